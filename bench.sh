@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Throughput of a Server engine (default: the multi-reactor EventLoop) for an increasing number
+# of threads; mode may name the engine (epoll, io_uring or threads).
+# Usage: ./bench.sh [path/to/main] [max_threads] [duration_s] [engine] [et] [cache]
+# Uses wrk when available, otherwise falls back to the curl loop from test.sh.
+
+main=${1:-./build/main}
+max_loops=${2:-$(nproc)}
+duration=${3:-10}
+mode="${*:4}"
+url=http://127.0.0.1:8080/
+
+run_load() {
+  if command -v wrk >/dev/null; then
+    wrk -t"$(nproc)" -c256 -d"${duration}s" "$url" | awk '/Requests\/sec/ {print $2}'
+  else
+    start=`date +%s.%N`
+    for i in $(seq 1 "$(nproc)");do
+    (
+      for j in {1..2000};do
+        curl -s -o /dev/null "$url"
+      done
+    ) &
+    done
+    wait
+    end=`date +%s.%N`
+    awk "BEGIN {printf \"%d\", $(nproc) * 2000 / ($end - $start)}"
+  fi
+}
+
+printf "%-10s %s\n" "threads" "requests/s"
+loops=1
+while [ "$loops" -le "$max_loops" ];do
+  "$main" "$loops" $mode >/dev/null &
+  pid=$!
+  sleep 0.5
+  printf "%-10s %s\n" "$loops" "$(run_load)"
+  kill "$pid"
+  wait "$pid" 2>/dev/null
+  loops=$((loops * 2))
+done
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+namespace mpmc {
+
+/**
+ * @brief Counters of a SlabPool.
+ *
+ * - blocks: blocks in all slabs allocated so far.
+ * - in_use, high_water: blocks currently acquired, and the most that ever were at once.
+ * - misses: acquire() calls the free list could not serve, each of which allocated a new slab.
+ * - oversized: Arena allocations too large for a block, served by operator new instead.
+ */
+struct PoolStats {
+    size_t block_size;
+    size_t blocks;
+    size_t in_use;
+    size_t high_water;
+    uint64_t misses;
+    uint64_t oversized;
+};
+
+/**
+ * @brief Fixed-size blocks carved out of large slabs, addressed by a dense block id.
+ *
+ * Slabs are allocated `slab_blocks` blocks at a time (the first one up front) and never freed
+ * before the pool, so block addresses are stable and the blocks of slab 0 are contiguous, e.g. to
+ * register them with io_uring. acquire() pops the free list and only allocates when it is empty.
+ *
+ * @note Not thread-safe, a pool belongs to the loop that uses it. get_stats() may be called from
+ * any thread.
+ *
+ * @example
+ * SlabPool pool(4096, 256);
+ * int id = pool.acquire();
+ * recv(fd, pool.at(id), pool.get_block_size(), 0);
+ * pool.release(id);
+ */
+class SlabPool {
+  private:
+    size_t block_size;
+    size_t slab_blocks;
+    std::vector<std::unique_ptr<char[]>> slabs;
+    std::vector<int> free_blocks;
+    std::atomic<size_t> blocks;
+    std::atomic<size_t> in_use;
+    std::atomic<size_t> high_water;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> oversized;
+
+    void grow();
+
+  public:
+    SlabPool(size_t block_size, size_t slab_blocks);
+    SlabPool(const SlabPool &other) = delete;
+    SlabPool &operator=(const SlabPool &other) = delete;
+
+    int acquire();
+    void release(int id);
+    char *at(int id) const;
+    char *slab(size_t index) const;
+    size_t get_block_size() const;
+    size_t get_slab_blocks() const;
+    void record_oversized();
+    PoolStats get_stats() const;
+};
+
+/**
+ * @brief Deleter of objects constructed by Arena::make().
+ */
+struct ArenaObjectDeleter {
+    template <typename T> void operator()(T *object) const { object->~T(); }
+};
+
+template <typename T> using ArenaObject = std::unique_ptr<T, ArenaObjectDeleter>;
+
+/**
+ * @brief Bump-pointer memory resource whose chunks are SlabPool blocks.
+ *
+ * The arena lives at the start of its first block, so creating and destroying one takes a block
+ * from the pool and gives it back without touching malloc. Allocations are carved from the
+ * current chunk and deallocate() is a no-op; allocations larger than half a block go to operator
+ * new and are freed by deallocate(), so containers that grow past a block do not pin chunks.
+ *
+ * reset() releases everything allocated since the last keep() (or since create()) in one step.
+ * It is meant to run between requests, once no container still holds memory from that region:
+ * release() the per-request containers first, then reset().
+ *
+ * Use it with std::pmr containers, which keep the arena as their allocator for their lifetime.
+ *
+ * @example
+ * ArenaPtr arena = Arena::create(pool);
+ * std::pmr::string input(arena.get());
+ * ...
+ * release(input);
+ * arena->reset();
+ */
+class Arena : public std::pmr::memory_resource {
+  private:
+    struct Chunk {
+        Chunk *next;
+        int id;
+    };
+
+    SlabPool *pool;
+    int id;
+    Chunk *chunks;
+    char *cursor;
+    char *limit;
+    Chunk *kept_chunks;
+    char *kept_cursor;
+    char *kept_limit;
+
+    Arena(SlabPool &pool, int id);
+    ~Arena() override;
+
+  protected:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *pointer, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+  public:
+    struct Deleter {
+        void operator()(Arena *arena) const;
+    };
+
+    static std::unique_ptr<Arena, Deleter> create(SlabPool &pool);
+
+    void keep();
+    void reset();
+
+    /**
+     * @brief Constructs an object in the arena. Its memory is reclaimed with the arena, the
+     * returned pointer only runs the destructor.
+     */
+    template <typename T, typename... Args> ArenaObject<T> make(Args &&...args);
+};
+
+using ArenaPtr = std::unique_ptr<Arena, Arena::Deleter>;
+
+template <typename T, typename... Args> ArenaObject<T> Arena::make(Args &&...args) {
+    void *memory = allocate(sizeof(T), alignof(T));
+    return ArenaObject<T>(new (memory) T(std::forward<Args>(args)...));
+}
+
+/**
+ * @brief Hands a std::pmr container's storage back to its memory resource. The container is left
+ * empty, still using the same resource.
+ */
+template <typename Container> void release(Container &container) {
+    Container released(std::move(container));
+    container.clear();
+}
+
+} // namespace mpmc
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace mpmc {
+
+namespace evtlp {
+
+enum class FdType : uint8_t { None, Listener, Client, Timer, Wakeup, Offload };
+
+constexpr uint32_t GENERATION_MASK = 0xffffff;
+
+/**
+ * @brief Packs an 8-bit tag, a 24-bit generation and the fd into one 64-bit token.
+ */
+inline uint64_t make_token(int fd, uint32_t generation, uint8_t tag) {
+    return (static_cast<uint64_t>(tag) << 56) |
+           (static_cast<uint64_t>(generation & GENERATION_MASK) << 32) |
+           static_cast<uint32_t>(fd);
+}
+
+inline int token_fd(uint64_t token) { return static_cast<int>(token & 0xffffffff); }
+inline uint32_t token_generation(uint64_t token) { return (token >> 32) & GENERATION_MASK; }
+inline uint8_t token_tag(uint64_t token) { return static_cast<uint8_t>(token >> 56); }
+
+/**
+ * @brief Dense per-fd table, indexed directly by the file descriptor.
+ *
+ * Every insert bumps the slot's generation. A token packs the fd, the generation and an 8-bit tag
+ * (the fd type for epoll, the operation for io_uring) into the 64 bits of epoll_event.data or
+ * io_uring user_data, so dispatch is one array access and completions for a closed fd whose
+ * number was already reused are detected by a generation mismatch.
+ *
+ * insert() default-constructs the entry, emplace() constructs it from its arguments. Entries are
+ * destroyed and constructed in place rather than assigned, so members whose allocator is bound at
+ * construction (std::pmr containers) get the one they are constructed with.
+ *
+ * @note insert() and emplace() may grow the table and invalidate references to other entries.
+ *
+ * @example
+ * ConnectionTable<Connection> table;
+ * table.insert(fd, FdType::Client);
+ * event.data.u64 = table.token(fd, static_cast<uint8_t>(FdType::Client));
+ * ...
+ * if (Connection *connection = table.find(event.data.u64)) { ... }
+ */
+template <typename T> class ConnectionTable {
+  private:
+    struct Slot {
+        T value;
+        uint32_t generation = 0;
+        FdType type = FdType::None;
+    };
+
+    std::vector<Slot> slots;
+    size_t count;
+
+  public:
+    ConnectionTable(size_t capacity = 1024);
+
+    T &insert(int fd, FdType type = FdType::Client);
+    template <typename... Args> T &emplace(int fd, FdType type, Args &&...args);
+    void erase(int fd);
+    T *get(int fd);
+    T *find(uint64_t token);
+    FdType type(int fd) const;
+    uint64_t token(int fd, uint8_t tag) const;
+    size_t size() const;
+    template <typename Callback> void for_each(Callback callback);
+};
+
+template <typename T> ConnectionTable<T>::ConnectionTable(size_t capacity) : count(0) {
+    slots.reserve(capacity);
+}
+
+template <typename T> T &ConnectionTable<T>::insert(int fd, FdType type) {
+    return emplace(fd, type);
+}
+
+template <typename T>
+template <typename... Args>
+T &ConnectionTable<T>::emplace(int fd, FdType type, Args &&...args) {
+    if (static_cast<size_t>(fd) >= slots.size()) {
+        slots.resize(std::max(static_cast<size_t>(fd) + 1, slots.size() * 2));
+    }
+    Slot &slot = slots[fd];
+    if (slot.type == FdType::None) {
+        ++count;
+    }
+    T value(std::forward<Args>(args)...);
+    slot.value.~T();
+    new (&slot.value) T(std::move(value));
+    slot.generation = (slot.generation + 1) & GENERATION_MASK;
+    slot.type = type;
+    return slot.value;
+}
+
+template <typename T> void ConnectionTable<T>::erase(int fd) {
+    if (static_cast<size_t>(fd) >= slots.size() || slots[fd].type == FdType::None) {
+        return;
+    }
+    slots[fd].value.~T();
+    new (&slots[fd].value) T();
+    slots[fd].type = FdType::None;
+    --count;
+}
+
+template <typename T> T *ConnectionTable<T>::get(int fd) {
+    if (fd < 0 || static_cast<size_t>(fd) >= slots.size() || slots[fd].type == FdType::None) {
+        return nullptr;
+    }
+    return &slots[fd].value;
+}
+
+template <typename T> T *ConnectionTable<T>::find(uint64_t token) {
+    int fd = token_fd(token);
+    if (fd < 0 || static_cast<size_t>(fd) >= slots.size()) {
+        return nullptr;
+    }
+    Slot &slot = slots[fd];
+    if (slot.type == FdType::None || slot.generation != token_generation(token)) {
+        return nullptr;
+    }
+    return &slot.value;
+}
+
+template <typename T> FdType ConnectionTable<T>::type(int fd) const {
+    if (fd < 0 || static_cast<size_t>(fd) >= slots.size()) {
+        return FdType::None;
+    }
+    return slots[fd].type;
+}
+
+template <typename T> uint64_t ConnectionTable<T>::token(int fd, uint8_t tag) const {
+    return make_token(fd, slots[fd].generation, tag);
+}
+
+template <typename T> size_t ConnectionTable<T>::size() const { return count; }
+
+template <typename T>
+template <typename Callback>
+void ConnectionTable<T>::for_each(Callback callback) {
+    for (size_t fd = 0; fd < slots.size(); ++fd) {
+        if (slots[fd].type != FdType::None) {
+            callback(static_cast<int>(fd), slots[fd].value);
+        }
+    }
+}
+
+} // namespace evtlp
+
+} // namespace mpmc
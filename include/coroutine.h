@@ -0,0 +1,324 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "network.h"
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <linux/time_types.h>
+#include <liburing.h>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <sys/socket.h>
+#include <utility>
+#include <vector>
+
+namespace mpmc {
+
+namespace evtlp {
+
+class RingEventLoop;
+
+/**
+ * @brief Coroutine frame allocator: one SlabPool per size class.
+ *
+ * Each frame is preceded by a header naming the pool and block it came from, so a frame is
+ * returned to its pool wherever it is destroyed. Frames larger than the largest class go to
+ * operator new. allocate() uses the pool of the RingEventLoop running on the calling thread;
+ * frames created on any other thread come from operator new, see Scope.
+ *
+ * @note Not thread-safe, like SlabPool: a pool belongs to its loop.
+ */
+class FramePool {
+  private:
+    struct alignas(std::max_align_t) Header {
+        SlabPool *pool;
+        int id;
+    };
+
+    static constexpr size_t CLASSES[] = {256, 512, 1024, 2048, 4096};
+    static constexpr size_t SLAB_BLOCKS = 64;
+    std::vector<std::unique_ptr<SlabPool>> pools;
+    static thread_local FramePool *current;
+
+  public:
+    /**
+     * @brief Makes `pool` the one allocate() uses on this thread until the scope ends.
+     */
+    class Scope {
+      private:
+        FramePool *previous;
+
+      public:
+        Scope(FramePool &pool);
+        ~Scope();
+        Scope(const Scope &other) = delete;
+        Scope &operator=(const Scope &other) = delete;
+    };
+
+    FramePool();
+    FramePool(const FramePool &other) = delete;
+    FramePool &operator=(const FramePool &other) = delete;
+
+    static void *allocate(size_t size);
+    static void deallocate(void *frame);
+    std::vector<PoolStats> get_stats() const;
+};
+
+/**
+ * @brief State shared by the promises of every AsyncTask.
+ *
+ * A task runs when it is awaited, and resumes the awaiting coroutine when it finishes. A task
+ * spawned on a loop (see RingEventLoop::spawn()) has nobody to resume: the loop keeps it on a
+ * list, and it destroys itself when it finishes. An exception escaping it is printed.
+ */
+class PromiseBase {
+  private:
+    friend class RingEventLoop;
+
+    std::coroutine_handle<> continuation;
+    std::coroutine_handle<> self;
+    PromiseBase **roots = nullptr;
+    PromiseBase *prev = nullptr;
+    PromiseBase *next = nullptr;
+
+    std::coroutine_handle<> finish();
+    void link(PromiseBase **roots, std::coroutine_handle<> self);
+
+  protected:
+    std::exception_ptr error;
+
+    void rethrow();
+
+  public:
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise().finish();
+        }
+        void await_resume() const noexcept {}
+    };
+
+    PromiseBase() = default;
+    PromiseBase(const PromiseBase &other) = delete;
+    PromiseBase &operator=(const PromiseBase &other) = delete;
+    ~PromiseBase();
+
+    static void *operator new(size_t size) { return FramePool::allocate(size); }
+    static void operator delete(void *frame) { FramePool::deallocate(frame); }
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+    void set_continuation(std::coroutine_handle<> handle) { continuation = handle; }
+};
+
+template <typename T> class AsyncTask;
+
+template <typename T> class AsyncPromise : public PromiseBase {
+  private:
+    std::optional<T> value;
+
+  public:
+    AsyncTask<T> get_return_object();
+    template <typename U> void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+    T result() {
+        rethrow();
+        return std::move(*value);
+    }
+};
+
+template <> class AsyncPromise<void> : public PromiseBase {
+  public:
+    AsyncTask<void> get_return_object();
+    void return_void() {}
+    void result() { rethrow(); }
+};
+
+/**
+ * @brief Lazily started coroutine returning T, run by co_await-ing it. Its frame comes from the
+ * FramePool of the running loop.
+ *
+ * The awaiting coroutine is resumed directly (symmetric transfer) once the task finishes, and
+ * co_await returns its result or rethrows its exception. A task that is destroyed, e.g. with the
+ * coroutine awaiting it, destroys its frame and, recursively, the tasks that frame awaits.
+ *
+ * @example
+ * AsyncTask<size_t> count_lines(AsyncConnection &connection) {
+ *     size_t lines = 0;
+ *     for (std::string_view data; !(data = co_await connection.recv()).empty();) {
+ *         lines += std::count(data.begin(), data.end(), '\n');
+ *     }
+ *     co_return lines;
+ * }
+ */
+template <typename T = void> class [[nodiscard]] AsyncTask {
+  public:
+    using promise_type = AsyncPromise<T>;
+
+  private:
+    std::coroutine_handle<promise_type> handle;
+
+  public:
+    explicit AsyncTask(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    AsyncTask(AsyncTask &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    AsyncTask &operator=(AsyncTask &&other) noexcept;
+    AsyncTask(const AsyncTask &other) = delete;
+    AsyncTask &operator=(const AsyncTask &other) = delete;
+    ~AsyncTask();
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().set_continuation(caller);
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+    /**
+     * @brief Gives up ownership of the coroutine, which is then destroyed by whoever took it.
+     */
+    std::coroutine_handle<promise_type> release() { return std::exchange(handle, nullptr); }
+};
+
+template <typename T> AsyncTask<T> &AsyncTask<T>::operator=(AsyncTask &&other) noexcept {
+    if (this != &other) {
+        if (handle) {
+            handle.destroy();
+        }
+        handle = std::exchange(other.handle, nullptr);
+    }
+    return *this;
+}
+
+template <typename T> AsyncTask<T>::~AsyncTask() {
+    if (handle) {
+        handle.destroy();
+    }
+}
+
+template <typename T> AsyncTask<T> AsyncPromise<T>::get_return_object() {
+    return AsyncTask<T>(std::coroutine_handle<AsyncPromise<T>>::from_promise(*this));
+}
+
+inline AsyncTask<void> AsyncPromise<void>::get_return_object() {
+    return AsyncTask<void>(std::coroutine_handle<AsyncPromise<void>>::from_promise(*this));
+}
+
+/**
+ * @brief Base of the awaiters of one io_uring operation.
+ *
+ * await_suspend() prepares an SQE from get_sqe() and passes it to resume_with(), which stores the
+ * awaiting coroutine's handle in its user_data. The loop resumes the coroutine with the
+ * completion, and await_resume() returns the completion's result (bytes, or -errno). Anything
+ * the kernel reads or writes lives in the awaiter, which stays in the suspended coroutine's frame.
+ */
+class OperationAwaiter {
+  protected:
+    RingEventLoop *loop;
+
+    io_uring_sqe *get_sqe() const;
+    void resume_with(io_uring_sqe *sqe, std::coroutine_handle<> handle) const;
+
+  public:
+    OperationAwaiter(RingEventLoop *loop) : loop(loop) {}
+
+    bool await_ready() const noexcept { return false; }
+    int await_resume() const;
+};
+
+class RecvAwaiter : public OperationAwaiter {
+  private:
+    int fd;
+    char *buffer;
+    size_t size;
+
+  public:
+    RecvAwaiter(RingEventLoop *loop, int fd, char *buffer, size_t size)
+        : OperationAwaiter(loop), fd(fd), buffer(buffer), size(size) {}
+
+    void await_suspend(std::coroutine_handle<> handle);
+    std::string_view await_resume() const;
+};
+
+class SendAwaiter : public OperationAwaiter {
+  private:
+    int fd;
+    const msghdr *message;
+
+  public:
+    SendAwaiter(RingEventLoop *loop, int fd, const msghdr *message)
+        : OperationAwaiter(loop), fd(fd), message(message) {}
+
+    void await_suspend(std::coroutine_handle<> handle);
+};
+
+class SleepAwaiter : public OperationAwaiter {
+  private:
+    __kernel_timespec timeout;
+
+  public:
+    SleepAwaiter(RingEventLoop *loop, int ms);
+
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const {}
+};
+
+/**
+ * @brief Suspends the calling coroutine for `ms` milliseconds with an io_uring timeout. Must be
+ * awaited on the thread running a RingEventLoop.
+ */
+SleepAwaiter sleep_for(int ms);
+
+/**
+ * @brief Client connection served by a coroutine handler (see RingEventLoop::set_async_handler()).
+ *
+ * Every operation is one io_uring SQE whose completion resumes the handler where it waits:
+ * - recv(): the next bytes received into the connection's buffer, a SlabPool block of the loop;
+ *   empty once the peer closed the connection or on error. The view is valid until the next
+ *   recv() and awaiting it allocates nothing.
+ * - send(data), flush(): send all of `data`, or everything in get_writer(), with sendmsg. false if
+ *   the connection failed.
+ * - read_request(): receives until one complete request is buffered, which request() then views
+ *   until the next read_request(). Pipelined requests are answered one after the other. false
+ *   once the connection is closed, or after a malformed request was answered with its error.
+ * The input, parser and writer allocate from an Arena of the loop, reset between requests while
+ * the connection is idle, as for the loop's own connections. The fd is closed with the
+ * connection, which lives in the frame of the coroutine that serves it.
+ *
+ * @note Only one operation may be in flight at a time, and the connection must be used on the
+ * thread of its loop.
+ */
+class AsyncConnection {
+  private:
+    RingEventLoop *loop;
+    int fd;
+    int buffer_id;
+    ArenaPtr arena;
+    std::pmr::string input;
+    RequestParser parser;
+    ResponseWriter writer;
+    size_t consumed;
+
+    void recycle();
+
+  public:
+    AsyncConnection(RingEventLoop *loop, int fd);
+    ~AsyncConnection();
+    AsyncConnection(const AsyncConnection &other) = delete;
+    AsyncConnection &operator=(const AsyncConnection &other) = delete;
+
+    int get_fd() const;
+    ResponseWriter &get_writer();
+    RequestView request();
+
+    RecvAwaiter recv();
+    AsyncTask<bool> send(std::string_view data);
+    AsyncTask<bool> flush();
+    AsyncTask<bool> read_request();
+};
+
+} // namespace evtlp
+
+} // namespace mpmc
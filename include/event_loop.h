@@ -1,12 +1,27 @@
 #pragma once
 
+#include "buffer_pool.h"
+#include "connection_table.h"
+#include "coroutine.h"
 #include "network.h"
+#include "offload.h"
+#include "router.h"
+#include "timer_wheel.h"
 #include <any>
 #include <arpa/inet.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <sys/socket.h>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <liburing.h>
 #include <sys/epoll.h>
 
@@ -14,60 +29,459 @@ namespace mpmc {
 
 namespace evtlp {
 
+/**
+ * @brief Client connections registered with one epoll instance, shared by EventLoop and
+ * SubEventLoop.
+ *
+ * Serves persistent, pipelined connections: EPOLLOUT is armed only while output is pending, a
+ * streamed or offloaded response holds back the requests behind it, and each connection has one
+ * idle/request timer and its own Arena, reset while it is idle.
+ */
+class EpollConnections {
+  private:
+    struct Connection {
+        ArenaPtr arena;
+        std::pmr::string input;
+        RequestParser parser;
+        ResponseWriter writer;
+        std::deque<OutputChunk> output;
+        std::unique_ptr<BodyStream> stream;
+        size_t output_bytes = 0;
+        uint32_t events = 0;
+        TimerId timer = 0;
+        bool request_pending = false;
+        bool closing = false;
+        bool waiting = false;
+
+        Connection() = default;
+        Connection(ArenaPtr arena, size_t header_limit, size_t body_limit)
+            : arena(std::move(arena)), input(this->arena.get()),
+              parser(header_limit, body_limit, this->arena.get()), writer(this->arena.get()) {}
+
+        size_t pending() const { return output_bytes + writer.size(); }
+    };
+
+    SlabPool arenas;
+    ConnectionTable<Connection> connections;
+    std::atomic<size_t> active;
+    static constexpr int BUFFER_SIZE = 4096;
+    static constexpr size_t ARENA_BLOCK_SIZE = 4096;
+    static constexpr size_t ARENA_SLAB_BLOCKS = 64;
+    static constexpr size_t OUTPUT_HIGH_WATER = 256 * 1024;
+    static constexpr size_t STREAM_CHUNK = 16 * 1024;
+    static constexpr int STREAM_BATCH = 16;
+    int epoll_fd;
+    bool edge_triggered;
+    TimerWheel &timers;
+    const Router *router;
+    size_t header_limit;
+    size_t body_limit;
+    int idle_timeout;
+    int request_timeout;
+    TaskPool *pool;
+    std::shared_ptr<OffloadQueue> offloads;
+    std::vector<OffloadResult> completed;
+
+    void queue(Connection &connection, OutputChunk chunk);
+    bool settle(int fd, Connection &connection, bool alive);
+    bool receive(int fd, Connection &connection);
+    bool flush(int fd, Connection &connection);
+    bool flush_output(int fd, Connection &connection);
+    void process(int fd, Connection &connection);
+    void produce(int fd, Connection &connection);
+    void update_events(int fd, Connection &connection);
+    void update_timer(int fd, Connection &connection);
+    void recycle(Connection &connection);
+    void complete(OffloadResult &result);
+
+  public:
+    EpollConnections(int epoll_fd, bool edge_triggered, TimerWheel &timers);
+    ~EpollConnections();
+
+    void set_timeouts(int idle_timeout, int request_timeout);
+    void set_router(const Router *router);
+    void set_request_limits(size_t header_limit, size_t body_limit);
+    void set_task_pool(TaskPool *pool);
+    void complete_offloads();
+    void add(int fd);
+    void remove(int fd);
+    size_t size() const;
+    PoolStats get_arena_stats() const;
+    bool handle(uint64_t token, uint32_t events);
+    void write(int fd, const std::string &data);
+};
+
+/**
+ * @brief Worker reactor owning a subset of the client connections.
+ *
+ * @note add_client() and client_count() may be called from the acceptor thread. Handed-off fds
+ * are queued and registered by the thread executing run(), which owns everything else.
+ */
 class SubEventLoop {
   private:
+    std::mutex mutex;
+    std::vector<int> pending_fd;
+    std::atomic<size_t> num_pending;
+    std::atomic<bool> running;
+    int events_length;
     int epoll_fd;
-    std::unordered_set<int> client_fd;
+    int wakeup_fd;
+    TimerWheel timers;
+    EpollConnections clients;
+
+    void add_pending();
 
   public:
-    SubEventLoop();
+    SubEventLoop(bool edge_triggered = false, int events_length = 256);
     ~SubEventLoop();
 
+    void set_timeouts(int idle_timeout, int request_timeout);
+    void set_router(const Router *router);
+    void set_request_limits(size_t header_limit, size_t body_limit);
+    void set_task_pool(TaskPool *pool);
     void add_client(int fd);
     void remove_client(int fd);
+    size_t client_count();
+    PoolStats get_arena_stats() const;
     void run();
     void stop();
 };
 
+/**
+ * @brief io_uring setup options of a RingEventLoop, each best effort (see get_config()).
+ *
+ * - entries: submission queue size.
+ * - sqpoll, sq_thread_idle, sq_thread_cpu: kernel SQ polling thread, its idle ms and its CPU.
+ * - single_issuer: only the creating thread uses the ring.
+ * - defer_taskrun, coop_taskrun: run completion work when the loop waits (not with sqpoll).
+ * - register_files, max_files: sparse registered file table for client sockets, slot == fd.
+ * - provided_buffers: multishot recv from a kernel-provided buffer ring.
+ * - fixed_buffers: register the per-connection receive pool and read it with READ_FIXED.
+ */
+struct RingConfig {
+    unsigned entries = 512;
+    bool sqpoll = false;
+    unsigned sq_thread_idle = 1000;
+    int sq_thread_cpu = -1;
+    bool single_issuer = true;
+    bool defer_taskrun = true;
+    bool coop_taskrun = true;
+    bool register_files = true;
+    unsigned max_files = 65536;
+    bool provided_buffers = true;
+    bool fixed_buffers = true;
+};
+
+/**
+ * @brief Coroutine serving one connection of a RingEventLoop, see set_async_handler().
+ */
+using AsyncHandler = std::function<AsyncTask<>(AsyncConnection &connection)>;
+
+/**
+ * @brief Single-threaded io_uring reactor.
+ *
+ * Listeners use multishot accept and clients multishot recv into a shared buffer ring (see
+ * RingConfig). Completions are routed by a ConnectionTable token tagged with the Operation. With
+ * set_async_handler() each connection is served by a coroutine instead, see AsyncConnection.
+ *
+ * @note With single_issuer (the default) the loop must be run on the thread that constructed it.
+ *
+ * @example
+ * RingEventLoop loop;
+ * loop.listen("127.0.0.1", 8080);
+ * loop.set_async_handler([](AsyncConnection &connection) -> AsyncTask<> {
+ *     while (co_await connection.read_request()) {
+ *         bool keep_alive = connection.request().keep_alive();
+ *         connection.get_writer().error(StatusCode::OK, keep_alive);
+ *         if (!co_await connection.flush() || !keep_alive) {
+ *             break;
+ *         }
+ *     }
+ * });
+ * loop.run();
+ */
 class RingEventLoop {
   private:
-    std::unordered_map<int, std::pair<sockaddr_in, socklen_t>> socket_map;
-    std::unordered_map<int, char*> client_buffers;
-    static constexpr int QUEUE_LENGTH = 512;
+    enum Operation : uint8_t {
+        ACCEPT,
+        RECV,
+        SEND,
+        SENDMSG,
+        SEND_ZC,
+        SPLICE_IN,
+        SPLICE_OUT,
+        CANCEL,
+        WAKEUP,
+        OFFLOAD,
+        ACCEPT_RETRY,
+        RESUME
+    };
+
+    friend class AsyncConnection;
+    friend class OperationAwaiter;
+
+    /**
+     * @brief Responses are written to `filling` while `sending` is in flight. Constructed in the
+     * connection's arena, so the buffers and msghdr the kernel reads stay put when the table grows.
+     */
+    struct Writers {
+        ResponseWriter filling;
+        ResponseWriter sending;
+        msghdr message;
+
+        Writers(std::pmr::memory_resource *resource) : filling(resource), sending(resource) {}
+    };
+
+    struct Connection {
+        ArenaPtr arena;
+        std::pmr::string input;
+        RequestParser parser;
+        ArenaObject<Writers> writers;
+        std::deque<OutputChunk> output;
+        std::vector<std::string> retired;
+        std::unique_ptr<BodyStream> stream;
+        size_t output_bytes = 0;
+        size_t piped = 0;
+        int pipe_fds[2] = {-1, -1};
+        int notifications = 0;
+        int buffer_id = -1;
+        bool fixed_file = false;
+        bool reading = false;
+        bool paused = false;
+        bool sending = false;
+        bool closing = false;
+        bool close_after_stream = false;
+        bool waiting = false;
+
+        Connection() = default;
+        Connection(ArenaPtr arena, size_t header_limit, size_t body_limit)
+            : arena(std::move(arena)), input(this->arena.get()),
+              parser(header_limit, body_limit, this->arena.get()),
+              writers(this->arena->make<Writers>(this->arena.get())) {
+            // The writers live as long as the connection, reset() only drops what follows.
+            this->arena->keep();
+        }
+    };
+
     static constexpr int BUFFER_SIZE = 1024;
+    static constexpr int BUFFER_COUNT = 1024;
+    static constexpr int BUFFER_GROUP = 0;
+    static constexpr size_t ARENA_BLOCK_SIZE = 4096;
+    static constexpr size_t ARENA_SLAB_BLOCKS = 64;
+    static constexpr size_t OUTPUT_HIGH_WATER = 256 * 1024;
+    static constexpr size_t ZEROCOPY_THRESHOLD = 16 * 1024;
+    static constexpr size_t PIPE_CHUNK = 64 * 1024;
+    static constexpr size_t STREAM_CHUNK = 32 * 1024;
+    RingConfig config;
+    unsigned setup_flags;
+    SlabPool buffers;
+    SlabPool arenas;
+    std::unordered_map<int, std::pair<sockaddr_in, socklen_t>> socket_map;
+    ConnectionTable<Connection> connection_table;
+    io_uring_buf_ring *buf_ring;
+    bool zerocopy;
+    std::atomic<uint64_t> connections;
+    std::atomic<uint64_t> requests;
+    std::atomic<bool> running;
+    const Router *router;
+    ListenOptions listen_options;
+    size_t header_limit;
+    size_t body_limit;
+    int wakeup_fd;
+    uint64_t wakeup_value;
+    TaskPool *pool;
+    std::shared_ptr<OffloadQueue> offloads;
+    std::vector<OffloadResult> completed;
+    uint64_t offload_value;
+    __kernel_timespec accept_backoff;
+    static constexpr int ACCEPT_BACKOFF_MS = 100;
+    FramePool frames;
+    PromiseBase *roots;
+    AsyncHandler async_handler;
+    int completion_result;
+    static constexpr uint64_t ADDRESS_MASK = (uint64_t(1) << 56) - 1;
+    static thread_local RingEventLoop *current;
     io_uring ring;
 
+    uint64_t make_user_data(Operation op, int fd);
+    io_uring_sqe *get_sqe();
+    void setup_ring();
+    void setup_buffers();
+    void register_file(int fd);
+    void unregister_file(int fd);
+    unsigned file_flags(int fd);
+    void prepare_wakeup();
+    void prepare_offload();
+    void complete_offloads();
+    void complete(OffloadResult &result);
+    int take_buffer(int fd, uint32_t flags);
+    void recycle_buffer(int buffer_id);
+    void enqueue(int fd, OutputChunk chunk);
+    void send_file(int fd, const FileResponse &response);
+    bool has_output(const Connection &connection) const;
+    size_t pending_output(const Connection &connection) const;
+    void prepare_send(int fd);
+    void send_complete(int fd, Operation op, int n, uint32_t flags);
+    void pause_read(int fd);
+    void process(int fd);
+    bool produce(int fd);
+    void close_after_send(int fd);
+    void maybe_close(int fd);
+    void recycle(Connection &connection);
+    AsyncTask<> serve_async(int fd);
+
   public:
-    RingEventLoop();
+    RingEventLoop(const RingConfig &config = RingConfig());
     ~RingEventLoop();
 
-    void listen(const char *ip, int port);
+    void listen(const char *ip, int port, bool reuse_port = false);
+    void set_listen_options(const ListenOptions &options);
     void prepare_accept(int socket_fd);
-    void accept(int socket_fd, int client_fd);
+    void prepare_accept_retry(int socket_fd);
+    void accept(int client_fd);
     void prepare_read(int client_fd);
     bool read(int fd, int n);
-    void write(int fd, const std::string &data);
+    void write(int fd, std::string data);
+    void set_router(const Router *router);
+    void set_request_limits(size_t header_limit, size_t body_limit);
+    void set_task_pool(TaskPool *pool);
+    void set_async_handler(AsyncHandler handler);
+    void spawn(AsyncTask<> task);
+    static RingEventLoop *get_current();
+    uint64_t get_connections() const;
+    uint64_t get_requests() const;
+    PoolStats get_buffer_stats() const;
+    PoolStats get_arena_stats() const;
+    std::vector<PoolStats> get_frame_stats() const;
+    const RingConfig &get_config() const;
+    unsigned get_setup_flags() const;
     void run();
+    void stop();
 };
 
+/**
+ * @brief N independent RingEventLoop shards, one thread and one io_uring each.
+ *
+ * Every shard binds its own SO_REUSEPORT listener to the same address so the kernel spreads
+ * incoming connections; shards share nothing but the TaskPool of offloaded routes, if one is
+ * set. Each ring is created on the thread that drives it, all with the same RingConfig.
+ *
+ * @example
+ * ShardedRingEventLoop loop(std::thread::hardware_concurrency(), true);
+ * loop.listen("127.0.0.1", 8080);
+ * loop.run();
+ */
+class ShardedRingEventLoop {
+  public:
+    struct ShardStats {
+        int cpu;
+        uint64_t connections;
+        uint64_t requests;
+        PoolStats buffers;
+        PoolStats arenas;
+    };
+
+  private:
+    std::mutex mutex;
+    std::condition_variable ready_cond;
+    std::vector<RingEventLoop *> shards;
+    std::vector<std::thread> threads;
+    std::vector<std::pair<std::string, int>> addresses;
+    std::exception_ptr error;
+    RingConfig config;
+    const Router *router;
+    TaskPool *pool;
+    AsyncHandler async_handler;
+    ListenOptions listen_options;
+    size_t header_limit;
+    size_t body_limit;
+    int num_shards;
+    bool pin_cpus;
+    int ready_count;
+    bool stopped;
+
+    void run_shard(int index);
+
+  public:
+    ShardedRingEventLoop(int num_shards, bool pin_cpus = false,
+                         const RingConfig &config = RingConfig());
+    ~ShardedRingEventLoop();
+
+    void listen(const char *ip, int port);
+    void set_listen_options(const ListenOptions &options);
+    void set_router(const Router *router);
+    void set_request_limits(size_t header_limit, size_t body_limit);
+    void set_task_pool(TaskPool *pool);
+    void set_async_handler(AsyncHandler handler);
+    std::vector<ShardStats> stats();
+    void run();
+    void stop();
+};
+
+/**
+ * @brief Main reactor.
+ *
+ * With sub_loops == 0 every connection is served on the thread calling run(). Otherwise the loop
+ * only accepts and hands each client to the least-loaded of `sub_loops` SubEventLoop threads.
+ * With edge_triggered the listeners and all clients are registered with EPOLLET. Each
+ * epoll_wait returns up to events_length events.
+ *
+ * Timers and per-connection timeouts (default 60s idle, 30s per request, see set_timeouts()) run
+ * on one TimerWheel per loop. Requests are answered by the Router given to set_router(), which
+ * must outlive the loop; without one every request gets 404. Offloaded routes run on the TaskPool
+ * given to set_task_pool(), shared by all loops, each getting its results back on its own
+ * thread (see EpollConnections); without one they run on the loop. Request size limits default
+ * to those of RequestParser. set_timeouts(), set_router(), set_task_pool() and
+ * set_request_limits() must be called before run(), set_listen_options() before listen().
+ * get_arena_stats() reports the connection arena pool of this loop followed by those of the sub
+ * loops. A sub loop that fails stops the others, and run() rethrows its exception.
+ *
+ * @example
+ * EventLoop loop(std::thread::hardware_concurrency());
+ * loop.listen("127.0.0.1", 8080);
+ * loop.run();
+ */
 class EventLoop {
   private:
     std::unordered_set<int> socket_fd;
-    std::unordered_map<int, int> timer_timeouts;
-    std::unordered_map<int, std::function<void()>> timer_callbacks;
-    static constexpr int EVENTS_LENGTH = 10;
+    std::vector<SubEventLoop *> sub_loops;
+    std::vector<std::thread> sub_threads;
+    std::mutex mutex;
+    // The first failure of a sub loop, rethrown by run().
+    std::exception_ptr error;
+    size_t next_loop;
+    std::atomic<bool> running;
+    int events_length;
+    bool edge_triggered;
     int epoll_fd;
+    int wakeup_fd;
+    ListenOptions listen_options;
+    TimerWheel timers;
+    EpollConnections clients;
+
+    static constexpr int ACCEPT_BACKOFF_MS = 100;
+
+    SubEventLoop *pick_sub_loop();
+    void join_sub_loops();
+    void arm_listener(int fd, bool armed);
+    void pause_accept(int fd);
 
   public:
-    EventLoop();
+    EventLoop(int sub_loops = 0, bool edge_triggered = false, int events_length = 256);
     ~EventLoop();
 
     void listen(const char *ip, int port);
+    void set_listen_options(const ListenOptions &options);
     void accept(int fd);
-    bool read(int fd, char *buffer, int size);
     void write(int fd, const std::string &data);
-    void add_timer(int timeout, std::function<void()> callback);
-    void read_timer(int fd);
+    void set_timeouts(int idle_timeout, int request_timeout);
+    void set_router(const Router *router);
+    void set_request_limits(size_t header_limit, size_t body_limit);
+    void set_task_pool(TaskPool *pool);
+    TimerId add_timer(int timeout, std::function<void()> callback, bool periodic = true);
+    bool cancel_timer(TimerId id);
+    bool reschedule_timer(TimerId id, int timeout);
+    std::vector<PoolStats> get_arena_stats();
     void run();
     void stop();
 };
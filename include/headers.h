@@ -0,0 +1,405 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace mpmc {
+
+/**
+ * @brief Header fields the server and typical clients use, resolved once when a header is added
+ * so that reading them later is an array access.
+ */
+enum class HeaderId : uint8_t {
+    Unknown,
+    Accept,
+    AcceptCharset,
+    AcceptEncoding,
+    AcceptLanguage,
+    AcceptRanges,
+    Age,
+    Allow,
+    Authorization,
+    CacheControl,
+    Connection,
+    ContentDisposition,
+    ContentEncoding,
+    ContentLanguage,
+    ContentLength,
+    ContentLocation,
+    ContentRange,
+    ContentType,
+    Cookie,
+    Date,
+    ETag,
+    Expect,
+    Expires,
+    Forwarded,
+    From,
+    Host,
+    IfMatch,
+    IfModifiedSince,
+    IfNoneMatch,
+    IfRange,
+    IfUnmodifiedSince,
+    KeepAlive,
+    LastModified,
+    Location,
+    Origin,
+    Pragma,
+    ProxyAuthorization,
+    Range,
+    Referer,
+    RetryAfter,
+    SecWebSocketKey,
+    Server,
+    SetCookie,
+    TE,
+    Trailer,
+    TransferEncoding,
+    Upgrade,
+    UserAgent,
+    Vary,
+    Via,
+    WWWAuthenticate,
+    XForwardedFor,
+    XForwardedProto,
+    XRequestedWith
+};
+
+constexpr std::string_view HEADER_NAMES[] = {
+    "",
+    "Accept",
+    "Accept-Charset",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Accept-Ranges",
+    "Age",
+    "Allow",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Disposition",
+    "Content-Encoding",
+    "Content-Language",
+    "Content-Length",
+    "Content-Location",
+    "Content-Range",
+    "Content-Type",
+    "Cookie",
+    "Date",
+    "ETag",
+    "Expect",
+    "Expires",
+    "Forwarded",
+    "From",
+    "Host",
+    "If-Match",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "If-Unmodified-Since",
+    "Keep-Alive",
+    "Last-Modified",
+    "Location",
+    "Origin",
+    "Pragma",
+    "Proxy-Authorization",
+    "Range",
+    "Referer",
+    "Retry-After",
+    "Sec-WebSocket-Key",
+    "Server",
+    "Set-Cookie",
+    "TE",
+    "Trailer",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "Vary",
+    "Via",
+    "WWW-Authenticate",
+    "X-Forwarded-For",
+    "X-Forwarded-Proto",
+    "X-Requested-With",
+};
+
+constexpr size_t HEADER_ID_COUNT = sizeof(HEADER_NAMES) / sizeof(HEADER_NAMES[0]);
+
+static_assert(HEADER_ID_COUNT == static_cast<size_t>(HeaderId::XRequestedWith) + 1,
+              "every HeaderId needs a name");
+
+/**
+ * @brief Canonical spelling of a well-known header name, "" for HeaderId::Unknown.
+ */
+constexpr std::string_view header_name(HeaderId id) {
+    return HEADER_NAMES[static_cast<size_t>(id)];
+}
+
+constexpr char ascii_lower(char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+constexpr bool equals_ignore_case(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (ascii_lower(a[i]) != ascii_lower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Perfect hash from well-known header names to HeaderId, built at compile time.
+ *
+ * The hash only mixes the length and the first, middle and last characters (case-folded), which
+ * are distinct for every name in HEADER_NAMES. The constructor tries seeds until no two names
+ * share one of the SLOTS slots, so a lookup is one hash, one slot and one comparison that rejects
+ * names which are not well-known.
+ */
+class HeaderIds {
+  private:
+    static constexpr size_t SLOTS = 256;
+    uint32_t seed = 0;
+    HeaderId slots[SLOTS] = {};
+
+    static constexpr size_t hash(std::string_view name, uint32_t seed) {
+        const unsigned char keys[] = {
+            static_cast<unsigned char>(name.size()),
+            static_cast<unsigned char>(name[0] | 0x20),
+            static_cast<unsigned char>(name[name.size() / 2] | 0x20),
+            static_cast<unsigned char>(name[name.size() - 1] | 0x20),
+        };
+        uint32_t h = seed;
+        for (unsigned char key : keys) {
+            h = (h ^ key) * 16777619u;
+        }
+        return h >> 24;
+    }
+
+  public:
+    constexpr HeaderIds() {
+        for (uint32_t candidate = 2166136261u;; ++candidate) {
+            bool collision = false;
+            for (size_t slot = 0; slot < SLOTS; ++slot) {
+                slots[slot] = HeaderId::Unknown;
+            }
+            for (size_t id = 1; id < HEADER_ID_COUNT && !collision; ++id) {
+                HeaderId &slot = slots[hash(HEADER_NAMES[id], candidate)];
+                collision = slot != HeaderId::Unknown;
+                slot = static_cast<HeaderId>(id);
+            }
+            if (!collision) {
+                seed = candidate;
+                return;
+            }
+        }
+    }
+
+    constexpr HeaderId find(std::string_view name) const {
+        if (name.empty()) {
+            return HeaderId::Unknown;
+        }
+        HeaderId id = slots[hash(name, seed)];
+        return equals_ignore_case(header_name(id), name) ? id : HeaderId::Unknown;
+    }
+};
+
+inline constexpr HeaderIds header_ids;
+
+/**
+ * @brief The HeaderId of `name` in any case, or HeaderId::Unknown.
+ */
+constexpr HeaderId header_id(std::string_view name) { return header_ids.find(name); }
+
+static_assert(header_id("content-length") == HeaderId::ContentLength &&
+                  header_id("X-Forwarded-Proto") == HeaderId::XForwardedProto &&
+                  header_id("Content-Lengthy") == HeaderId::Unknown,
+              "header_id() must resolve every well-known name");
+
+/**
+ * @brief Flat list of header fields, stored inline up to INLINE_CAPACITY fields and in a vector
+ * beyond that.
+ *
+ * Fields keep their order and duplicates (e.g. Set-Cookie); get() returns the first match. Names
+ * are compared ignoring case. add() resolves the HeaderId of a name once and indexes the first
+ * field of each well-known id, so get(HeaderId) is an array access without string comparisons.
+ * clear() keeps the fields' storage, so a list that is refilled for every request stops
+ * allocating once it has seen its largest request.
+ *
+ * `String` is std::string for lists that own their fields (Request, Response) and
+ * std::string_view for the lists RequestParser hands out.
+ *
+ * @example
+ * HeaderList<std::string> headers;
+ * headers.add("content-type", "text/html");
+ * headers.get(HeaderId::ContentType); // "text/html"
+ * headers.get("Content-Type");        // "text/html"
+ */
+template <typename String, size_t INLINE_CAPACITY = 16> class HeaderList {
+  public:
+    struct Field {
+        HeaderId id = HeaderId::Unknown;
+        String name;
+        String value;
+    };
+
+    class Iterator {
+      private:
+        const HeaderList *list;
+        size_t index;
+
+      public:
+        Iterator(const HeaderList *list, size_t index) : list(list), index(index) {}
+        const Field &operator*() const { return (*list)[index]; }
+        const Field *operator->() const { return &(*list)[index]; }
+        Iterator &operator++() {
+            ++index;
+            return *this;
+        }
+        bool operator==(const Iterator &other) const { return index == other.index; }
+        bool operator!=(const Iterator &other) const { return index != other.index; }
+    };
+
+  private:
+    std::array<Field, INLINE_CAPACITY> fields;
+    std::vector<Field> overflow;
+    size_t count = 0;
+    // 1 + the position of the first field with each id, 0 when there is none.
+    std::array<uint32_t, HEADER_ID_COUNT> first = {};
+
+    Field &slot(size_t index);
+
+  public:
+    void add(HeaderId id, std::string_view name, std::string_view value);
+    void add(std::string_view name, std::string_view value);
+    void set(std::string_view name, std::string_view value);
+    const Field *find(HeaderId id) const;
+    const Field *find(std::string_view name) const;
+    std::string_view get(HeaderId id) const;
+    std::string_view get(std::string_view name) const;
+    const Field &operator[](size_t index) const;
+    size_t size() const;
+    bool empty() const;
+    void clear();
+    Iterator begin() const;
+    Iterator end() const;
+};
+
+template <typename String, size_t INLINE_CAPACITY>
+typename HeaderList<String, INLINE_CAPACITY>::Field &
+HeaderList<String, INLINE_CAPACITY>::slot(size_t index) {
+    if (index < INLINE_CAPACITY) {
+        return fields[index];
+    }
+    if (index - INLINE_CAPACITY == overflow.size()) {
+        overflow.emplace_back();
+    }
+    return overflow[index - INLINE_CAPACITY];
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+void HeaderList<String, INLINE_CAPACITY>::add(HeaderId id, std::string_view name,
+                                              std::string_view value) {
+    Field &field = slot(count);
+    field.id = id;
+    field.name = name;
+    field.value = value;
+    ++count;
+    uint32_t &position = first[static_cast<size_t>(id)];
+    if (id != HeaderId::Unknown && position == 0) {
+        position = count;
+    }
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+void HeaderList<String, INLINE_CAPACITY>::add(std::string_view name, std::string_view value) {
+    add(header_id(name), name, value);
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+void HeaderList<String, INLINE_CAPACITY>::set(std::string_view name, std::string_view value) {
+    if (const Field *field = find(name)) {
+        const_cast<Field *>(field)->value = value;
+        return;
+    }
+    add(name, value);
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+const typename HeaderList<String, INLINE_CAPACITY>::Field *
+HeaderList<String, INLINE_CAPACITY>::find(HeaderId id) const {
+    uint32_t position = first[static_cast<size_t>(id)];
+    if (id == HeaderId::Unknown || position == 0) {
+        return nullptr;
+    }
+    return &(*this)[position - 1];
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+const typename HeaderList<String, INLINE_CAPACITY>::Field *
+HeaderList<String, INLINE_CAPACITY>::find(std::string_view name) const {
+    HeaderId id = header_id(name);
+    if (id != HeaderId::Unknown) {
+        return find(id);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const Field &field = (*this)[i];
+        if (field.id == HeaderId::Unknown && equals_ignore_case(field.name, name)) {
+            return &field;
+        }
+    }
+    return nullptr;
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+std::string_view HeaderList<String, INLINE_CAPACITY>::get(HeaderId id) const {
+    const Field *field = find(id);
+    return field != nullptr ? std::string_view(field->value) : std::string_view();
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+std::string_view HeaderList<String, INLINE_CAPACITY>::get(std::string_view name) const {
+    const Field *field = find(name);
+    return field != nullptr ? std::string_view(field->value) : std::string_view();
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+const typename HeaderList<String, INLINE_CAPACITY>::Field &
+HeaderList<String, INLINE_CAPACITY>::operator[](size_t index) const {
+    return index < INLINE_CAPACITY ? fields[index] : overflow[index - INLINE_CAPACITY];
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+size_t HeaderList<String, INLINE_CAPACITY>::size() const {
+    return count;
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+bool HeaderList<String, INLINE_CAPACITY>::empty() const {
+    return count == 0;
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+void HeaderList<String, INLINE_CAPACITY>::clear() {
+    // Only forgets the fields: their strings and the overflow vector are reused by add().
+    count = 0;
+    first.fill(0);
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+typename HeaderList<String, INLINE_CAPACITY>::Iterator
+HeaderList<String, INLINE_CAPACITY>::begin() const {
+    return Iterator(this, 0);
+}
+
+template <typename String, size_t INLINE_CAPACITY>
+typename HeaderList<String, INLINE_CAPACITY>::Iterator
+HeaderList<String, INLINE_CAPACITY>::end() const {
+    return Iterator(this, count);
+}
+
+} // namespace mpmc
@@ -0,0 +1,40 @@
+#pragma once
+
+namespace mpmc {
+
+/**
+ * @brief Instruction set used by the scan_* functions.
+ */
+enum class ScannerIsa { Scalar, SSE42, AVX2 };
+
+/**
+ * @brief Character class scanners for the HTTP parser.
+ *
+ * Each function returns the first byte in [begin, end) outside its class, or `end`, so the byte
+ * that stops a scan is both the delimiter and the validity check: a token must stop at the
+ * expected separator, a field value at CR or LF.
+ *
+ * - scan_token: tchar (RFC 9110 token characters), e.g. methods and header names.
+ * - scan_target: visible characters, stops at space and control characters.
+ * - scan_field: field-value characters, stops at control characters other than HTAB.
+ *
+ * The AVX2 (32 bytes per step) or SSE4.2 (16 bytes per step) implementation is chosen on first use
+ * from what the CPU supports, with a table-driven scalar fallback and for the tail of each scan.
+ */
+const char *scan_token(const char *begin, const char *end);
+const char *scan_target(const char *begin, const char *end);
+const char *scan_field(const char *begin, const char *end);
+
+ScannerIsa scanner_isa();
+
+/**
+ * @brief Forces an implementation, e.g. to compare them in a benchmark. Falls back to the best
+ * supported one that is not wider than `isa`, which is returned.
+ *
+ * @note Not thread-safe, call it before any request is parsed.
+ */
+ScannerIsa set_scanner_isa(ScannerIsa isa);
+
+const char *scanner_isa_name(ScannerIsa isa);
+
+} // namespace mpmc
@@ -1,14 +1,23 @@
 #pragma once
 
+#include "buffer_pool.h"
+#include "headers.h"
+#include "status_code.h"
 #include "thread_pool.h"
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
 #include <netinet/in.h>
 #include <string>
+#include <string_view>
 #include <sys/socket.h>
-#include <unordered_map>
+#include <sys/uio.h>
 #include <vector>
 
 namespace mpmc {
 
+class ResponseWriter;
+
 class TCPStream {
   private:
     std::string ip;
@@ -27,9 +36,13 @@ class TCPStream {
     std::string get_client_addr() const;
     int read(char *buffer, int size);
     void write(const std::string &data);
+    void write(ResponseWriter &writer);
+    void send_file(int fd, off_t offset, size_t length);
+    void set_read_timeout(int timeout);
 };
 
 class TCPListener;
+class Router;
 
 /**
  * @brief Iterator for TCPListener
@@ -54,17 +67,55 @@ class TCPStreamIterator {
     bool operator!=(const TCPStreamIterator &other) const;
 };
 
+/**
+ * @brief Options of a listening socket.
+ *
+ * - backlog: length of the queue of connections not accepted yet.
+ * - receive_buffer, send_buffer: SO_RCVBUF and SO_SNDBUF in bytes, inherited by every accepted
+ *   socket; 0 keeps the kernel default and its autotuning.
+ */
+struct ListenOptions {
+    int backlog = SOMAXCONN;
+    int receive_buffer = 0;
+    int send_buffer = 0;
+};
+
+/**
+ * @brief Creates a TCP socket with SO_REUSEADDR (and SO_REUSEPORT if `reuse_port`), binds it to
+ * ip:port and listens on it. Returns the socket, throws std::runtime_error on failure.
+ */
+int listen_socket(const char *ip, int port, const ListenOptions &options, bool nonblocking = false,
+                  bool reuse_port = false);
+
+/**
+ * @brief Logs a failed accept, at most once a second per thread with the count of those
+ * dropped since: while the process is out of fds every retry fails the same way.
+ */
+void log_accept_error(int error);
+
+/**
+ * @brief Whether accepting failed for lack of fds or memory, which a retry right away only
+ * repeats.
+ */
+bool accept_exhausted(int error);
+
+/**
+ * @brief Blocking listener of the thread pool engine.
+ *
+ * accept() throws std::system_error carrying the errno. shutdown() makes a blocked accept(), and
+ * every later one, fail, so another thread can stop the accepting one.
+ */
 class TCPListener {
   private:
     int socket_fd;
     int port;
     std::string ip;
-    sockaddr_in address;
 
   public:
-    TCPListener(const char *ip, int port);
+    TCPListener(const char *ip, int port, const ListenOptions &options = ListenOptions());
     ~TCPListener();
     TCPStream accept();
+    void shutdown();
     TCPStreamIterator begin();
     TCPStreamIterator end();
 };
@@ -74,8 +125,47 @@ std::string trim(const std::string &s);
 std::string ltrim(const std::string &s);
 std::string rtrim(const std::string &s);
 
+/**
+ * @brief Non-owning view of a parsed request.
+ *
+ * Every field points into the buffer the request was parsed from, and the header array belongs
+ * to the RequestParser that produced the view: it is valid until that buffer is modified or the
+ * parser is reset. Accessors never copy; convert to Request to keep a request beyond that.
+ *
+ * @example
+ * RequestView request = parser.view(input.data());
+ * if (request.get_method() == "GET" && request.get_header(HeaderId::Accept) == "text/html") { ... }
+ */
+class RequestView {
+  public:
+    using Headers = HeaderList<std::string_view, 32>;
+    using Header = Headers::Field;
+
+  private:
+    std::string_view method;
+    std::string_view path;
+    std::string_view version;
+    const Headers *headers;
+    std::string_view body;
+
+  public:
+    RequestView(std::string_view method, std::string_view path, std::string_view version,
+                const Headers *headers, std::string_view body);
+
+    std::string_view get_method() const;
+    std::string_view get_path() const;
+    std::string_view get_version() const;
+    std::string_view get_body() const;
+    const Headers &get_headers() const;
+    std::string_view get_header(HeaderId id) const;
+    std::string_view get_header(std::string_view name) const;
+    size_t get_header_count() const;
+    const Header &get_header(size_t index) const;
+    bool keep_alive() const;
+};
+
 class Request {
-    using Headers = std::unordered_map<std::string, std::string>;
+    using Headers = HeaderList<std::string>;
 
   private:
     std::string method;
@@ -88,17 +178,104 @@ class Request {
     Request(const std::string &request_str);
     Request(const std::string &method, const std::string &path, const std::string &version,
             const Headers &headers, const std::string &body);
+    explicit Request(const RequestView &view);
     ~Request();
-    std::string get_method() const;
-    std::string get_path() const;
-    std::string get_version() const;
-    Headers get_headers() const;
-    std::string get_body() const;
+    const std::string &get_method() const;
+    const std::string &get_path() const;
+    const std::string &get_version() const;
+    const Headers &get_headers() const;
+    std::string_view get_header(HeaderId id) const;
+    std::string_view get_header(std::string_view name) const;
+    const std::string &get_body() const;
+    bool keep_alive() const;
     std::string to_string() const;
 };
 
+/**
+ * @brief Incremental HTTP/1.x request parser: parse() is handed the request received so far and
+ * resumes where the previous call stopped.
+ *
+ * @note On Error, error() is the status to answer with (400, 413, 431, 501 or 505).
+ */
+class RequestParser {
+  public:
+    enum class Result { NeedMore, Complete, Error };
+    static constexpr size_t DEFAULT_HEADER_LIMIT = 8 * 1024;
+    static constexpr size_t DEFAULT_BODY_LIMIT = 1024 * 1024;
+
+  private:
+    enum class State {
+        Method,
+        Target,
+        Version,
+        HeaderLine,
+        HeaderName,
+        HeaderValue,
+        Body,
+        ChunkSize,
+        ChunkData,
+        ChunkEnd,
+        Trailer,
+        Done,
+        Failed
+    };
+    struct Span {
+        size_t offset = 0;
+        size_t length = 0;
+    };
+
+    State state;
+    size_t position;
+    size_t scanned;
+    size_t content_length;
+    bool has_content_length;
+    bool chunked;
+    size_t chunk_remaining;
+    size_t header_limit;
+    size_t body_limit;
+    StatusCode status;
+    Span method;
+    Span path;
+    Span version;
+    Span header_name;
+    Span body;
+    struct HeaderSpan {
+        HeaderId id;
+        Span name;
+        Span value;
+    };
+
+    std::pmr::vector<HeaderSpan> headers;
+    std::pmr::string decoded;
+    RequestView::Headers header_views;
+    static constexpr size_t CHUNK_LINE_LIMIT = 1024;
+
+    Result fail(StatusCode status);
+    Result need_more(size_t size);
+    bool end_line(size_t line_break);
+    bool add_header(const char *data, HeaderId id, Span name, Span value);
+    // Both return Complete once a whole line was consumed and parsing goes on.
+    Result parse_chunk_size(const char *data, size_t size);
+    Result parse_trailer(const char *data, size_t size);
+    bool framing_exceeded() const;
+
+  public:
+    RequestParser(size_t header_limit = DEFAULT_HEADER_LIMIT,
+                  size_t body_limit = DEFAULT_BODY_LIMIT,
+                  std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+    void set_limits(size_t header_limit, size_t body_limit);
+    Result parse(const char *data, size_t size);
+    void reset();
+    void release();
+    size_t length() const;
+    size_t expected_length() const;
+    StatusCode error() const;
+    RequestView view(const char *data);
+};
+
 class Response {
-    using Headers = std::unordered_map<std::string, std::string>;
+    using Headers = HeaderList<std::string>;
 
   private:
     std::string version;
@@ -127,14 +304,133 @@ class Response {
     std::string to_string() const;
 };
 
+/**
+ * @brief Source of a response body that is produced while it is sent, e.g. a large report or a
+ * proxied stream whose length is not known in advance.
+ *
+ * The event loops pull from it only while the connection has nothing left to send, so a slow
+ * client throttles the producer and at most one chunk of the body is in memory at a time.
+ *
+ * @note read() runs on the loop thread: it must not block and has to append at least one byte
+ * unless it returns false.
+ */
+class BodyStream {
+  private:
+    // Set by ResponseWriter::finish_stream(), the framing every later write_chunk() uses.
+    bool chunked = true;
+    friend class ResponseWriter;
+
+  public:
+    virtual ~BodyStream() = default;
+
+    /**
+     * @brief Appends the next part of the body, about `limit` bytes, to `output`. Returns false
+     * once the body is complete, including with the bytes appended by that call.
+     */
+    virtual bool read(std::pmr::string &output, size_t limit) = 0;
+};
+
+/**
+ * @brief Serializes responses into reusable buffers and sends them with sendmsg().
+ *
+ * @note A response without its body (HEAD, 304) still carries the Content-Length of the 200.
+ */
+class ResponseWriter {
+  private:
+    enum class Source : uint8_t { Head, Body, External };
+    struct Segment {
+        Source source;
+        const char *data;
+        size_t offset;
+        size_t length;
+    };
+
+    std::pmr::string heads;
+    std::pmr::string bodies;
+    std::pmr::vector<Segment> segments;
+    std::pmr::vector<iovec> iovecs;
+    std::pmr::vector<std::shared_ptr<const void>> owners;
+    size_t head_start = 0;
+    size_t body_start = 0;
+    size_t first = 0;
+    size_t pending = 0;
+    bool head_only = false;
+    static constexpr size_t CHUNK_SIZE_DIGITS = 8;
+
+    void push(Source source, const char *data, size_t offset, size_t length);
+    void end_head(size_t content_length, bool keep_alive);
+
+  public:
+    struct Mark {
+        size_t heads;
+        size_t bodies;
+        size_t segments;
+        // push() may have grown the last segment since.
+        size_t last_length;
+        size_t owners;
+        size_t pending;
+    };
+
+    ResponseWriter(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+    void start(StatusCode status);
+    void header(std::string_view name, std::string_view value);
+    void header(std::string_view name, uint64_t value);
+    void header(HeaderId id, std::string_view value);
+    void header(HeaderId id, uint64_t value);
+    std::pmr::string &body();
+    void finish(bool keep_alive);
+    void finish(std::string_view body, bool keep_alive);
+    void finish_head(size_t content_length, bool keep_alive);
+    void finish_serialized(std::string_view head, std::string_view body, bool keep_alive,
+                           std::shared_ptr<const void> owner);
+    void error(StatusCode status, bool keep_alive = false);
+    void set_head_only(bool head_only);
+    bool get_head_only() const;
+    void finish_stream(BodyStream &body, bool chunked, bool keep_alive);
+    bool write_chunk(BodyStream &body, size_t limit);
+    Mark mark() const;
+    void rollback(const Mark &mark);
+
+    size_t size() const;
+    bool empty() const;
+    const iovec *data(size_t &count);
+    void consume(size_t n);
+    void copy_to(std::string &output) const;
+    void clear();
+    void release();
+    bool send(int fd);
+};
+
+/**
+ * @brief Limits of an HTTPHandler: the read timeout in ms (0 waits forever) and the request size
+ * limits of its RequestParser.
+ */
+struct HandlerOptions {
+    int idle_timeout = 5000;
+    size_t header_limit = RequestParser::DEFAULT_HEADER_LIMIT;
+    size_t body_limit = RequestParser::DEFAULT_BODY_LIMIT;
+};
+
+/**
+ * @brief Serves one connection on a thread pool worker until the client closes it, a request
+ * does not keep it alive, or no data arrives for options.idle_timeout ms.
+ *
+ * Requests are answered by `router` (404 without one). File bodies are sent with sendfile() and
+ * streamed bodies one STREAM_CHUNK at a time, each written before the next is produced.
+ */
 class HTTPHandler {
   private:
     TCPStream *stream;
+    const Router *router;
+    HandlerOptions options;
     static constexpr int BUFFER_SIZE = 1024;
+    static constexpr size_t STREAM_CHUNK = 16 * 1024;
 
   public:
     HTTPHandler();
-    HTTPHandler(TCPStream *stream);
+    HTTPHandler(TCPStream *stream, const Router *router = nullptr,
+                const HandlerOptions &options = HandlerOptions());
     ~HTTPHandler();
     HTTPHandler(const HTTPHandler &other) = delete;
     HTTPHandler &operator=(const HTTPHandler &other) = delete;
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "router.h"
+#include "static_files.h"
+#include "task_pool.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mpmc {
+
+namespace evtlp {
+
+/**
+ * @brief Response of an offloaded request, handed back to the loop owning its connection.
+ *
+ * `token` is the connection's ConnectionTable token, so a result for a connection closed in the
+ * meantime is recognized and dropped. `response` holds the serialized head and writer body, a
+ * file or streamed body follows it as on the loop.
+ */
+struct OffloadResult {
+    uint64_t token = 0;
+    std::string response;
+    FileResponse file;
+    std::unique_ptr<BodyStream> stream;
+    bool keep_alive = false;
+};
+
+/**
+ * @brief Results of offloaded requests on their way back to one loop.
+ *
+ * Pool workers push() results and the loop take()s them. The queue signals its eventfd when a
+ * result arrives while it was empty; the loop waits for the fd (epoll_wait, or an io_uring read)
+ * and has to read it before take(), so a result pushed in between signals again. The fd is a
+ * blocking eventfd, read only once it is known to be readable.
+ *
+ * Jobs hold the queue by shared_ptr: a loop destroyed while some of its requests still run leaves
+ * the queue to the last of them.
+ */
+class OffloadQueue {
+  private:
+    std::mutex mutex;
+    std::vector<OffloadResult> results;
+    int fd;
+
+  public:
+    OffloadQueue();
+    ~OffloadQueue();
+    OffloadQueue(const OffloadQueue &other) = delete;
+    OffloadQueue &operator=(const OffloadQueue &other) = delete;
+
+    int get_fd() const;
+    void push(OffloadResult result);
+    void take(std::vector<OffloadResult> &output);
+};
+
+/**
+ * @brief Answers `request`, the raw bytes of one complete request, on a worker of `pool` with
+ * `router` and pushes the result for `token` to `queue`.
+ *
+ * The request is parsed again on the worker and dispatched without offloading. A handler that
+ * throws is answered with 500, and a request the pool does not run, because its queue is full or
+ * it is destroyed first, with 503; both close the connection. Never waits for the pool.
+ */
+void offload(TaskPool &pool, const Router &router, const std::shared_ptr<OffloadQueue> &queue,
+             uint64_t token, std::string_view request, bool keep_alive);
+
+} // namespace evtlp
+
+} // namespace mpmc
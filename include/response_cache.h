@@ -0,0 +1,125 @@
+#pragma once
+
+#include "network.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mpmc {
+
+/**
+ * @brief A response stored fully serialized. `head` holds the status line and every header up to
+ * and including Content-Length; Connection and the blank line are added per request.
+ */
+struct CachedResponse {
+    std::string key;
+    std::string head;
+    std::string body;
+    std::string etag;
+    uint64_t expires_ms;
+    size_t charge;
+    mutable std::atomic<bool> referenced;
+};
+
+struct CacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;
+};
+
+/**
+ * @brief Opt-in cache of generated responses, keyed by method, target and the values of the
+ * `vary` request headers.
+ *
+ * Only GET and HEAD requests without a body are cached. Entries expire `ttl_ms` after they were
+ * stored and carry an ETag computed from the body, so If-None-Match is answered with 304 Not
+ * Modified. A hit is written to the ResponseWriter by reference: the stored head and body are sent
+ * as they are, the entry is kept alive until the writer has sent them.
+ *
+ * The cache is split into shards by key hash, each with `capacity / shards` bytes and its own
+ * reader-writer lock. Lookups only take the shared lock and mark the entry referenced; stores take
+ * the exclusive lock and evict with the CLOCK policy, expired entries first. An entry larger than
+ * its shard is served but not kept.
+ *
+ * @note Thread-safe, one instance can be shared by every loop and worker.
+ *
+ * @example
+ * ResponseCache cache(64 * 1024 * 1024, 5000, {"Accept-Encoding"});
+ * cache.respond(request, keep_alive, writer, "text/html", [&](std::string &body) {
+ *     body = render(request);
+ * });
+ */
+class ResponseCache {
+  private:
+    struct alignas(64) Shard {
+        std::shared_mutex mutex;
+        std::unordered_map<std::string, size_t> index;
+        std::vector<std::shared_ptr<const CachedResponse>> slots;
+        std::vector<size_t> free_slots;
+        size_t hand = 0;
+        size_t bytes = 0;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> evictions{0};
+    };
+
+    std::vector<std::string> vary;
+    std::vector<HeaderId> vary_ids;
+    std::string vary_header;
+    size_t shard_capacity;
+    uint64_t ttl_ms;
+    size_t shard_count;
+    std::unique_ptr<Shard[]> shards;
+
+    void make_key(const RequestView &request, std::string &key) const;
+    Shard &shard_for(const std::string &key);
+    void evict_one(Shard &shard, uint64_t now);
+
+  public:
+    ResponseCache(size_t capacity, int ttl_ms, std::vector<std::string> vary = {},
+                  size_t shards = 16);
+    ResponseCache(const ResponseCache &other) = delete;
+    ResponseCache &operator=(const ResponseCache &other) = delete;
+
+    bool cacheable(const RequestView &request) const;
+    std::shared_ptr<const CachedResponse> lookup(const RequestView &request);
+    std::shared_ptr<const CachedResponse> store(const RequestView &request, StatusCode status,
+                                                std::string_view content_type,
+                                                std::string body);
+    void serve(std::shared_ptr<const CachedResponse> entry, const RequestView &request,
+               bool keep_alive, ResponseWriter &writer) const;
+    CacheStats get_stats();
+
+    /**
+     * @brief Answers a cacheable request from the cache, on a miss rendering the body with
+     * `render(std::string &body)` and storing it first. Returns false, writing nothing, if the
+     * request is not cacheable.
+     */
+    template <typename Render>
+    bool respond(const RequestView &request, bool keep_alive, ResponseWriter &writer,
+                 std::string_view content_type, Render render);
+};
+
+template <typename Render>
+bool ResponseCache::respond(const RequestView &request, bool keep_alive, ResponseWriter &writer,
+                            std::string_view content_type, Render render) {
+    if (!cacheable(request)) {
+        return false;
+    }
+    std::shared_ptr<const CachedResponse> entry = lookup(request);
+    if (entry == nullptr) {
+        std::string body;
+        render(body);
+        entry = store(request, StatusCode::OK, content_type, std::move(body));
+    }
+    serve(std::move(entry), request, keep_alive, writer);
+    return true;
+}
+
+} // namespace mpmc
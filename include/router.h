@@ -0,0 +1,119 @@
+#pragma once
+
+#include "network.h"
+#include "static_files.h"
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mpmc {
+
+/**
+ * @brief Path parameters of a matched route, in pattern order. Names and values are views into
+ * the route table and the request, the list itself is fixed-size and never allocates.
+ */
+class PathParams {
+  public:
+    static constexpr size_t CAPACITY = 8;
+    struct Param {
+        std::string_view name;
+        std::string_view value;
+    };
+
+  private:
+    std::array<Param, CAPACITY> params;
+    size_t count = 0;
+
+  public:
+    void push(std::string_view name, std::string_view value);
+    void pop();
+    std::string_view get(std::string_view name) const;
+    const Param &operator[](size_t index) const;
+    size_t size() const;
+};
+
+/**
+ * @brief A request being answered by a route handler.
+ *
+ * The handler writes the status line and headers, and usually the body, to `writer`. A body that
+ * does not come from the writer is left in `file` (a range of a static file, see
+ * StaticFiles::serve()) or `stream` (see ResponseWriter::finish_stream()), and a handler whose
+ * response ends the connection clears `keep_alive`.
+ *
+ * An event loop that can hand requests to a TaskPool sets `can_offload`; Router::dispatch() then
+ * only sets `offloaded` for a route added with Router::offload() and leaves the request to the
+ * loop, which dispatches it again on a worker.
+ */
+struct RouteContext {
+    const RequestView &request;
+    ResponseWriter &writer;
+    bool keep_alive;
+    bool can_offload = false;
+    bool offloaded = false;
+    PathParams params;
+    FileResponse file;
+    std::unique_ptr<BodyStream> stream;
+
+    RouteContext(const RequestView &request, ResponseWriter &writer, bool keep_alive)
+        : request(request), writer(writer), keep_alive(keep_alive) {}
+
+    std::string_view param(std::string_view name) const { return params.get(name); }
+};
+
+using RouteHandler = std::function<void(RouteContext &context)>;
+
+/**
+ * @brief Dispatches requests to handlers by method and path pattern, where `:name` matches one
+ * path segment and a final `*name` the rest of the path.
+ *
+ * @example
+ * Router router;
+ * router.add("GET", "/users/:id", [](RouteContext &context) {
+ *     context.writer.start(StatusCode::OK);
+ *     fmt::format_to(std::back_inserter(context.writer.body()), "user {}", context.param("id"));
+ *     context.writer.finish(context.keep_alive);
+ * });
+ * EventLoop loop;
+ * loop.set_router(&router);
+ */
+class Router {
+  private:
+    struct Route {
+        std::string method;
+        RouteHandler handler;
+        bool offload;
+    };
+    struct Node {
+        std::string prefix;
+        // indices[i] is the first byte of children[i]->prefix.
+        std::string indices;
+        std::vector<std::unique_ptr<Node>> children;
+        std::unique_ptr<Node> param;
+        std::unique_ptr<Node> wildcard;
+        std::string name;
+        std::vector<Route> routes;
+        std::string allow;
+    };
+
+    Node root;
+
+    Node *insert(std::string_view pattern);
+    const Node *match(const Node &node, std::string_view path, PathParams &params) const;
+    void route(RouteContext &context) const;
+    void add_route(std::string_view method, std::string_view pattern, RouteHandler handler,
+                   bool offload);
+
+  public:
+    Router() = default;
+    Router(const Router &other) = delete;
+    Router &operator=(const Router &other) = delete;
+
+    void add(std::string_view method, std::string_view pattern, RouteHandler handler);
+    void offload(std::string_view method, std::string_view pattern, RouteHandler handler);
+    void dispatch(RouteContext &context) const;
+};
+
+} // namespace mpmc
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "event_loop.h"
+#include "network.h"
+#include "router.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace mpmc {
+
+/**
+ * @brief Connection engine of a Server.
+ *
+ * - ThreadPool: blocking sockets, one TCPListener per address and each connection served by an
+ *   HTTPHandler on a ThreadPool worker for its whole lifetime.
+ * - Epoll: evtlp::EventLoop, an accepting loop handing connections to SubEventLoop threads.
+ * - IoUring: evtlp::ShardedRingEventLoop, one ring and one SO_REUSEPORT listener per thread.
+ */
+enum class Engine { ThreadPool, Epoll, IoUring };
+
+/**
+ * @brief Parses "threads", "epoll" or "io_uring" into `engine`. Returns false, leaving `engine`
+ * unchanged, for any other name.
+ */
+bool parse_engine(std::string_view name, Engine &engine);
+std::string_view engine_name(Engine engine);
+
+/**
+ * @brief Options of a Server. Every engine reads the ones that apply to it.
+ *
+ * - threads: threads serving connections: SubEventLoop threads for Epoll (0 serves everything on
+ *   the thread calling run()), rings for IoUring and workers for ThreadPool (at least 1 each).
+ * - addresses: ip and port pairs to listen on, each with the `listen` options.
+ * - edge_triggered: register epoll sockets with EPOLLET (Epoll only).
+ * - idle_timeout, request_timeout: ms, 0 disables them. ThreadPool has no request timer, its
+ *   handlers give up after idle_timeout ms without data.
+ * - header_limit, body_limit: request size limits, see RequestParser.
+ * - pin_cpus, ring: CPU pinning and io_uring setup of the rings (IoUring only).
+ * - scheduling: how the pool hands connections to its workers (ThreadPool only).
+ * - offload_threads: workers of the TaskPool running offloaded routes (see Router::offload()) for
+ *   Epoll and IoUring; 0 runs them on the loops. ThreadPool runs them on its own workers.
+ */
+struct ServerConfig {
+    Engine engine = Engine::Epoll;
+    int threads = static_cast<int>(std::thread::hardware_concurrency());
+    std::vector<std::pair<std::string, int>> addresses;
+    ListenOptions listen;
+    bool edge_triggered = false;
+    int idle_timeout = 60000;
+    int request_timeout = 30000;
+    size_t header_limit = RequestParser::DEFAULT_HEADER_LIMIT;
+    size_t body_limit = RequestParser::DEFAULT_BODY_LIMIT;
+    bool pin_cpus = false;
+    evtlp::RingConfig ring;
+    Scheduling scheduling = Scheduling::Shared;
+    int offload_threads = static_cast<int>(std::thread::hardware_concurrency());
+};
+
+/**
+ * @brief Serves a Router with the engine chosen in its ServerConfig.
+ *
+ * The routes, and so the handlers, are the same whichever engine runs them, which makes the
+ * engine a deployment option: switch it in the config and compare on the real workload. The
+ * engine is built by run() and torn down before it returns.
+ *
+ * @note stop() may be called from any thread, also before run(), which then returns at once.
+ * With ThreadPool it stops accepting and waits for the open connections to close or time out.
+ * The router must outlive the server.
+ *
+ * @example
+ * ServerConfig config;
+ * config.engine = Engine::IoUring;
+ * config.addresses = {{"127.0.0.1", 8080}};
+ * Server server(config, router);
+ * server.run();
+ */
+class Server {
+  private:
+    ServerConfig config;
+    const Router &router;
+    std::mutex mutex;
+    std::unique_ptr<evtlp::EventLoop> event_loop;
+    std::unique_ptr<evtlp::ShardedRingEventLoop> rings;
+    std::unique_ptr<TaskPool> offload_pool;
+    std::vector<std::unique_ptr<TCPListener>> listeners;
+    std::atomic<bool> stopped;
+    static constexpr int ACCEPT_BACKOFF_MS = 100;
+
+    void start();
+    void serve();
+    void serve_thread_pool();
+    void accept_loop(TCPListener &listener, ThreadPool<HTTPHandler> &pool);
+
+  public:
+    Server(const ServerConfig &config, const Router &router);
+    ~Server();
+    Server(const Server &other) = delete;
+    Server &operator=(const Server &other) = delete;
+
+    const ServerConfig &get_config() const;
+    void run();
+    void stop();
+};
+
+} // namespace mpmc
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "network.h"
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+namespace mpmc {
+
+/**
+ * @brief An open file with the metadata needed to answer requests for it.
+ *
+ * The fd is closed when the last reference goes away, so a file that is evicted from the cache
+ * while a response is still streaming it stays valid until that response is sent.
+ */
+struct StaticFile {
+    int fd;
+    size_t size;
+    ino_t inode;
+    int64_t mtime_ns;
+    std::string content_type;
+    std::string etag;
+    std::string last_modified;
+
+    StaticFile(int fd);
+    ~StaticFile();
+    StaticFile(const StaticFile &other) = delete;
+    StaticFile &operator=(const StaticFile &other) = delete;
+};
+
+/**
+ * @brief One piece of a connection's pending output: in-memory bytes, or a range of an open file
+ * that is sent without copying it through user space.
+ *
+ * `offset` is the position of the next byte to send, in `data` or in the file.
+ */
+struct OutputChunk {
+    std::string data;
+    std::shared_ptr<const StaticFile> file;
+    off_t offset = 0;
+    size_t length = 0;
+
+    size_t remaining() const { return file ? length : data.size() - offset; }
+};
+
+/**
+ * @brief The file range to stream after the head serve() wrote (no file for HEAD, 304 and error
+ * responses).
+ */
+struct FileResponse {
+    std::shared_ptr<const StaticFile> file;
+    off_t offset = 0;
+    size_t length = 0;
+};
+
+/**
+ * @brief Serves the files below `root` for request paths starting with `prefix`.
+ *
+ * Open fds and their stat results are kept in an LRU cache of up to `capacity` files; a cached
+ * entry is re-validated with stat() at most every REVALIDATE_MS, so modified files are picked up
+ * shortly after they change. Responses carry ETag and Last-Modified, and If-None-Match or an
+ * exact If-Modified-Since match is answered with 304 Not Modified. Only GET and HEAD are allowed,
+ * paths that escape `root` get 403 and a directory is served through its index.html, a path to
+ * one without the trailing '/' being redirected there with 301. The status line and headers are
+ * written to the connection's ResponseWriter, the body is left to the caller.
+ *
+ * @note Thread-safe, one instance can be shared by every loop and worker. sendfile() and splice()
+ * have no MSG_NOSIGNAL, so the constructor sets SIGPIPE to be ignored process-wide.
+ *
+ * @example
+ * // A Router handler for GET and HEAD on a wildcard route under the prefix.
+ * StaticFiles files("/static/", "./public");
+ * auto serve = [&files](RouteContext &context) {
+ *     context.file = files.serve(context.request, context.keep_alive, context.writer);
+ * };
+ */
+class StaticFiles {
+  private:
+    struct Entry {
+        std::shared_ptr<const StaticFile> file;
+        uint64_t checked_ms;
+        std::list<std::string>::iterator lru;
+    };
+
+    static constexpr uint64_t REVALIDATE_MS = 1000;
+    std::string prefix;
+    std::string root;
+    size_t capacity;
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> lru;
+
+    // Both set `status` to the error to answer with when they return nullptr.
+    std::shared_ptr<const StaticFile> open(const std::string &path, StatusCode &status);
+    std::shared_ptr<const StaticFile> lookup(const std::string &path, StatusCode &status);
+    bool resolve(std::string_view request_path, std::string &path) const;
+
+  public:
+    StaticFiles(const std::string &prefix, const std::string &root, size_t capacity = 1024);
+
+    bool matches(std::string_view request_path) const;
+    FileResponse serve(const RequestView &request, bool keep_alive, ResponseWriter &writer);
+    size_t size();
+};
+
+} // namespace mpmc
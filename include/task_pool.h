@@ -0,0 +1,365 @@
+#pragma once
+
+#include "thread_pool.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace mpmc {
+
+class Task;
+
+/**
+ * @brief Calls a task function with the worker running it if it takes one, otherwise without
+ * arguments.
+ */
+template <typename F> decltype(auto) invoke_task(F &function, Worker<Task> *worker) {
+    if constexpr (std::is_invocable_v<F &, Worker<Task> *>) {
+        return function(worker);
+    } else {
+        return function();
+    }
+}
+
+template <typename F> struct TaskResult {
+    using type = std::conditional_t<std::is_invocable_v<F &, Worker<Task> *>,
+                                    std::invoke_result<F &, Worker<Task> *>,
+                                    std::invoke_result<F &>>;
+};
+
+template <typename F> using task_result_t = typename TaskResult<F>::type::type;
+
+/**
+ * @brief Move-only, type-erased callable run by a TaskPool worker.
+ *
+ * The callable takes no arguments or the Worker<Task> * running it. Callables up to INLINE_SIZE
+ * bytes that can be moved without throwing are stored inside the Task, so wrapping a small lambda
+ * does not allocate; larger ones are moved to the heap. A Task is one cache line.
+ */
+class Task {
+  public:
+    static constexpr size_t INLINE_SIZE = 48;
+
+  private:
+    struct Ops {
+        void (*invoke)(void *storage, Worker<Task> *worker);
+        // Move-constructs the callable at `to` and destroys the one at `from`.
+        void (*relocate)(void *from, void *to);
+        void (*destroy)(void *storage);
+    };
+
+    template <typename F> struct InlineOps {
+        static F *get(void *storage) { return std::launder(reinterpret_cast<F *>(storage)); }
+        static void invoke(void *storage, Worker<Task> *worker) {
+            invoke_task(*get(storage), worker);
+        }
+        static void relocate(void *from, void *to) {
+            new (to) F(std::move(*get(from)));
+            get(from)->~F();
+        }
+        static void destroy(void *storage) { get(storage)->~F(); }
+        static constexpr Ops ops = {invoke, relocate, destroy};
+    };
+
+    template <typename F> struct HeapOps {
+        static F *&get(void *storage) { return *std::launder(reinterpret_cast<F **>(storage)); }
+        static void invoke(void *storage, Worker<Task> *worker) {
+            invoke_task(*get(storage), worker);
+        }
+        static void relocate(void *from, void *to) { new (to) F *(get(from)); }
+        static void destroy(void *storage) { delete get(storage); }
+        static constexpr Ops ops = {invoke, relocate, destroy};
+    };
+
+    template <typename F>
+    static constexpr bool fits_inline = sizeof(F) <= INLINE_SIZE &&
+                                        alignof(F) <= alignof(std::max_align_t) &&
+                                        std::is_nothrow_move_constructible_v<F>;
+
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+    const Ops *ops;
+
+  public:
+    Task() : ops(nullptr) {}
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F &&function);
+    Task(Task &&other) noexcept;
+    Task &operator=(Task &&other) noexcept;
+    Task(const Task &other) = delete;
+    Task &operator=(const Task &other) = delete;
+    ~Task();
+
+    explicit operator bool() const;
+    void operator()(Worker<Task> *worker);
+};
+
+template <typename F, typename> Task::Task(F &&function) {
+    using Function = std::decay_t<F>;
+    if constexpr (fits_inline<Function>) {
+        new (storage) Function(std::forward<F>(function));
+        ops = &InlineOps<Function>::ops;
+    } else {
+        new (storage) Function *(new Function(std::forward<F>(function)));
+        ops = &HeapOps<Function>::ops;
+    }
+}
+
+/**
+ * @brief Completion state shared by a TaskFuture and the tasks it waits for.
+ *
+ * It is freed by whoever drops the last reference: the future and each task hold one. `status`
+ * doubles as a futex word; the last task only wakes anybody if a waiter marked it WAITING.
+ */
+template <typename R> class TaskState {
+  private:
+    using Value = std::conditional_t<std::is_void_v<R>, char, R>;
+    enum Status : uint32_t { PENDING, WAITING, READY };
+
+    std::atomic<uint32_t> references;
+    std::atomic<uint32_t> remaining;
+    std::atomic<uint32_t> status;
+    std::atomic<bool> failed;
+    std::optional<Value> value;
+    std::exception_ptr error;
+
+  public:
+    TaskState(uint32_t tasks);
+
+    void release();
+    template <typename F> void run(F &function, Worker<Task> *worker);
+    void fail(std::exception_ptr exception);
+    void finish();
+    bool is_ready() const;
+    void wait();
+    R get();
+};
+
+template <typename R>
+TaskState<R>::TaskState(uint32_t tasks)
+    : references(tasks + 1), remaining(tasks), status(tasks == 0 ? READY : PENDING),
+      failed(false) {}
+
+template <typename R> void TaskState<R>::release() {
+    if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+template <typename R>
+template <typename F>
+void TaskState<R>::run(F &function, Worker<Task> *worker) {
+    try {
+        if constexpr (std::is_void_v<R>) {
+            invoke_task(function, worker);
+        } else {
+            value.emplace(invoke_task(function, worker));
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    finish();
+}
+
+template <typename R> void TaskState<R>::fail(std::exception_ptr exception) {
+    // A batch keeps the first failure.
+    if (!failed.exchange(true, std::memory_order_relaxed)) {
+        error = exception;
+    }
+}
+
+template <typename R> void TaskState<R>::finish() {
+    if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+        status.exchange(READY, std::memory_order_acq_rel) == WAITING) {
+        futex_wake(status, INT32_MAX);
+    }
+}
+
+template <typename R> bool TaskState<R>::is_ready() const {
+    return status.load(std::memory_order_acquire) == READY;
+}
+
+template <typename R> void TaskState<R>::wait() {
+    uint32_t current = status.load(std::memory_order_acquire);
+    while (current != READY) {
+        if (current == PENDING &&
+            !status.compare_exchange_weak(current, WAITING, std::memory_order_acquire)) {
+            continue;
+        }
+        futex_wait(status, WAITING);
+        current = status.load(std::memory_order_acquire);
+    }
+}
+
+template <typename R> R TaskState<R>::get() {
+    wait();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if constexpr (!std::is_void_v<R>) {
+        return std::move(*value);
+    }
+}
+
+/**
+ * @brief Result of TaskPool::submit() or TaskPool::submit_batch().
+ *
+ * get() blocks until the task (or every task of the batch) ran, then returns the result or
+ * rethrows the exception the task threw; it may only be called once. A task dropped without
+ * running, because the pool was destroyed first, fails with std::runtime_error. Dropping the
+ * future does not cancel anything.
+ *
+ * @note Waiting on a future from inside a pool task can deadlock a small pool: the worker that
+ * blocks is one fewer to run the task it waits for.
+ */
+template <typename R> class TaskFuture {
+  private:
+    TaskState<R> *state;
+
+  public:
+    TaskFuture() : state(nullptr) {}
+    explicit TaskFuture(TaskState<R> *state) : state(state) {}
+    TaskFuture(TaskFuture &&other) noexcept : state(other.state) { other.state = nullptr; }
+    TaskFuture &operator=(TaskFuture &&other) noexcept;
+    TaskFuture(const TaskFuture &other) = delete;
+    TaskFuture &operator=(const TaskFuture &other) = delete;
+    ~TaskFuture();
+
+    bool valid() const { return state != nullptr; }
+    bool ready() const { return state->is_ready(); }
+    void wait() const { state->wait(); }
+    R get() { return state->get(); }
+};
+
+template <typename R> TaskFuture<R> &TaskFuture<R>::operator=(TaskFuture &&other) noexcept {
+    if (this != &other) {
+        if (state != nullptr) {
+            state->release();
+        }
+        state = other.state;
+        other.state = nullptr;
+    }
+    return *this;
+}
+
+template <typename R> TaskFuture<R>::~TaskFuture() {
+    if (state != nullptr) {
+        state->release();
+    }
+}
+
+/**
+ * @brief A task function bound to the TaskState it completes. Destroyed without having run, it
+ * fails the state so its future does not wait forever.
+ */
+template <typename R, typename F> class BoundTask {
+  private:
+    TaskState<R> *state;
+    F function;
+
+  public:
+    template <typename Function>
+    BoundTask(TaskState<R> *state, Function &&function)
+        : state(state), function(std::forward<Function>(function)) {}
+    BoundTask(BoundTask &&other) noexcept(std::is_nothrow_move_constructible_v<F>)
+        : state(other.state), function(std::move(other.function)) {
+        other.state = nullptr;
+    }
+    BoundTask(const BoundTask &other) = delete;
+    BoundTask &operator=(const BoundTask &other) = delete;
+    BoundTask &operator=(BoundTask &&other) = delete;
+
+    ~BoundTask() {
+        if (state != nullptr) {
+            state->fail(std::make_exception_ptr(std::runtime_error("Task dropped before it ran")));
+            state->finish();
+            state->release();
+        }
+    }
+
+    void operator()(Worker<Task> *worker) {
+        TaskState<R> *done = state;
+        state = nullptr;
+        done->run(function, worker);
+        done->release();
+    }
+};
+
+/**
+ * @brief ThreadPool running arbitrary closures, with futures and batch submission.
+ *
+ * post() runs a closure and forgets it; an exception escaping it terminates the program, as it
+ * would on a std::thread. try_post() does not wait for room in a full queue: it returns false and
+ * destroys the closure instead. submit() also returns a TaskFuture for its result, which costs one
+ * allocation for the shared state; the closure itself is stored in the Task (see Task), so small
+ * lambdas are not allocated. submit_batch() runs every callable of a range, copying them (pass
+ * move iterators to move them), behind one TaskFuture<void> that completes with the last of them,
+ * and hands all of them to the pool in one ThreadPool::submit_batch().
+ *
+ * Closures may take the Worker<Task> * running them, e.g. to spawn() follow-up tasks onto the
+ * same worker with Scheduling::WorkStealing.
+ *
+ * @example
+ * TaskPool pool(8, 1024, Scheduling::WorkStealing);
+ * TaskFuture<size_t> length = pool.submit([&page] { return render(page).size(); });
+ * std::vector<std::function<void()>> parts = ...;
+ * pool.submit_batch(parts.begin(), parts.end()).wait();
+ * fmt::print("{}\n", length.get());
+ */
+class TaskPool {
+  private:
+    ThreadPool<Task> pool;
+
+  public:
+    TaskPool(int num_workers = static_cast<int>(std::thread::hardware_concurrency()),
+             size_t capacity = Channel<Task>::DEFAULT_CAPACITY,
+             Scheduling scheduling = Scheduling::Shared);
+    TaskPool(const TaskPool &other) = delete;
+    TaskPool &operator=(const TaskPool &other) = delete;
+
+    template <typename F> void post(F &&function);
+    template <typename F> bool try_post(F &&function);
+    template <typename F> TaskFuture<task_result_t<std::decay_t<F>>> submit(F &&function);
+    template <typename Iterator> TaskFuture<void> submit_batch(Iterator first, Iterator last);
+};
+
+template <typename F> void TaskPool::post(F &&function) {
+    pool.submit(Task(std::forward<F>(function)));
+}
+
+template <typename F> bool TaskPool::try_post(F &&function) {
+    return pool.try_submit(Task(std::forward<F>(function)));
+}
+
+template <typename F> TaskFuture<task_result_t<std::decay_t<F>>> TaskPool::submit(F &&function) {
+    using R = task_result_t<std::decay_t<F>>;
+    auto state = new TaskState<R>(1);
+    TaskFuture<R> future(state);
+    pool.submit(Task(BoundTask<R, std::decay_t<F>>(state, std::forward<F>(function))));
+    return future;
+}
+
+template <typename Iterator>
+TaskFuture<void> TaskPool::submit_batch(Iterator first, Iterator last) {
+    using F = std::decay_t<decltype(*first)>;
+    size_t count = std::distance(first, last);
+    std::vector<Task> tasks;
+    tasks.reserve(count);
+    auto state = new TaskState<void>(static_cast<uint32_t>(count));
+    TaskFuture<void> future(state);
+    for (; first != last; ++first) {
+        tasks.emplace_back(BoundTask<void, F>(state, *first));
+    }
+    pool.submit_batch(tasks.data(), tasks.size());
+    return future;
+}
+
+} // namespace mpmc
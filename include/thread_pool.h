@@ -1,14 +1,55 @@
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <fmt/format.h>
 #include <iostream>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
+#include <stdexcept>
 #include <thread>
+#include <vector>
 
 namespace mpmc {
+
+/**
+ * @brief Sleeps while `word` holds `expected`, until futex_wake() on it. May return spuriously.
+ */
+void futex_wait(std::atomic<uint32_t> &word, uint32_t expected);
+
+/**
+ * @brief Wakes up to `count` threads sleeping in futex_wait() on `word`.
+ */
+void futex_wake(std::atomic<uint32_t> &word, int count);
+
+/**
+ * @brief Lets threads sleep until lock-free state they poll changes, at no cost to the threads
+ * changing it while nobody sleeps.
+ *
+ * A waiter calls prepare_wait(), checks its condition once more and then either cancel_wait()s
+ * or wait()s. A thread that made the condition true calls notify_one() (notify_n() after making
+ * it true n times), which only makes a system call when some thread is between prepare_wait() and
+ * the end of wait(). The fences in
+ * both guarantee that the waiter sees the change or the notifier sees the waiter.
+ */
+class EventCount {
+  private:
+    std::atomic<uint32_t> epoch;
+    std::atomic<uint32_t> waiting;
+
+  public:
+    EventCount();
+
+    uint32_t prepare_wait();
+    void cancel_wait();
+    void wait(uint32_t key);
+    void notify_one();
+    void notify_n(int count);
+    void notify_all();
+};
 class Semaphore {
   private:
     std::mutex mutex;
@@ -37,6 +78,9 @@ template <typename T> class Sender {
 
     void close();
     bool send(T &&data);
+    bool try_send(T &&data);
+    bool send_batch(T *data, size_t count);
+    size_t try_send_batch(T *data, size_t count);
 };
 
 template <typename T> class Receiver {
@@ -48,27 +92,67 @@ template <typename T> class Receiver {
     ~Receiver();
 
     bool receive(T &data);
+    bool try_receive(T &data);
 };
 
+/**
+ * @brief Bounded multi-producer multi-consumer queue, shared by its Senders and Receivers.
+ *
+ * The queue is a ring of `capacity` slots (rounded up to a power of two), each on its own cache
+ * line with a sequence number that says whether the slot is free for the producer of a position
+ * or full for its consumer (D. Vyukov's bounded MPMC queue). try_push() and try_pop() claim a
+ * position with one compare-and-swap on the enqueue or dequeue counter and never block.
+ *
+ * push() and pop() spin on the non-blocking path for a moment and then sleep on a futex. A
+ * thread only sleeps after announcing itself and checking the queue once more, so the other
+ * side only makes a system call when somebody is asleep, i.e. when the queue was empty or full,
+ * and then wakes a single waiter per item or free slot. try_push_batch() claims as many free
+ * slots as it can, up to `count`, with a single compare-and-swap and wakes the receivers for all
+ * of them at once.
+ *
+ * After close() every operation fails and the items still queued are destroyed with the channel.
+ *
+ * @example
+ * Sender<Job> *sender;
+ * Receiver<Job> *receiver;
+ * Channel<Job>::create(&sender, &receiver, 4096);
+ */
 template <typename T> class Channel {
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 1024;
+
   private:
-    std::queue<T> channel;
-    std::mutex mutex;
-    std::condition_variable empty_cond;
-    int empty_count;
-    std::condition_variable full_cond;
-    int full_count;
-    bool closed = false;
+    struct alignas(64) Slot {
+        std::atomic<size_t> sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    static constexpr int SPIN_COUNT = 64;
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_position;
+    alignas(64) std::atomic<size_t> dequeue_position;
+    alignas(64) EventCount not_empty;
+    alignas(64) EventCount not_full;
+    std::atomic<bool> closed;
+
+    template <typename Try> bool wait_until(Try attempt, EventCount &event);
 
   public:
-    Channel();
-    Channel(int capacity);
+    Channel(size_t capacity = DEFAULT_CAPACITY);
     ~Channel();
+    Channel(const Channel &other) = delete;
+    Channel &operator=(const Channel &other) = delete;
 
     void close();
     bool push(T &&data);
     bool pop(T &data);
-    static void create(Sender<T> **, Receiver<T> **);
+    bool try_push(T &&data);
+    size_t try_push_batch(T *data, size_t count);
+    bool push_batch(T *data, size_t count);
+    bool try_pop(T &data);
+    size_t get_capacity() const;
+    static void create(Sender<T> **, Receiver<T> **, size_t capacity = DEFAULT_CAPACITY);
 };
 
 template <typename Callback> void Semaphore::wait(Callback callback) {
@@ -115,54 +199,181 @@ template <typename Callback> void Semaphore::signal_n(int n, Callback callback)
     cv.notify_all();
 }
 
-template <typename T> void Channel<T>::create(Sender<T> **sender, Receiver<T> **receiver) {
-    auto channel_ptr = std::make_shared<Channel<T>>();
+template <typename T>
+void Channel<T>::create(Sender<T> **sender, Receiver<T> **receiver, size_t capacity) {
+    auto channel_ptr = std::make_shared<Channel<T>>(capacity);
     *sender = new Sender<T>(channel_ptr);
     *receiver = new Receiver<T>(channel_ptr);
 }
 
-template <typename T> Channel<T>::Channel() : empty_count(10), full_count(0) {}
-
-template <typename T> Channel<T>::Channel(int capacity) : empty_count(capacity), full_count(0) {}
+template <typename T>
+Channel<T>::Channel(size_t capacity)
+    : enqueue_position(0), dequeue_position(0), closed(false) {
+    if (capacity == 0) {
+        throw std::runtime_error("capacity must be greater than 0");
+    }
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    mask = size - 1;
+    slots = std::make_unique<Slot[]>(size);
+    for (size_t i = 0; i < size; ++i) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
 
-template <typename T> Channel<T>::~Channel() {}
+template <typename T> Channel<T>::~Channel() {
+    // Nobody else uses the channel any more, every position in between holds an item.
+    size_t end = enqueue_position.load(std::memory_order_relaxed);
+    for (size_t position = dequeue_position.load(std::memory_order_relaxed); position != end;
+         ++position) {
+        std::launder(reinterpret_cast<T *>(slots[position & mask].storage))->~T();
+    }
+}
 
-template <typename T> bool Channel<T>::push(T &&data) {
-    std::unique_lock<std::mutex> lock(mutex);
-    empty_cond.wait(lock, [this] { return empty_count > 0 || closed; });
-    if (closed) {
-        empty_cond.notify_all();
-        full_cond.notify_all();
+template <typename T> bool Channel<T>::try_push(T &&data) {
+    if (closed.load(std::memory_order_relaxed)) {
         return false;
     }
-    --empty_count;
-    channel.push(std::move(data));
-    ++full_count;
-    full_cond.notify_all();
+    size_t position = enqueue_position.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &slots[position & mask];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+        if (diff == 0) {
+            if (enqueue_position.compare_exchange_weak(position, position + 1,
+                                                       std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The consumer of the previous round has not freed the slot yet: full.
+            return false;
+        } else {
+            position = enqueue_position.load(std::memory_order_relaxed);
+        }
+    }
+    new (slot->storage) T(std::move(data));
+    slot->sequence.store(position + 1, std::memory_order_release);
+    not_empty.notify_one();
     return true;
 }
 
-template <typename T> bool Channel<T>::pop(T &data) {
-    std::unique_lock<std::mutex> lock(mutex);
-    full_cond.wait(lock, [this] { return full_count > 0 || closed; });
-    if (closed) {
-        empty_cond.notify_all();
-        full_cond.notify_all();
+template <typename T> size_t Channel<T>::try_push_batch(T *data, size_t count) {
+    if (count == 0 || closed.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+    size_t position = enqueue_position.load(std::memory_order_relaxed);
+    size_t claimed;
+    while (true) {
+        // Positions past enqueue_position belong to nobody, free slots stay free until claimed.
+        claimed = 0;
+        while (claimed < count && slots[(position + claimed) & mask].sequence.load(
+                                      std::memory_order_acquire) == position + claimed) {
+            ++claimed;
+        }
+        if (claimed > 0) {
+            if (enqueue_position.compare_exchange_weak(position, position + claimed,
+                                                       std::memory_order_relaxed)) {
+                break;
+            }
+            continue;
+        }
+        size_t sequence = slots[position & mask].sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position) < 0) {
+            return 0;
+        }
+        position = enqueue_position.load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < claimed; ++i) {
+        Slot &slot = slots[(position + i) & mask];
+        new (slot.storage) T(std::move(data[i]));
+        slot.sequence.store(position + i + 1, std::memory_order_release);
+    }
+    not_empty.notify_n(static_cast<int>(claimed));
+    return claimed;
+}
+
+template <typename T> bool Channel<T>::try_pop(T &data) {
+    if (closed.load(std::memory_order_relaxed)) {
         return false;
     }
-    --full_count;
-    data = std::move(channel.front());
-    channel.pop();
-    ++empty_count;
-    empty_cond.notify_all();
+    size_t position = dequeue_position.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &slots[position & mask];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+        if (diff == 0) {
+            if (dequeue_position.compare_exchange_weak(position, position + 1,
+                                                       std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The producer of this position has not published it yet: empty.
+            return false;
+        } else {
+            position = dequeue_position.load(std::memory_order_relaxed);
+        }
+    }
+    T *item = std::launder(reinterpret_cast<T *>(slot->storage));
+    data = std::move(*item);
+    item->~T();
+    slot->sequence.store(position + mask + 1, std::memory_order_release);
+    not_full.notify_one();
     return true;
 }
 
+template <typename T>
+template <typename Try>
+bool Channel<T>::wait_until(Try attempt, EventCount &event) {
+    while (true) {
+        for (int i = 0; i < SPIN_COUNT; ++i) {
+            if (attempt()) {
+                return true;
+            }
+            if (closed.load(std::memory_order_relaxed)) {
+                return false;
+            }
+        }
+        uint32_t key = event.prepare_wait();
+        if (attempt()) {
+            event.cancel_wait();
+            return true;
+        }
+        if (closed.load(std::memory_order_relaxed)) {
+            event.cancel_wait();
+            return false;
+        }
+        event.wait(key);
+    }
+}
+
+template <typename T> bool Channel<T>::push(T &&data) {
+    return wait_until([this, &data] { return try_push(std::move(data)); }, not_full);
+}
+
+template <typename T> bool Channel<T>::pop(T &data) {
+    return wait_until([this, &data] { return try_pop(data); }, not_empty);
+}
+
+template <typename T> bool Channel<T>::push_batch(T *data, size_t count) {
+    size_t pushed = 0;
+    return wait_until(
+        [this, data, count, &pushed] {
+            pushed += try_push_batch(data + pushed, count - pushed);
+            return pushed == count;
+        },
+        not_full);
+}
+
+template <typename T> size_t Channel<T>::get_capacity() const { return mask + 1; }
+
 template <typename T> void Channel<T>::close() {
-    std::unique_lock<std::mutex> lock(mutex);
-    closed = true;
-    empty_cond.notify_all();
-    full_cond.notify_all();
+    closed.store(true);
+    not_empty.notify_all();
+    not_full.notify_all();
 }
 
 template <typename T> Sender<T>::Sender(std::shared_ptr<Channel<T>> channel) : channel(channel) {}
@@ -173,6 +384,18 @@ template <typename T> bool Sender<T>::send(T &&data) {
     return channel != nullptr && channel->push(std::move(data));
 }
 
+template <typename T> bool Sender<T>::try_send(T &&data) {
+    return channel != nullptr && channel->try_push(std::move(data));
+}
+
+template <typename T> bool Sender<T>::send_batch(T *data, size_t count) {
+    return channel != nullptr && channel->push_batch(data, count);
+}
+
+template <typename T> size_t Sender<T>::try_send_batch(T *data, size_t count) {
+    return channel != nullptr ? channel->try_push_batch(data, count) : 0;
+}
+
 template <typename T> void Sender<T>::close() {
     if (channel != nullptr) {
         channel->close();
@@ -188,67 +411,439 @@ template <typename T> bool Receiver<T>::receive(T &data) {
     return channel != nullptr && channel->pop(data);
 }
 
+template <typename T> bool Receiver<T>::try_receive(T &data) {
+    return channel != nullptr && channel->try_pop(data);
+}
+
+/**
+ * @brief Chase-Lev work-stealing deque of T pointers.
+ *
+ * The owning thread push()es and pop()s at the bottom, in LIFO order, without any atomic
+ * read-modify-write unless it races a thief for the last item. Other threads steal() the oldest
+ * item from the top with one compare-and-swap; nullptr means empty or a lost race. The ring
+ * doubles when full; replaced rings are kept until the deque is destroyed, as a thief may still
+ * be reading one. The deque does not own the items, whoever takes one frees it.
+ */
+template <typename T> class WorkDeque {
+  private:
+    struct Ring {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<T *>[]> items;
+
+        Ring(int64_t capacity)
+            : capacity(capacity), items(std::make_unique<std::atomic<T *>[]>(capacity)) {}
+        T *get(int64_t index) const {
+            return items[index & (capacity - 1)].load(std::memory_order_relaxed);
+        }
+        void put(int64_t index, T *item) {
+            items[index & (capacity - 1)].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    static constexpr int64_t INITIAL_CAPACITY = 256;
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    std::atomic<Ring *> ring;
+    std::vector<std::unique_ptr<Ring>> rings;
+
+  public:
+    WorkDeque();
+    ~WorkDeque();
+    WorkDeque(const WorkDeque &other) = delete;
+    WorkDeque &operator=(const WorkDeque &other) = delete;
+
+    void push(T *item);
+    T *pop();
+    T *steal();
+};
+
+template <typename T> WorkDeque<T>::WorkDeque() : top(0), bottom(0) {
+    rings.push_back(std::make_unique<Ring>(INITIAL_CAPACITY));
+    ring.store(rings.back().get(), std::memory_order_relaxed);
+}
+
+template <typename T> WorkDeque<T>::~WorkDeque() {}
+
+template <typename T> void WorkDeque<T>::push(T *item) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Ring *current = ring.load(std::memory_order_relaxed);
+    if (b - t >= current->capacity) {
+        auto grown = std::make_unique<Ring>(current->capacity * 2);
+        for (int64_t i = t; i < b; ++i) {
+            grown->put(i, current->get(i));
+        }
+        current = grown.get();
+        rings.push_back(std::move(grown));
+        ring.store(current, std::memory_order_release);
+    }
+    current->put(b, item);
+    bottom.store(b + 1, std::memory_order_release);
+}
+
+template <typename T> T *WorkDeque<T>::pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Ring *current = ring.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    if (t > b) {
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    T *item = current->get(b);
+    if (t == b) {
+        // The last item: whoever moves top first gets it.
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            item = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+}
+
+template <typename T> T *WorkDeque<T>::steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) {
+        return nullptr;
+    }
+    T *item = ring.load(std::memory_order_acquire)->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    return item;
+}
+
+/**
+ * @brief Nodes for T objects, handed out by one owning thread and freed by any thread.
+ *
+ * acquire() takes a node from the owner's free list. When that is empty it takes every node the
+ * other threads release()d since in one exchange, and only when there are none allocates a block
+ * of BLOCK_SIZE nodes. release() pushes the node back onto its slab with one compare-and-swap;
+ * only the owner takes them off, so the list has no ABA problem. The blocks are freed with the
+ * slab, which has to outlive every node it handed out.
+ */
+template <typename T> class JobSlab {
+  private:
+    struct Node {
+        // First, so a T * is the address of its Node.
+        alignas(T) unsigned char storage[sizeof(T)];
+        Node *next;
+        JobSlab<T> *slab;
+    };
+
+    static constexpr size_t BLOCK_SIZE = 256;
+    Node *free_list;
+    alignas(64) std::atomic<Node *> returned;
+    std::vector<std::unique_ptr<Node[]>> blocks;
+
+  public:
+    JobSlab() : free_list(nullptr), returned(nullptr) {}
+    JobSlab(const JobSlab &other) = delete;
+    JobSlab &operator=(const JobSlab &other) = delete;
+
+    T *acquire(T &&item);
+    static void release(T *item);
+};
+
+template <typename T> T *JobSlab<T>::acquire(T &&item) {
+    if (free_list == nullptr) {
+        free_list = returned.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (free_list == nullptr) {
+        std::unique_ptr<Node[]> block(new Node[BLOCK_SIZE]);
+        for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+            block[i].slab = this;
+            block[i].next = i + 1 < BLOCK_SIZE ? &block[i + 1] : nullptr;
+        }
+        free_list = block.get();
+        blocks.push_back(std::move(block));
+    }
+    Node *node = free_list;
+    free_list = node->next;
+    return new (node->storage) T(std::move(item));
+}
+
+template <typename T> void JobSlab<T>::release(T *item) {
+    Node *node = reinterpret_cast<Node *>(reinterpret_cast<unsigned char *>(item));
+    item->~T();
+    JobSlab<T> *slab = node->slab;
+    Node *head = slab->returned.load(std::memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!slab->returned.compare_exchange_weak(head, node, std::memory_order_release,
+                                                   std::memory_order_relaxed));
+}
+
+/**
+ * @brief How a ThreadPool hands jobs to its workers.
+ *
+ * - Shared: one Channel that every submit() and every worker goes through.
+ * - WorkStealing: every worker has its own WorkDeque. Jobs submitted from outside the pool go
+ *   through the Channel as an injection queue, jobs submitted or spawn()ed by a job stay on the
+ *   deque of the worker running it, which runs the newest first while its cache is warm. Idle
+ *   workers take from the injection queue and then steal the oldest job of a random other worker,
+ *   and park on an EventCount when there is nothing, so submitting only wakes a thread when one
+ *   sleeps. Queued jobs live in a JobSlab of the worker, so queueing one does not allocate.
+ */
+enum class Scheduling { Shared, WorkStealing };
+
+template <typename Job> class ThreadPool;
+
 template <typename Job> class Worker {
   private:
+    friend class ThreadPool<Job>;
+
+    static constexpr int SPIN_COUNT = 64;
+    static thread_local Worker<Job> *current;
     int id;
     std::thread thread;
+    ThreadPool<Job> *pool;
     Receiver<Job> *receiver;
+    JobSlab<Job> slab;
+    WorkDeque<Job> deque;
+    uint64_t random;
+
+    void start();
+    void run_shared();
+    void run_stealing();
+    bool find_job(Job &job);
 
   public:
-    Worker(int id, Receiver<Job> *receiver);
+    Worker(int id, ThreadPool<Job> *pool, Receiver<Job> *receiver);
     ~Worker();
 
     int get_id() const;
     void join();
+
+    /**
+     * @brief Queues a job from the job this worker is running. With WorkStealing it goes on this
+     * worker's deque, otherwise it is submit()ted to the pool.
+     */
+    void spawn(Job &&job);
 };
 
+/**
+ * @brief Runs jobs, callables taking the Worker<Job> * that runs them, on `num_workers` threads.
+ *
+ * submit() blocks while `capacity` jobs wait in the Channel, try_submit() returns false instead and
+ * leaves the job to the caller. submit_batch() moves `count` jobs
+ * from an array into the pool with one synchronization per run of free slots instead of one per
+ * job, and wakes as many workers as it queued jobs. Destroying the pool lets every
+ * worker finish its current job; jobs that did not start by then are dropped.
+ *
+ * @example
+ * ThreadPool<Task> pool(std::thread::hardware_concurrency(), 1024, Scheduling::WorkStealing);
+ * pool.submit(Task([](Worker<Task> *worker) { worker->spawn(Task(render)); }));
+ */
 template <typename Job> class ThreadPool {
   private:
+    friend class Worker<Job>;
+
     std::vector<Worker<Job> *> workers;
     Sender<Job> *sender;
+    Scheduling scheduling;
+    std::atomic<bool> stopping;
+    alignas(64) EventCount work;
 
   public:
-    ThreadPool(int num_workers);
+    ThreadPool(int num_workers, size_t capacity = Channel<Job>::DEFAULT_CAPACITY,
+               Scheduling scheduling = Scheduling::Shared);
     ~ThreadPool();
 
     void submit(Job &&job);
+    bool try_submit(Job &&job);
+    void submit_batch(Job *jobs, size_t count);
 };
 
-template <typename Job> ThreadPool<Job>::ThreadPool(int num_workers) {
+template <typename Job>
+ThreadPool<Job>::ThreadPool(int num_workers, size_t capacity, Scheduling scheduling)
+    : scheduling(scheduling), stopping(false) {
     Receiver<Job> *receiver;
-    Channel<Job>::create(&sender, &receiver);
+    Channel<Job>::create(&sender, &receiver, capacity);
     for (int i = 0; i < num_workers; ++i) {
-        auto worker = new Worker(i, new Receiver<Job>(*receiver));
+        auto worker = new Worker(i, this, new Receiver<Job>(*receiver));
         workers.push_back(worker);
     }
+    // Thieves look at every worker, so none may run before all exist.
+    for (auto worker : workers) {
+        worker->start();
+    }
 
     delete receiver;
 }
 
 template <typename Job> ThreadPool<Job>::~ThreadPool() {
+    stopping.store(true);
     sender->close();
+    work.notify_all();
     for (auto worker : workers) {
         worker->join();
-        fmt::print("Worker {} joined", worker->get_id());
+    }
+    // Only now, a worker still running may be stealing from any other.
+    for (auto worker : workers) {
         delete worker;
     }
     delete sender;
 }
 
-template <typename Job> void ThreadPool<Job>::submit(Job &&job) { sender->send(std::move(job)); }
+template <typename Job> void ThreadPool<Job>::submit(Job &&job) {
+    if (scheduling == Scheduling::Shared) {
+        sender->send(std::move(job));
+        return;
+    }
+    Worker<Job> *worker = Worker<Job>::current;
+    if (worker != nullptr && worker->pool == this) {
+        worker->spawn(std::move(job));
+        return;
+    }
+    if (sender->send(std::move(job))) {
+        work.notify_one();
+    }
+}
+
+template <typename Job> bool ThreadPool<Job>::try_submit(Job &&job) {
+    if (scheduling == Scheduling::Shared) {
+        return sender->try_send(std::move(job));
+    }
+    Worker<Job> *worker = Worker<Job>::current;
+    if (worker != nullptr && worker->pool == this) {
+        worker->spawn(std::move(job));
+        return true;
+    }
+    if (!sender->try_send(std::move(job))) {
+        return false;
+    }
+    work.notify_one();
+    return true;
+}
+
+template <typename Job> void ThreadPool<Job>::submit_batch(Job *jobs, size_t count) {
+    if (scheduling == Scheduling::Shared) {
+        sender->send_batch(jobs, count);
+        return;
+    }
+    Worker<Job> *worker = Worker<Job>::current;
+    if (worker != nullptr && worker->pool == this) {
+        for (size_t i = 0; i < count; ++i) {
+            worker->deque.push(worker->slab.acquire(std::move(jobs[i])));
+        }
+        work.notify_n(static_cast<int>(count));
+        return;
+    }
+    // Parked workers only wake up for `work`, so each part has to be announced before waiting
+    // for room to queue the next.
+    size_t queued = 0;
+    while (queued < count) {
+        size_t n = sender->try_send_batch(jobs + queued, count - queued);
+        if (n == 0) {
+            if (!sender->send(std::move(jobs[queued]))) {
+                return;
+            }
+            n = 1;
+        }
+        work.notify_n(static_cast<int>(n));
+        queued += n;
+    }
+}
+
+template <typename Job> thread_local Worker<Job> *Worker<Job>::current = nullptr;
 
 template <typename Job>
-Worker<Job>::Worker(int id, Receiver<Job> *receiver) : id(id), receiver(receiver) {
+Worker<Job>::Worker(int id, ThreadPool<Job> *pool, Receiver<Job> *receiver)
+    : id(id), pool(pool), receiver(receiver),
+      random(0x9e3779b97f4a7c15ull * static_cast<uint64_t>(id + 1)) {}
+
+template <typename Job> Worker<Job>::~Worker() {
+    // Every worker has stopped: the jobs left are dropped, and their nodes returned before the
+    // slab goes.
+    while (Job *job = deque.pop()) {
+        JobSlab<Job>::release(job);
+    }
+    delete receiver;
+}
+
+template <typename Job> void Worker<Job>::start() {
     thread = std::thread([this] {
-        Job job;
-        while (this->receiver->receive(job)) {
-            job(this);
+        current = this;
+        if (pool->scheduling == Scheduling::WorkStealing) {
+            run_stealing();
+        } else {
+            run_shared();
         }
     });
 }
-template <typename Job> Worker<Job>::~Worker() { delete receiver; }
+
+template <typename Job> void Worker<Job>::run_shared() {
+    Job job;
+    while (receiver->receive(job)) {
+        job(this);
+    }
+}
+
+template <typename Job> bool Worker<Job>::find_job(Job &job) {
+    Job *found = deque.pop();
+    if (found == nullptr && receiver->try_receive(job)) {
+        return true;
+    }
+    size_t count = pool->workers.size();
+    if (found == nullptr && count > 1) {
+        // xorshift64, only has to spread the thieves over the victims.
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        size_t start = random % count;
+        for (size_t i = 0; i < count && found == nullptr; ++i) {
+            Worker<Job> *victim = pool->workers[(start + i) % count];
+            if (victim != this) {
+                found = victim->deque.steal();
+            }
+        }
+    }
+    if (found == nullptr) {
+        return false;
+    }
+    job = std::move(*found);
+    JobSlab<Job>::release(found);
+    return true;
+}
+
+template <typename Job> void Worker<Job>::run_stealing() {
+    Job job;
+    while (!pool->stopping.load(std::memory_order_relaxed)) {
+        bool found = false;
+        for (int i = 0; i < SPIN_COUNT && !found; ++i) {
+            found = find_job(job);
+        }
+        if (!found) {
+            uint32_t key = pool->work.prepare_wait();
+            found = find_job(job);
+            if (found || pool->stopping.load()) {
+                pool->work.cancel_wait();
+            } else {
+                pool->work.wait(key);
+            }
+        }
+        if (found) {
+            job(this);
+        }
+    }
+}
+
+template <typename Job> void Worker<Job>::spawn(Job &&job) {
+    if (pool->scheduling == Scheduling::Shared) {
+        pool->submit(std::move(job));
+        return;
+    }
+    deque.push(slab.acquire(std::move(job)));
+    pool->work.notify_one();
+}
 
 template <typename Job> int Worker<Job>::get_id() const { return id; }
 template <typename Job> void Worker<Job>::join() { thread.join(); }
 
-} // namespace mpmc
\ No newline at end of file
+} // namespace mpmc
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace mpmc {
+
+namespace evtlp {
+
+using TimerId = uint64_t;
+
+/**
+ * @brief Hierarchical timing wheel driven by a single timerfd.
+ *
+ * Four levels of 256 slots cover 2^32 ticks. add(), cancel() and reschedule() are O(1): a timer
+ * is an intrusive list node in one slot and is moved down a level when its slot comes up. The
+ * timerfd is armed one-shot for the next non-empty slot of the lowest level (or the next cascade),
+ * so an idle wheel does not wake the loop every tick.
+ *
+ * Register get_fd() for EPOLLIN and call handle_expired() when it is readable.
+ *
+ * @note Not thread-safe, a wheel belongs to the loop that drives it. Callbacks may add, cancel
+ * or reschedule timers, including their own.
+ *
+ * @example
+ * TimerWheel wheel(10);
+ * TimerId id = wheel.add(5000, [] { fmt::print("idle\n"); });
+ * wheel.reschedule(id, 5000);
+ * wheel.cancel(id);
+ */
+class TimerWheel {
+  private:
+    struct Node {
+        uint32_t prev;
+        uint32_t next;
+        uint32_t generation = 0;
+        uint32_t slot = NONE;
+        uint64_t expire = 0;
+        uint64_t interval = 0;
+        std::function<void()> callback;
+    };
+
+    static constexpr int LEVELS = 4;
+    static constexpr int SLOT_BITS = 8;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr uint32_t SLOT_MASK = SLOTS - 1;
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr uint32_t EXPIRED = LEVELS * SLOTS;
+    static constexpr uint32_t FIRST_NODE = EXPIRED + 1;
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> free_nodes;
+    uint64_t occupied[SLOTS / 64];
+    uint64_t start_ns;
+    uint64_t current;
+    uint64_t armed;
+    size_t count;
+    int tick_ms;
+    int timer_fd;
+
+    uint64_t now_tick() const;
+    uint64_t ticks(uint64_t ms) const;
+    void link(uint32_t index, uint32_t slot);
+    void unlink(uint32_t index);
+    void place(uint32_t index);
+    void cascade(int level);
+    void run_tick();
+    void arm(uint64_t tick);
+    void rearm();
+    Node *lookup(TimerId id);
+
+  public:
+    TimerWheel(int tick_ms = 10);
+    ~TimerWheel();
+    TimerWheel(const TimerWheel &other) = delete;
+    TimerWheel &operator=(const TimerWheel &other) = delete;
+
+    int get_fd() const;
+    size_t size() const;
+    TimerId add(uint64_t delay_ms, std::function<void()> callback, uint64_t interval_ms = 0);
+    bool cancel(TimerId id);
+    bool reschedule(TimerId id, uint64_t delay_ms);
+    void handle_expired();
+};
+
+} // namespace evtlp
+
+} // namespace mpmc
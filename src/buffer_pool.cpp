@@ -0,0 +1,143 @@
+#include "buffer_pool.h"
+#include <fmt/format.h>
+#include <stdexcept>
+
+namespace mpmc {
+
+SlabPool::SlabPool(size_t block_size, size_t slab_blocks)
+    : block_size(block_size), slab_blocks(slab_blocks), blocks(0), in_use(0), high_water(0),
+      misses(0), oversized(0) {
+    if (block_size == 0 || block_size % alignof(std::max_align_t) != 0 || slab_blocks == 0) {
+        throw std::runtime_error(fmt::format(
+            "block_size must be a non-zero multiple of {} and slab_blocks greater than 0",
+            alignof(std::max_align_t)));
+    }
+    grow();
+}
+
+void SlabPool::grow() {
+    int first = slabs.size() * slab_blocks;
+    slabs.emplace_back(new char[block_size * slab_blocks]);
+    for (int i = slab_blocks - 1; i >= 0; --i) {
+        free_blocks.push_back(first + i);
+    }
+    blocks.store(blocks.load(std::memory_order_relaxed) + slab_blocks, std::memory_order_relaxed);
+}
+
+int SlabPool::acquire() {
+    if (free_blocks.empty()) {
+        misses.store(misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        grow();
+    }
+    int id = free_blocks.back();
+    free_blocks.pop_back();
+    // Only the owning thread writes the counters, loads and stores need no read-modify-write.
+    size_t used = in_use.load(std::memory_order_relaxed) + 1;
+    in_use.store(used, std::memory_order_relaxed);
+    if (used > high_water.load(std::memory_order_relaxed)) {
+        high_water.store(used, std::memory_order_relaxed);
+    }
+    return id;
+}
+
+void SlabPool::release(int id) {
+    free_blocks.push_back(id);
+    in_use.store(in_use.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+char *SlabPool::at(int id) const {
+    return slabs[id / slab_blocks].get() + (id % slab_blocks) * block_size;
+}
+
+char *SlabPool::slab(size_t index) const { return slabs[index].get(); }
+
+size_t SlabPool::get_block_size() const { return block_size; }
+
+size_t SlabPool::get_slab_blocks() const { return slab_blocks; }
+
+void SlabPool::record_oversized() {
+    oversized.store(oversized.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+PoolStats SlabPool::get_stats() const {
+    return {block_size,
+            blocks.load(std::memory_order_relaxed),
+            in_use.load(std::memory_order_relaxed),
+            high_water.load(std::memory_order_relaxed),
+            misses.load(std::memory_order_relaxed),
+            oversized.load(std::memory_order_relaxed)};
+}
+
+static char *align_up(char *pointer, size_t alignment) {
+    auto address = reinterpret_cast<uintptr_t>(pointer);
+    return reinterpret_cast<char *>((address + alignment - 1) & ~(alignment - 1));
+}
+
+Arena::Arena(SlabPool &pool, int id)
+    : pool(&pool), id(id), chunks(nullptr), cursor(reinterpret_cast<char *>(this + 1)),
+      limit(pool.at(id) + pool.get_block_size()) {
+    keep();
+}
+
+Arena::~Arena() {
+    kept_chunks = nullptr;
+    reset();
+}
+
+ArenaPtr Arena::create(SlabPool &pool) {
+    int id = pool.acquire();
+    return ArenaPtr(new (pool.at(id)) Arena(pool, id));
+}
+
+void Arena::Deleter::operator()(Arena *arena) const {
+    SlabPool *pool = arena->pool;
+    int id = arena->id;
+    arena->~Arena();
+    pool->release(id);
+}
+
+void *Arena::do_allocate(size_t bytes, size_t alignment) {
+    size_t block_size = pool->get_block_size();
+    if (bytes > block_size / 2 || alignment > alignof(std::max_align_t)) {
+        pool->record_oversized();
+        return ::operator new(bytes, std::align_val_t(alignment));
+    }
+    char *begin = align_up(cursor, alignment);
+    if (begin + bytes > limit) {
+        int chunk_id = pool->acquire();
+        char *block = pool->at(chunk_id);
+        chunks = new (block) Chunk{chunks, chunk_id};
+        limit = block + block_size;
+        begin = align_up(block + sizeof(Chunk), alignment);
+    }
+    cursor = begin + bytes;
+    return begin;
+}
+
+void Arena::do_deallocate(void *pointer, size_t bytes, size_t alignment) {
+    if (bytes > pool->get_block_size() / 2 || alignment > alignof(std::max_align_t)) {
+        ::operator delete(pointer, bytes, std::align_val_t(alignment));
+    }
+}
+
+bool Arena::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+    return this == &other;
+}
+
+void Arena::keep() {
+    kept_chunks = chunks;
+    kept_cursor = cursor;
+    kept_limit = limit;
+}
+
+void Arena::reset() {
+    while (chunks != kept_chunks) {
+        Chunk *chunk = chunks;
+        chunks = chunk->next;
+        pool->release(chunk->id);
+    }
+    cursor = kept_cursor;
+    limit = kept_limit;
+}
+
+} // namespace mpmc
@@ -0,0 +1,249 @@
+#include "coroutine.h"
+#include "event_loop.h"
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace mpmc {
+
+namespace evtlp {
+
+thread_local FramePool *FramePool::current = nullptr;
+
+FramePool::Scope::Scope(FramePool &pool) : previous(std::exchange(current, &pool)) {}
+
+FramePool::Scope::~Scope() { current = previous; }
+
+FramePool::FramePool() {
+    for (size_t size : CLASSES) {
+        pools.push_back(std::make_unique<SlabPool>(size, SLAB_BLOCKS));
+    }
+}
+
+void *FramePool::allocate(size_t size) {
+    size_t needed = size + sizeof(Header);
+    if (current != nullptr) {
+        for (size_t i = 0; i < std::size(CLASSES); ++i) {
+            if (needed <= CLASSES[i]) {
+                SlabPool &pool = *current->pools[i];
+                int id = pool.acquire();
+                Header *header = reinterpret_cast<Header *>(pool.at(id));
+                header->pool = &pool;
+                header->id = id;
+                return header + 1;
+            }
+        }
+        current->pools.back()->record_oversized();
+    }
+    Header *header = static_cast<Header *>(::operator new(needed));
+    header->pool = nullptr;
+    return header + 1;
+}
+
+void FramePool::deallocate(void *frame) {
+    Header *header = static_cast<Header *>(frame) - 1;
+    if (header->pool != nullptr) {
+        header->pool->release(header->id);
+    } else {
+        ::operator delete(header);
+    }
+}
+
+std::vector<PoolStats> FramePool::get_stats() const {
+    std::vector<PoolStats> stats;
+    for (auto &pool : pools) {
+        stats.push_back(pool->get_stats());
+    }
+    return stats;
+}
+
+PromiseBase::~PromiseBase() {
+    if (roots == nullptr) {
+        return;
+    }
+    if (prev != nullptr) {
+        prev->next = next;
+    } else {
+        *roots = next;
+    }
+    if (next != nullptr) {
+        next->prev = prev;
+    }
+}
+
+void PromiseBase::link(PromiseBase **roots, std::coroutine_handle<> self) {
+    this->roots = roots;
+    this->self = self;
+    next = *roots;
+    if (next != nullptr) {
+        next->prev = this;
+    }
+    *roots = this;
+}
+
+std::coroutine_handle<> PromiseBase::finish() {
+    if (continuation) {
+        return continuation;
+    }
+    if (roots != nullptr) {
+        if (error) {
+            try {
+                std::rethrow_exception(error);
+            } catch (std::exception &e) {
+                std::cerr << e.what() << "\n";
+            } catch (...) {
+                std::cerr << "Spawned coroutine failed\n";
+            }
+        }
+        // Nobody awaits a spawned task, it is done with itself. Destroying it unlinks it.
+        self.destroy();
+    }
+    return std::noop_coroutine();
+}
+
+void PromiseBase::rethrow() {
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+io_uring_sqe *OperationAwaiter::get_sqe() const { return loop->get_sqe(); }
+
+void OperationAwaiter::resume_with(io_uring_sqe *sqe, std::coroutine_handle<> handle) const {
+    // User space addresses leave the top byte free for the tag.
+    uint64_t address = reinterpret_cast<uintptr_t>(handle.address());
+    io_uring_sqe_set_data64(sqe, make_token(0, 0, RingEventLoop::RESUME) | address);
+}
+
+int OperationAwaiter::await_resume() const { return loop->completion_result; }
+
+void RecvAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_recv(sqe, fd, buffer, size, 0);
+    resume_with(sqe, handle);
+}
+
+std::string_view RecvAwaiter::await_resume() const {
+    int n = OperationAwaiter::await_resume();
+    return n > 0 ? std::string_view(buffer, n) : std::string_view();
+}
+
+void SendAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_sendmsg(sqe, fd, message, MSG_NOSIGNAL);
+    resume_with(sqe, handle);
+}
+
+SleepAwaiter::SleepAwaiter(RingEventLoop *loop, int ms) : OperationAwaiter(loop) {
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_nsec = static_cast<long long>(ms % 1000) * 1000000;
+}
+
+void SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_timeout(sqe, &timeout, 0, 0);
+    resume_with(sqe, handle);
+}
+
+SleepAwaiter sleep_for(int ms) {
+    RingEventLoop *loop = RingEventLoop::get_current();
+    if (loop == nullptr) {
+        throw std::runtime_error("sleep_for() must be awaited on a running RingEventLoop");
+    }
+    return SleepAwaiter(loop, ms);
+}
+
+AsyncConnection::AsyncConnection(RingEventLoop *loop, int fd)
+    : loop(loop), fd(fd), buffer_id(loop->buffers.acquire()), arena(Arena::create(loop->arenas)),
+      input(arena.get()), parser(loop->header_limit, loop->body_limit, arena.get()),
+      writer(arena.get()), consumed(0) {}
+
+AsyncConnection::~AsyncConnection() {
+    // Not recycle_buffer(): the block never belonged to the provided buffer ring.
+    loop->buffers.release(buffer_id);
+    close(fd);
+}
+
+int AsyncConnection::get_fd() const { return fd; }
+
+ResponseWriter &AsyncConnection::get_writer() { return writer; }
+
+RequestView AsyncConnection::request() { return parser.view(input.data()); }
+
+void AsyncConnection::recycle() {
+    // Idle between requests: nothing references the request memory in the arena any more.
+    parser.release();
+    writer.release();
+    release(input);
+    arena->reset();
+}
+
+RecvAwaiter AsyncConnection::recv() {
+    return RecvAwaiter(loop, fd, loop->buffers.at(buffer_id), loop->buffers.get_block_size());
+}
+
+AsyncTask<bool> AsyncConnection::send(std::string_view data) {
+    while (!data.empty()) {
+        iovec vector = {const_cast<char *>(data.data()), data.size()};
+        msghdr message = {};
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        int n = co_await SendAwaiter(loop, fd, &message);
+        if (n <= 0) {
+            co_return false;
+        }
+        data.remove_prefix(n);
+    }
+    co_return true;
+}
+
+AsyncTask<bool> AsyncConnection::flush() {
+    while (!writer.empty()) {
+        size_t count;
+        msghdr message = {};
+        message.msg_iov = const_cast<iovec *>(writer.data(count));
+        message.msg_iovlen = count;
+        int n = co_await SendAwaiter(loop, fd, &message);
+        if (n <= 0) {
+            writer.clear();
+            co_return false;
+        }
+        writer.consume(n);
+    }
+    co_return true;
+}
+
+AsyncTask<bool> AsyncConnection::read_request() {
+    if (consumed > 0) {
+        // The previous request is answered.
+        input.erase(0, consumed);
+        consumed = 0;
+        parser.reset();
+    }
+    if (input.empty() && writer.empty()) {
+        recycle();
+    }
+    while (true) {
+        auto result = parser.parse(input.data(), input.size());
+        if (result == RequestParser::Result::Complete) {
+            consumed = parser.length();
+            co_return true;
+        }
+        if (result == RequestParser::Result::Error) {
+            writer.error(parser.error());
+            co_await flush();
+            co_return false;
+        }
+        input.reserve(parser.expected_length());
+        std::string_view data = co_await recv();
+        if (data.empty()) {
+            co_return false;
+        }
+        input.append(data);
+    }
+}
+
+} // namespace evtlp
+
+} // namespace mpmc
@@ -1,295 +1,1733 @@
 #include "event_loop.h"
 #include "network.h"
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
 #include <stdexcept>
-#include <sys/timerfd.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
+#include <utility>
 
 namespace mpmc {
 
 namespace evtlp {
 
-constexpr const char *LOREM =
-    "But I must explain to you how all this mistaken idea of denouncing pleasure and praising pain "
-    "was born and I will give you a complete account of the system, and expound the actual "
-    "teachings of the great explorer of the truth, the master-builder of human happiness. No one "
-    "rejects, dislikes, or avoids pleasure itself, because it is pleasure, but because those who "
-    "do not know how to pursue pleasure rationally encounter consequences that are extremely "
-    "painful. Nor again is there anyone who loves or pursues or desires to obtain pain of itself, "
-    "because it is pain, but because occasionally circumstances occur in which toil and pain can "
-    "procure him some great pleasure. To take a trivial example, which of us ever undertakes "
-    "laborious physical exercise, except to obtain some advantage from it? But who has any right "
-    "to find fault with a man who chooses to enjoy a pleasure that has no annoying consequences, "
-    "or one who avoids a pain that produces no resultant pleasure?";
-
-RingEventLoop::RingEventLoop() {
-    if (io_uring_queue_init(QUEUE_LENGTH, &ring, 0) < 0) {
-        throw std::runtime_error(
-            fmt::format("Failed to init io_uring, errors: {}", strerror(errno)));
+/**
+ * @brief Answers `request` through `router`, or with 404 without one. A file body to send after
+ * the head is returned, a body to stream is left in `stream`, and `keep_alive` is cleared if the
+ * response ends the connection. Given `offloaded`, a request for an offloaded route is not
+ * answered and `*offloaded` is set instead.
+ */
+static FileResponse respond(const Router *router, const RequestView &request, bool &keep_alive,
+                            ResponseWriter &writer, std::unique_ptr<BodyStream> &stream,
+                            bool *offloaded = nullptr) {
+    if (router == nullptr) {
+        writer.error(StatusCode::NotFound, keep_alive);
+        return FileResponse();
+    }
+    RouteContext context(request, writer, keep_alive);
+    context.can_offload = offloaded != nullptr;
+    router->dispatch(context);
+    if (offloaded != nullptr) {
+        *offloaded = context.offloaded;
     }
+    keep_alive = context.keep_alive;
+    stream = std::move(context.stream);
+    return std::move(context.file);
 }
 
-RingEventLoop::~RingEventLoop() { io_uring_queue_exit(&ring); }
+static int create_epoll() {
+    int fd = epoll_create1(0);
+    if (fd == -1) {
+        throw std::runtime_error(fmt::format("Failed to create epoll, error: {}", strerror(errno)));
+    }
+    return fd;
+}
 
-void RingEventLoop::listen(const char *ip, int port) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
+static void add_timer_fd(int epoll_fd, int timer_fd) {
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = make_token(timer_fd, 0, static_cast<uint8_t>(FdType::Timer));
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) == -1) {
+        throw std::runtime_error(
+            fmt::format("Failed to add timer to epoll, error: {}", strerror(errno)));
+    }
+}
+
+static int create_wakeup_fd(int epoll_fd) {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     if (fd == -1) {
         throw std::runtime_error(
-            fmt::format("Failed to create socket, error: {}", strerror(errno)));
+            fmt::format("Failed to create eventfd, error: {}", strerror(errno)));
+    }
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = make_token(fd, 0, static_cast<uint8_t>(FdType::Wakeup));
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        throw std::runtime_error(
+            fmt::format("Failed to add eventfd to epoll, error: {}", strerror(errno)));
     }
+    return fd;
+}
+
+RingEventLoop::RingEventLoop(const RingConfig &config)
+    : config(config), setup_flags(0), buffers(BUFFER_SIZE, BUFFER_COUNT),
+      arenas(ARENA_BLOCK_SIZE, ARENA_SLAB_BLOCKS), buf_ring(nullptr), zerocopy(false),
+      connections(0), requests(0), running(false), router(nullptr),
+      header_limit(RequestParser::DEFAULT_HEADER_LIMIT),
+      body_limit(RequestParser::DEFAULT_BODY_LIMIT), wakeup_value(0), pool(nullptr),
+      offload_value(0), accept_backoff{0, ACCEPT_BACKOFF_MS * 1000000LL}, roots(nullptr),
+      completion_result(0) {
+    setup_ring();
+    setup_buffers();
+    io_uring_probe *probe = io_uring_get_probe_ring(&ring);
+    if (probe != nullptr) {
+        zerocopy = io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+        io_uring_free_probe(probe);
+    }
+    wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        if (buf_ring != nullptr) {
+            io_uring_free_buf_ring(&ring, buf_ring, BUFFER_COUNT, BUFFER_GROUP);
+        }
+        io_uring_queue_exit(&ring);
+        throw std::runtime_error(
+            fmt::format("Failed to create eventfd, error: {}", strerror(errno)));
+    }
+}
+
+RingEventLoop::~RingEventLoop() {
+    if (buf_ring != nullptr) {
+        io_uring_free_buf_ring(&ring, buf_ring, BUFFER_COUNT, BUFFER_GROUP);
+    }
+    io_uring_queue_exit(&ring);
+    // Coroutines waiting for a completion that will not come any more.
+    while (roots != nullptr) {
+        roots->self.destroy();
+    }
+    for (auto &socket : socket_map) {
+        close(socket.first);
+    }
+    connection_table.for_each([](int fd, Connection &connection) {
+        if (connection.pipe_fds[0] != -1) {
+            close(connection.pipe_fds[0]);
+            close(connection.pipe_fds[1]);
+        }
+        close(fd);
+    });
+    close(wakeup_fd);
+}
+
+void RingEventLoop::listen(const char *ip, int port, bool reuse_port) {
+    int fd = listen_socket(ip, port, listen_options, false, reuse_port);
     sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = inet_addr(ip);
-    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
-        throw std::runtime_error(fmt::format("Failed to bind socket, error: {}", strerror(errno)));
-    }
-    if (::listen(fd, 10) == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to listen on socket, error: {}", strerror(errno)));
-    }
     socket_map.insert({
         fd, {addr, sizeof(addr)}
     });
 }
 
-void RingEventLoop::prepare_accept(int socket_fd) {
+void RingEventLoop::set_listen_options(const ListenOptions &options) { listen_options = options; }
+
+thread_local RingEventLoop *RingEventLoop::current = nullptr;
+
+RingEventLoop *RingEventLoop::get_current() { return current; }
+
+uint64_t RingEventLoop::make_user_data(Operation op, int fd) {
+    if (op == ACCEPT || op == ACCEPT_RETRY || op == WAKEUP || op == OFFLOAD) {
+        return make_token(fd, 0, op);
+    }
+    return connection_table.token(fd, op);
+}
+
+io_uring_sqe *RingEventLoop::get_sqe() {
     io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    io_uring_prep_accept(sqe, socket_fd, reinterpret_cast<sockaddr *>(&socket_map[socket_fd].first),
-                         &socket_map[socket_fd].second, 0);
-    io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(socket_fd));
+    if (sqe == nullptr) {
+        // The submission queue is full: flush it and retry once.
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+        if (sqe == nullptr) {
+            throw std::runtime_error("Failed to get sqe, submission queue is full");
+        }
+    }
+    return sqe;
 }
 
-void RingEventLoop::accept(int socket_fd, int client_fd) {
-    if (client_fd == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to accept client, error: {}", strerror(errno)));
+void RingEventLoop::setup_ring() {
+    unsigned flags = 0;
+    if (config.single_issuer) {
+        flags |= IORING_SETUP_SINGLE_ISSUER;
+    }
+    if (config.sqpoll) {
+        flags |= IORING_SETUP_SQPOLL;
+        if (config.sq_thread_cpu >= 0) {
+            flags |= IORING_SETUP_SQ_AFF;
+        }
+    } else {
+        if (config.single_issuer && config.defer_taskrun) {
+            flags |= IORING_SETUP_DEFER_TASKRUN;
+        }
+        if (config.coop_taskrun) {
+            flags |= IORING_SETUP_COOP_TASKRUN;
+        }
+    }
+    auto init = [this](unsigned flags) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = flags;
+        params.sq_thread_idle = config.sq_thread_idle;
+        params.sq_thread_cpu = config.sq_thread_cpu >= 0 ? config.sq_thread_cpu : 0;
+        return io_uring_queue_init_params(config.entries, &ring, &params);
+    };
+    int ret = init(flags);
+    // Every option is best effort. A kernel that lacks a setup flag answers EINVAL, and one that
+    // forbids it (SQPOLL without privileges on older kernels) EPERM: the flag is dropped and the
+    // setup retried, newest kernel requirements first. config is updated to what took effect.
+    const unsigned optional[] = {IORING_SETUP_DEFER_TASKRUN, IORING_SETUP_SINGLE_ISSUER,
+                                 IORING_SETUP_COOP_TASKRUN,
+                                 IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF};
+    for (unsigned flag : optional) {
+        if (ret != -EINVAL && ret != -EPERM) {
+            break;
+        }
+        if (flags & flag) {
+            flags &= ~flag;
+            ret = init(flags);
+        }
+    }
+    if (ret < 0) {
+        throw std::runtime_error(fmt::format("Failed to init io_uring, errors: {}", strerror(-ret)));
     }
-    client_buffers.insert({client_fd, new char[BUFFER_SIZE]});
+    setup_flags = flags;
+    config.sqpoll = flags & IORING_SETUP_SQPOLL;
+    config.single_issuer = flags & IORING_SETUP_SINGLE_ISSUER;
+    config.defer_taskrun = flags & IORING_SETUP_DEFER_TASKRUN;
+    config.coop_taskrun = flags & IORING_SETUP_COOP_TASKRUN;
+    // Saves the ring fd lookup on every io_uring_enter, harmless if unsupported.
+    io_uring_register_ring_fd(&ring);
+    // Without a registered file table sockets are submitted by their plain fd.
+    if (config.register_files && io_uring_register_files_sparse(&ring, config.max_files) < 0) {
+        config.register_files = false;
+    }
+}
+
+void RingEventLoop::setup_buffers() {
+    int ret = 0;
+    if (config.provided_buffers) {
+        buf_ring = io_uring_setup_buf_ring(&ring, BUFFER_COUNT, BUFFER_GROUP, 0, &ret);
+    }
+    if (buf_ring != nullptr) {
+        // The ring owns the whole first slab, recycle_buffer() returns buffers to it.
+        for (int i = 0; i < BUFFER_COUNT; ++i) {
+            int buffer_id = buffers.acquire();
+            io_uring_buf_ring_add(buf_ring, buffers.at(buffer_id), BUFFER_SIZE, buffer_id,
+                                  io_uring_buf_ring_mask(BUFFER_COUNT), i);
+        }
+        io_uring_buf_ring_advance(buf_ring, BUFFER_COUNT);
+        config.fixed_buffers = false;
+        return;
+    }
+    // No buffer ring (disabled, or an older kernel): every connection reads single-shot into a
+    // buffer of its own from the pool, registered if possible so reads skip mapping the pages.
+    config.provided_buffers = false;
+    if (config.fixed_buffers) {
+        iovec pool = {buffers.slab(0), BUFFER_COUNT * BUFFER_SIZE};
+        config.fixed_buffers = io_uring_register_buffers(&ring, &pool, 1) == 0;
+    }
+}
+
+void RingEventLoop::register_file(int fd) {
+    if (!config.register_files || static_cast<unsigned>(fd) >= config.max_files) {
+        return;
+    }
+    if (io_uring_register_files_update(&ring, fd, &fd, 1) == 1) {
+        connection_table.get(fd)->fixed_file = true;
+    }
+}
+
+void RingEventLoop::unregister_file(int fd) {
+    Connection &connection = *connection_table.get(fd);
+    if (connection.fixed_file) {
+        // The table holds its own reference, the socket is not released by close() alone.
+        int none = -1;
+        io_uring_register_files_update(&ring, fd, &none, 1);
+        connection.fixed_file = false;
+    }
+}
+
+unsigned RingEventLoop::file_flags(int fd) {
+    return connection_table.get(fd)->fixed_file ? IOSQE_FIXED_FILE : 0;
+}
+
+int RingEventLoop::take_buffer(int fd, uint32_t flags) {
+    if (flags & IORING_CQE_F_BUFFER) {
+        return flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    if (buf_ring != nullptr) {
+        return -1;
+    }
+    Connection &connection = *connection_table.get(fd);
+    int buffer_id = connection.buffer_id;
+    connection.buffer_id = -1;
+    return buffer_id;
+}
+
+void RingEventLoop::recycle_buffer(int buffer_id) {
+    if (buf_ring == nullptr) {
+        buffers.release(buffer_id);
+        return;
+    }
+    io_uring_buf_ring_add(buf_ring, buffers.at(buffer_id), BUFFER_SIZE, buffer_id,
+                          io_uring_buf_ring_mask(BUFFER_COUNT), 0);
+    io_uring_buf_ring_advance(buf_ring, 1);
+}
+
+void RingEventLoop::prepare_accept(int socket_fd) {
+    // One multishot accept posts a completion per connection until it is cancelled or fails.
+    io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_multishot_accept(sqe, socket_fd, nullptr, nullptr, 0);
+    io_uring_sqe_set_data64(sqe, make_user_data(ACCEPT, socket_fd));
+}
+
+void RingEventLoop::prepare_accept_retry(int socket_fd) {
+    // The client stays in the backlog: re-arming now would fail again at once.
+    io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_timeout(sqe, &accept_backoff, 0, 0);
+    io_uring_sqe_set_data64(sqe, make_user_data(ACCEPT_RETRY, socket_fd));
+}
+
+void RingEventLoop::accept(int client_fd) {
+    if (client_fd < 0) {
+        // EMFILE, ECONNABORTED and the like fail one client, not the loop.
+        log_accept_error(-client_fd);
+        return;
+    }
+    connections.fetch_add(1, std::memory_order_relaxed);
+    if (async_handler) {
+        spawn(serve_async(client_fd));
+        return;
+    }
+    connection_table.emplace(client_fd, FdType::Client, Arena::create(arenas), header_limit,
+                             body_limit);
+    register_file(client_fd);
     prepare_read(client_fd);
-    prepare_accept(socket_fd);
 }
 
 void RingEventLoop::prepare_read(int client_fd) {
-    io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    io_uring_prep_read(sqe, client_fd, client_buffers[client_fd], BUFFER_SIZE, 0);
-    io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(client_fd));
+    Connection &connection = *connection_table.get(client_fd);
+    if (buf_ring != nullptr) {
+        io_uring_sqe *sqe = get_sqe();
+        io_uring_prep_recv_multishot(sqe, client_fd, nullptr, 0, 0);
+        io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT | file_flags(client_fd));
+        sqe->buf_group = BUFFER_GROUP;
+        io_uring_sqe_set_data64(sqe, make_user_data(RECV, client_fd));
+        connection.reading = true;
+        return;
+    }
+    // Once every buffer is held by an armed read the pool grows by an unregistered slab.
+    connection.buffer_id = buffers.acquire();
+    char *buffer = buffers.at(connection.buffer_id);
+    io_uring_sqe *sqe = get_sqe();
+    if (config.fixed_buffers && connection.buffer_id < BUFFER_COUNT) {
+        io_uring_prep_read_fixed(sqe, client_fd, buffer, BUFFER_SIZE, 0, 0);
+    } else {
+        io_uring_prep_recv(sqe, client_fd, buffer, BUFFER_SIZE, 0);
+    }
+    io_uring_sqe_set_flags(sqe, file_flags(client_fd));
+    io_uring_sqe_set_data64(sqe, make_user_data(RECV, client_fd));
+    connection.reading = true;
+}
+
+void RingEventLoop::pause_read(int fd) {
+    Connection &connection = *connection_table.get(fd);
+    connection.paused = true;
+    io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_cancel64(sqe, make_user_data(RECV, fd), 0);
+    io_uring_sqe_set_data64(sqe, make_user_data(CANCEL, fd));
 }
 
 bool RingEventLoop::read(int client_fd, int n) {
-    if (n < 0) {
-        delete[] client_buffers[client_fd];
-        client_buffers.erase(client_fd);
-        close(client_fd);
+    Connection &connection = *connection_table.get(client_fd);
+    if (n == -ENOBUFS) {
+        // Every provided buffer is checked out; the recv was terminated, arm it again.
+        connection.reading = false;
+        if (!connection.paused) {
+            prepare_read(client_fd);
+        }
         return false;
-        // throw std::runtime_error(
-        // fmt::format("Failed to read from socket, error: {}", strerror(errno)));
     }
-    if (n == 0) {
-        delete[] client_buffers[client_fd];
-        client_buffers.erase(client_fd);
-        close(client_fd);
+    if (n == -ECANCELED && connection.paused) {
+        // Cancelled by pause_read(), re-armed once the output queue drains.
+        connection.reading = false;
+        return false;
+    }
+    if (n <= 0) {
+        connection.reading = false;
+        connection.closing = true;
+        maybe_close(client_fd);
         return false;
     }
-    prepare_read(client_fd);
     return true;
 }
 
-void RingEventLoop::write(int fd, const std::string &data) {
-    int n = ::write(fd, data.c_str(), data.size());
-    if (n == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to write to socket, error: {}", strerror(errno)));
+void RingEventLoop::write(int fd, std::string data) {
+    OutputChunk chunk;
+    chunk.data = std::move(data);
+    enqueue(fd, std::move(chunk));
+}
+
+void RingEventLoop::send_file(int fd, const FileResponse &response) {
+    Connection &connection = *connection_table.get(fd);
+    if (connection.pipe_fds[0] == -1 && pipe2(connection.pipe_fds, O_CLOEXEC) == -1) {
+        // No fds left for the splice pipe: copy the body through user space instead.
+        std::string data(response.length, '\0');
+        ssize_t n = pread(response.file->fd, &data[0], response.length, response.offset);
+        data.resize(n > 0 ? n : 0);
+        bool truncated = data.size() < response.length;
+        write(fd, std::move(data));
+        if (truncated) {
+            close_after_send(fd);
+        }
+        return;
+    }
+    OutputChunk chunk;
+    chunk.file = response.file;
+    chunk.offset = response.offset;
+    chunk.length = response.length;
+    enqueue(fd, std::move(chunk));
+}
+
+void RingEventLoop::enqueue(int fd, OutputChunk chunk) {
+    Connection &connection = *connection_table.get(fd);
+    if (connection.closing || chunk.remaining() == 0) {
+        return;
+    }
+    ResponseWriter &filling = connection.writers->filling;
+    if (!filling.empty()) {
+        // Responses still in the writer were answered first.
+        OutputChunk earlier;
+        filling.copy_to(earlier.data);
+        filling.clear();
+        connection.output_bytes += earlier.remaining();
+        connection.output.push_back(std::move(earlier));
+    }
+    connection.output_bytes += chunk.remaining();
+    connection.output.push_back(std::move(chunk));
+    if (!connection.sending) {
+        prepare_send(fd);
+    }
+    if (pending_output(connection) > OUTPUT_HIGH_WATER && connection.reading &&
+        !connection.paused) {
+        pause_read(fd);
+    }
+}
+
+bool RingEventLoop::has_output(const Connection &connection) const {
+    return !connection.output.empty() || !connection.writers->sending.empty() ||
+           !connection.writers->filling.empty();
+}
+
+size_t RingEventLoop::pending_output(const Connection &connection) const {
+    return connection.output_bytes + connection.writers->sending.size() +
+           connection.writers->filling.size();
+}
+
+void RingEventLoop::set_router(const Router *router) { this->router = router; }
+
+void RingEventLoop::set_async_handler(AsyncHandler handler) {
+    async_handler = std::move(handler);
+}
+
+void RingEventLoop::spawn(AsyncTask<> task) {
+    std::coroutine_handle<AsyncPromise<void>> handle = task.release();
+    handle.promise().link(&roots, handle);
+    handle.resume();
+}
+
+AsyncTask<> RingEventLoop::serve_async(int fd) {
+    AsyncConnection connection(this, fd);
+    co_await async_handler(connection);
+}
+
+void RingEventLoop::set_task_pool(TaskPool *pool) {
+    this->pool = pool;
+    if (pool != nullptr && offloads == nullptr) {
+        offloads = std::make_shared<OffloadQueue>();
+    }
+}
+
+void RingEventLoop::set_request_limits(size_t header_limit, size_t body_limit) {
+    this->header_limit = header_limit;
+    this->body_limit = body_limit;
+}
+
+void RingEventLoop::prepare_send(int fd) {
+    Connection &connection = *connection_table.get(fd);
+    Writers &writers = *connection.writers;
+    if (writers.sending.empty() && connection.output.empty()) {
+        // Nothing is queued ahead of the writer: its buffers are sent as they are, and the other
+        // writer takes new responses until the send completes.
+        std::swap(writers.sending, writers.filling);
+    }
+    io_uring_sqe *sqe = get_sqe();
+    if (!writers.sending.empty()) {
+        size_t count;
+        writers.message = {};
+        writers.message.msg_iov = const_cast<iovec *>(writers.sending.data(count));
+        writers.message.msg_iovlen = count;
+        io_uring_prep_sendmsg(sqe, fd, &writers.message, MSG_NOSIGNAL);
+        io_uring_sqe_set_flags(sqe, file_flags(fd));
+        io_uring_sqe_set_data64(sqe, make_user_data(SENDMSG, fd));
+        connection.sending = true;
+        return;
+    }
+    OutputChunk &front = connection.output.front();
+    if (front.file && connection.piped == 0) {
+        // File to pipe, then pipe to socket: the file pages never reach user space.
+        unsigned size = std::min(front.length, PIPE_CHUNK);
+        io_uring_prep_splice(sqe, front.file->fd, front.offset, connection.pipe_fds[1], -1, size,
+                             0);
+        io_uring_sqe_set_data64(sqe, make_user_data(SPLICE_IN, fd));
+    } else if (front.file) {
+        bool more = front.length > 0 || connection.output.size() > 1;
+        io_uring_prep_splice(sqe, connection.pipe_fds[0], -1, fd, -1, connection.piped,
+                             more ? SPLICE_F_MORE : 0);
+        io_uring_sqe_set_flags(sqe, file_flags(fd));
+        io_uring_sqe_set_data64(sqe, make_user_data(SPLICE_OUT, fd));
+    } else {
+        const char *data = front.data.data() + front.offset;
+        size_t size = front.remaining();
+        if (zerocopy && size >= ZEROCOPY_THRESHOLD) {
+            io_uring_prep_send_zc(sqe, fd, data, size, MSG_NOSIGNAL, 0);
+            io_uring_sqe_set_data64(sqe, make_user_data(SEND_ZC, fd));
+        } else {
+            io_uring_prep_send(sqe, fd, data, size, MSG_NOSIGNAL);
+            io_uring_sqe_set_data64(sqe, make_user_data(SEND, fd));
+        }
+        io_uring_sqe_set_flags(sqe, file_flags(fd));
+    }
+    connection.sending = true;
+}
+
+void RingEventLoop::send_complete(int fd, Operation op, int n, uint32_t flags) {
+    Connection &connection = *connection_table.get(fd);
+    if (flags & IORING_CQE_F_NOTIF) {
+        // The kernel no longer references the zero-copy buffers.
+        if (--connection.notifications == 0) {
+            connection.retired.clear();
+        }
+        // A closing connection is only torn down once the last notification frees its chunks.
+        maybe_close(fd);
+        return;
+    }
+    if (op == SEND_ZC && (flags & IORING_CQE_F_MORE)) {
+        ++connection.notifications;
+    }
+    connection.sending = false;
+    if (op == SEND_ZC && (n == -EOPNOTSUPP || n == -EINVAL)) {
+        zerocopy = false;
+        prepare_send(fd);
+        return;
+    }
+    if (n < 0 || (n == 0 && (op == SPLICE_IN || op == SPLICE_OUT))) {
+        // A splice of 0 bytes means the file was truncated after its Content-Length was sent.
+        // A partial SEND_ZC leaves the front chunk referenced by the kernel until its
+        // notification arrives, so the chunks are retired rather than freed here.
+        for (OutputChunk &chunk : connection.output) {
+            if (!chunk.file && connection.notifications > 0) {
+                connection.retired.push_back(std::move(chunk.data));
+            }
+        }
+        connection.output.clear();
+        connection.output_bytes = 0;
+        connection.writers->sending.clear();
+        connection.writers->filling.clear();
+        connection.piped = 0;
+        connection.closing = true;
+        // Terminates the outstanding recv, which then closes the connection.
+        shutdown(fd, SHUT_RDWR);
+        maybe_close(fd);
+        return;
+    }
+    if (op == SENDMSG) {
+        connection.writers->sending.consume(n);
+    } else if (op == SPLICE_IN) {
+        OutputChunk &front = connection.output.front();
+        front.offset += n;
+        front.length -= n;
+        connection.piped = n;
+    } else {
+        OutputChunk &front = connection.output.front();
+        if (op == SPLICE_OUT) {
+            connection.piped -= n;
+        } else {
+            front.offset += n;
+        }
+        connection.output_bytes -= n;
+        if (front.remaining() == 0 && connection.piped == 0) {
+            if (op == SEND_ZC) {
+                connection.retired.push_back(std::move(front.data));
+            }
+            connection.output.pop_front();
+        }
+    }
+    if (!has_output(connection) && connection.stream && !connection.closing &&
+        !produce(fd)) {
+        return;
+    }
+    if (!has_output(connection) && connection.input.empty() && !connection.closing) {
+        recycle(connection);
+    }
+    if (has_output(connection)) {
+        if (!connection.sending) {
+            prepare_send(fd);
+        }
+    } else if (connection.paused && !connection.closing && !connection.waiting) {
+        connection.paused = false;
+        if (!connection.reading) {
+            prepare_read(fd);
+        }
+    } else {
+        maybe_close(fd);
+    }
+}
+
+void RingEventLoop::process(int fd) {
+    Connection &connection = *connection_table.get(fd);
+    if (connection.closing) {
+        return;
+    }
+    // Every complete request in the input is answered into the writer and leaves with one send.
+    ResponseWriter &writer = connection.writers->filling;
+    size_t consumed = 0;
+    bool keep_alive = true;
+    while (keep_alive && !connection.stream && !connection.waiting) {
+        auto result = connection.parser.parse(connection.input.data() + consumed,
+                                              connection.input.size() - consumed);
+        if (result == RequestParser::Result::NeedMore) {
+            connection.input.reserve(consumed + connection.parser.expected_length());
+            break;
+        }
+        if (result == RequestParser::Result::Error) {
+            writer.error(connection.parser.error());
+            keep_alive = false;
+            break;
+        }
+        RequestView request = connection.parser.view(connection.input.data() + consumed);
+        requests.fetch_add(1, std::memory_order_relaxed);
+        keep_alive = request.keep_alive();
+        bool offloaded = false;
+        FileResponse response = respond(router, request, keep_alive, writer, connection.stream,
+                                        pool != nullptr ? &offloaded : nullptr);
+        size_t length = connection.parser.length();
+        connection.parser.reset();
+        if (offloaded) {
+            // Answered by complete(), the requests behind it wait until then.
+            offload(*pool, *router, offloads, connection_table.token(fd, RECV),
+                    std::string_view(connection.input.data() + consumed, length), keep_alive);
+            connection.waiting = true;
+            keep_alive = true;
+        }
+        consumed += length;
+        if (response.file) {
+            send_file(fd, response);
+        }
+    }
+    connection.input.erase(0, consumed);
+    if (!connection.sending && has_output(connection)) {
+        prepare_send(fd);
+    }
+    if ((pending_output(connection) > OUTPUT_HIGH_WATER || connection.stream ||
+         connection.waiting) &&
+        connection.reading && !connection.paused) {
+        pause_read(fd);
+    }
+    if (!keep_alive && connection.stream) {
+        connection.close_after_stream = true;
+    } else if (!keep_alive) {
+        close_after_send(fd);
+    }
+}
+
+bool RingEventLoop::produce(int fd) {
+    Connection &connection = *connection_table.get(fd);
+    if (connection.writers->filling.write_chunk(*connection.stream, STREAM_CHUNK)) {
+        return true;
+    }
+    connection.stream.reset();
+    if (connection.close_after_stream) {
+        if (has_output(connection)) {
+            prepare_send(fd);
+        }
+        close_after_send(fd);
+    } else {
+        // Requests pipelined behind the stream were held back until now.
+        process(fd);
+    }
+    // Either may have closed the connection.
+    return connection_table.get(fd) != nullptr;
+}
+
+void RingEventLoop::close_after_send(int fd) {
+    Connection &connection = *connection_table.get(fd);
+    connection.closing = true;
+    connection.input.clear();
+    if (connection.reading) {
+        // The cancelled recv completes with -ECANCELED and closes once the output is sent.
+        io_uring_sqe *sqe = get_sqe();
+        io_uring_prep_cancel64(sqe, make_user_data(RECV, fd), 0);
+        io_uring_sqe_set_data64(sqe, make_user_data(CANCEL, fd));
     }
+    maybe_close(fd);
 }
 
+void RingEventLoop::maybe_close(int fd) {
+    Connection &connection = *connection_table.get(fd);
+    if (connection.closing && !connection.reading && !connection.sending &&
+        connection.notifications == 0) {
+        unregister_file(fd);
+        if (connection.pipe_fds[0] != -1) {
+            close(connection.pipe_fds[0]);
+            close(connection.pipe_fds[1]);
+        }
+        close(fd);
+        connection_table.erase(fd);
+    }
+}
+
+void RingEventLoop::recycle(Connection &connection) {
+    // Idle between requests: nothing references the request memory in the arena any more.
+    connection.parser.release();
+    connection.writers->filling.release();
+    connection.writers->sending.release();
+    release(connection.input);
+    connection.arena->reset();
+}
+
+uint64_t RingEventLoop::get_connections() const {
+    return connections.load(std::memory_order_relaxed);
+}
+
+uint64_t RingEventLoop::get_requests() const { return requests.load(std::memory_order_relaxed); }
+
+PoolStats RingEventLoop::get_buffer_stats() const { return buffers.get_stats(); }
+
+PoolStats RingEventLoop::get_arena_stats() const { return arenas.get_stats(); }
+
+std::vector<PoolStats> RingEventLoop::get_frame_stats() const { return frames.get_stats(); }
+
+const RingConfig &RingEventLoop::get_config() const { return config; }
+
+unsigned RingEventLoop::get_setup_flags() const { return setup_flags; }
+
+void RingEventLoop::prepare_wakeup() {
+    io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_read(sqe, wakeup_fd, &wakeup_value, sizeof(wakeup_value), 0);
+    io_uring_sqe_set_data64(sqe, make_user_data(WAKEUP, wakeup_fd));
+}
+
+void RingEventLoop::prepare_offload() {
+    io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_read(sqe, offloads->get_fd(), &offload_value, sizeof(offload_value), 0);
+    io_uring_sqe_set_data64(sqe, make_user_data(OFFLOAD, offloads->get_fd()));
+}
+
+void RingEventLoop::complete_offloads() {
+    // The read that completed reset the eventfd, results pushed from now on signal it again.
+    offloads->take(completed);
+    for (auto &result : completed) {
+        complete(result);
+    }
+    completed.clear();
+}
+
+void RingEventLoop::complete(OffloadResult &result) {
+    Connection *connection = connection_table.find(result.token);
+    if (connection == nullptr || !connection->waiting) {
+        return; // closed while the request ran
+    }
+    int fd = token_fd(result.token);
+    connection->waiting = false;
+    if (connection->closing) {
+        return;
+    }
+    write(fd, std::move(result.response));
+    if (result.file.file) {
+        send_file(fd, result.file);
+    }
+    connection->stream = std::move(result.stream);
+    if (connection->closing) {
+        return; // a truncated file body, closed after the send
+    }
+    if (!result.keep_alive && connection->stream) {
+        connection->close_after_stream = true;
+    } else if (!result.keep_alive) {
+        close_after_send(fd);
+    } else {
+        // Requests pipelined behind the offloaded one were held back until now.
+        process(fd);
+    }
+}
+
+/**
+ * @brief Points a thread_local at `value` until the scope ends.
+ */
+template <typename T> class CurrentScope {
+  private:
+    T *&slot;
+    T *previous;
+
+  public:
+    CurrentScope(T *&slot, T *value) : slot(slot), previous(std::exchange(slot, value)) {}
+    ~CurrentScope() { slot = previous; }
+    CurrentScope(const CurrentScope &other) = delete;
+    CurrentScope &operator=(const CurrentScope &other) = delete;
+};
+
 void RingEventLoop::run() {
+    CurrentScope<RingEventLoop> loop_scope(current, this);
+    FramePool::Scope frame_scope(frames);
     for (auto &socket : socket_map) {
         prepare_accept(socket.first);
     }
-    io_uring_submit(&ring);
-    while (true) {
-        io_uring_cqe *cqe;
-        if (io_uring_wait_cqe(&ring, &cqe) < 0) {
+    prepare_wakeup();
+    if (offloads != nullptr) {
+        prepare_offload();
+    }
+    running = true;
+    while (running) {
+        int ret = io_uring_submit_and_wait(&ring, 1);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
             throw std::runtime_error(
-                fmt::format("Failed to wait for cqe, error: {}", strerror(errno)));
+                fmt::format("Failed to wait for cqe, error: {}", strerror(-ret)));
         }
-        long long fd = reinterpret_cast<long long>(io_uring_cqe_get_data(cqe));
-        if (socket_map.find(fd) != socket_map.end()) {
-            accept(cqe->user_data, cqe->res);
-        } else {
-            int n = cqe->res;
-            if (read(fd, cqe->res)) {
-                std::string request_str(client_buffers[fd], n);
-                Request request(request_str);
-                Response response;
+        io_uring_cqe *cqe;
+        unsigned head;
+        unsigned count = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            ++count;
+            Operation op = static_cast<Operation>(token_tag(cqe->user_data));
+            int fd = token_fd(cqe->user_data);
+            bool more = cqe->flags & IORING_CQE_F_MORE;
+            bool owned = op == ACCEPT || op == ACCEPT_RETRY || op == WAKEUP || op == OFFLOAD ||
+                         op == RESUME;
+            if (!owned && connection_table.find(cqe->user_data) == nullptr) {
+                // Completion for a connection that is already gone.
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    recycle_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+            } else if (op == WAKEUP) {
+                running = false;
+            } else if (op == RESUME) {
+                // The coroutine picks the result up in await_resume().
+                completion_result = cqe->res;
+                void *address = reinterpret_cast<void *>(cqe->user_data & ADDRESS_MASK);
+                std::coroutine_handle<>::from_address(address).resume();
+            } else if (op == OFFLOAD) {
+                complete_offloads();
+                prepare_offload();
+            } else if (op == ACCEPT) {
+                accept(cqe->res);
+                if (!more) {
+                    if (cqe->res < 0 && accept_exhausted(-cqe->res)) {
+                        prepare_accept_retry(fd);
+                    } else {
+                        prepare_accept(fd);
+                    }
+                }
+            } else if (op == ACCEPT_RETRY) {
+                prepare_accept(fd);
+            } else if (op == SEND || op == SENDMSG || op == SEND_ZC || op == SPLICE_IN ||
+                       op == SPLICE_OUT) {
+                send_complete(fd, op, cqe->res, cqe->flags);
+            } else if (op == RECV) {
+                int buffer_id = take_buffer(fd, cqe->flags);
+                if (read(fd, cqe->res)) {
+                    Connection &connection = *connection_table.get(fd);
+                    connection.input.append(buffers.at(buffer_id), cqe->res);
+                    recycle_buffer(buffer_id);
+                    if (!more) {
+                        connection.reading = false;
+                        if (!connection.paused) {
+                            prepare_read(fd);
+                        }
+                    }
+                    process(fd);
+                } else if (buffer_id >= 0) {
+                    recycle_buffer(buffer_id);
+                }
+            }
+        }
+        io_uring_cq_advance(&ring, count);
+    }
+}
+
+void RingEventLoop::stop() {
+    running = false;
+    uint64_t one = 1;
+    ::write(wakeup_fd, &one, sizeof(one));
+}
+
+ShardedRingEventLoop::ShardedRingEventLoop(int num_shards, bool pin_cpus,
+                                           const RingConfig &config)
+    : shards(num_shards, nullptr), config(config), router(nullptr), pool(nullptr),
+      header_limit(RequestParser::DEFAULT_HEADER_LIMIT),
+      body_limit(RequestParser::DEFAULT_BODY_LIMIT), num_shards(num_shards), pin_cpus(pin_cpus),
+      ready_count(0), stopped(false) {
+    if (num_shards <= 0) {
+        throw std::runtime_error("num_shards must be greater than 0");
+    }
+}
+
+ShardedRingEventLoop::~ShardedRingEventLoop() { stop(); }
 
-                std::string response_body(fmt::format(
-                    "<html><body><h1>{} {}</h1><p>{}</p><p>{}</p></body></html>",
-                    request.get_method(), request.get_path(), request.get_body(), LOREM));
+void ShardedRingEventLoop::listen(const char *ip, int port) { addresses.push_back({ip, port}); }
 
-                response.set_header("Content-Type", "text/html");
-                response.set_header("Content-Length", std::to_string(response_body.size()));
-                response.set_body(response_body);
+void ShardedRingEventLoop::set_listen_options(const ListenOptions &options) {
+    listen_options = options;
+}
+
+void ShardedRingEventLoop::set_router(const Router *router) { this->router = router; }
+
+void ShardedRingEventLoop::set_task_pool(TaskPool *pool) { this->pool = pool; }
+
+void ShardedRingEventLoop::set_async_handler(AsyncHandler handler) {
+    async_handler = std::move(handler);
+}
+
+void ShardedRingEventLoop::set_request_limits(size_t header_limit, size_t body_limit) {
+    this->header_limit = header_limit;
+    this->body_limit = body_limit;
+}
 
-                write(cqe->user_data, response.to_string());
+void ShardedRingEventLoop::run_shard(int index) {
+    RingEventLoop *shard = nullptr;
+    try {
+        if (pin_cpus) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(index % std::thread::hardware_concurrency(), &cpus);
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+            if (err != 0) {
+                throw std::runtime_error(
+                    fmt::format("Failed to pin shard {}, error: {}", index, strerror(err)));
             }
         }
-        io_uring_cqe_seen(&ring, cqe);
-        io_uring_submit(&ring);
+        shard = new RingEventLoop(config);
+        shard->set_router(router);
+        shard->set_task_pool(pool);
+        shard->set_async_handler(async_handler);
+        shard->set_request_limits(header_limit, body_limit);
+        shard->set_listen_options(listen_options);
+        for (auto &address : addresses) {
+            shard->listen(address.first.c_str(), address.second, true);
+        }
+    } catch (...) {
+        delete shard;
+        shard = nullptr;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error) {
+            error = std::current_exception();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shards[index] = shard;
+        ++ready_count;
+    }
+    ready_cond.notify_all();
+    if (shard == nullptr) {
+        return;
+    }
+    {
+        // Do not serve until every shard is up, or a failed startup could leave some running.
+        std::unique_lock<std::mutex> lock(mutex);
+        ready_cond.wait(lock, [this] { return ready_count == num_shards; });
+        if (error || stopped) {
+            return;
+        }
+    }
+    try {
+        shard->run();
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        // run() rethrows it once the other shards have stopped too.
+        stop();
     }
 }
 
-EventLoop::EventLoop() {
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) {
-        throw std::runtime_error(fmt::format("Failed to create epoll, error: {}", strerror(errno)));
+std::vector<ShardedRingEventLoop::ShardStats> ShardedRingEventLoop::stats() {
+    std::vector<ShardStats> result;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int i = 0; i < num_shards; ++i) {
+        int cpu = pin_cpus ? static_cast<int>(i % std::thread::hardware_concurrency()) : -1;
+        if (shards[i] == nullptr) {
+            result.push_back({cpu, 0, 0, {}, {}});
+        } else {
+            result.push_back({cpu, shards[i]->get_connections(), shards[i]->get_requests(),
+                              shards[i]->get_buffer_stats(), shards[i]->get_arena_stats()});
+        }
     }
+    return result;
 }
 
-EventLoop::~EventLoop() { close(epoll_fd); }
+void ShardedRingEventLoop::run() {
+    for (int i = 0; i < num_shards; ++i) {
+        threads.emplace_back([this, i] { run_shard(i); });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+    std::exception_ptr e;
+    {
+        // stats() and stop() may still be called from other threads.
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &shard : shards) {
+            delete shard;
+            shard = nullptr;
+        }
+        ready_count = 0;
+        stopped = false;
+        e = std::exchange(error, nullptr);
+    }
+    if (e) {
+        std::rethrow_exception(e);
+    }
+}
 
-void EventLoop::listen(const char *ip, int port) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to create socket, error: {}", strerror(errno)));
+void ShardedRingEventLoop::stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+    for (auto shard : shards) {
+        if (shard != nullptr) {
+            shard->stop();
+        }
     }
-    sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = inet_addr(ip);
-    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
-        throw std::runtime_error(fmt::format("Failed to bind socket, error: {}", strerror(errno)));
+}
+
+constexpr int DEFAULT_IDLE_TIMEOUT = 60000;
+constexpr int DEFAULT_REQUEST_TIMEOUT = 30000;
+
+EpollConnections::EpollConnections(int epoll_fd, bool edge_triggered, TimerWheel &timers)
+    : arenas(ARENA_BLOCK_SIZE, ARENA_SLAB_BLOCKS), active(0), epoll_fd(epoll_fd),
+      edge_triggered(edge_triggered), timers(timers), router(nullptr),
+      header_limit(RequestParser::DEFAULT_HEADER_LIMIT),
+      body_limit(RequestParser::DEFAULT_BODY_LIMIT), idle_timeout(DEFAULT_IDLE_TIMEOUT),
+      request_timeout(DEFAULT_REQUEST_TIMEOUT), pool(nullptr) {}
+
+EpollConnections::~EpollConnections() {
+    connections.for_each([](int fd, Connection &) { close(fd); });
+}
+
+void EpollConnections::set_timeouts(int idle_timeout, int request_timeout) {
+    this->idle_timeout = idle_timeout;
+    this->request_timeout = request_timeout;
+}
+
+void EpollConnections::set_router(const Router *router) { this->router = router; }
+
+void EpollConnections::set_request_limits(size_t header_limit, size_t body_limit) {
+    this->header_limit = header_limit;
+    this->body_limit = body_limit;
+}
+
+void EpollConnections::set_task_pool(TaskPool *pool) {
+    this->pool = pool;
+    if (pool == nullptr || offloads != nullptr) {
+        return;
     }
-    if (::listen(fd, 10) == -1) {
+    offloads = std::make_shared<OffloadQueue>();
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = make_token(offloads->get_fd(), 0, static_cast<uint8_t>(FdType::Offload));
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, offloads->get_fd(), &event) == -1) {
+        offloads.reset();
         throw std::runtime_error(
-            fmt::format("Failed to listen on socket, error: {}", strerror(errno)));
+            fmt::format("Failed to add eventfd to epoll, error: {}", strerror(errno)));
     }
-    socket_fd.insert(fd);
+}
 
+size_t EpollConnections::size() const { return active; }
+
+PoolStats EpollConnections::get_arena_stats() const { return arenas.get_stats(); }
+
+void EpollConnections::add(int fd) {
+    Connection &connection = connections.emplace(fd, FdType::Client, Arena::create(arenas),
+                                                 header_limit, body_limit);
+    connection.events = EPOLLIN | (edge_triggered ? static_cast<uint32_t>(EPOLLET) : 0);
     epoll_event event;
-    event.events = EPOLLIN;
-    event.data.fd = fd;
+    event.events = connection.events;
+    event.data.u64 = connections.token(fd, static_cast<uint8_t>(FdType::Client));
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        connections.erase(fd);
+        close(fd);
         throw std::runtime_error(
             fmt::format("Failed to add socket to epoll, error: {}", strerror(errno)));
     }
+    ++active;
+    update_timer(fd, connection);
 }
 
-void EventLoop::accept(int fd) {
-    sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-    int client_fd = ::accept(fd, (sockaddr *)&addr, &addr_len);
-    if (client_fd == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to accept connection, error: {}", strerror(errno)));
+void EpollConnections::remove(int fd) {
+    Connection *connection = connections.get(fd);
+    if (connection == nullptr) {
+        return;
     }
-    epoll_event event;
-    event.events = EPOLLIN;
-    event.data.fd = client_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to add socket to epoll, error: {}", strerror(errno)));
+    if (connection->timer != 0) {
+        timers.cancel(connection->timer);
     }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    connections.erase(fd);
+    --active;
 }
 
-void EventLoop::add_timer(int timeout, std::function<void()> callback) {
-    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-    if (timer_fd == -1) {
-        throw std::runtime_error(fmt::format("Failed to create timer, error: {}", strerror(errno)));
+bool EpollConnections::handle(uint64_t token, uint32_t events) {
+    Connection *found = connections.find(token);
+    if (found == nullptr) {
+        // Stale event for a closed fd, possibly already reused by a newer connection.
+        return true;
+    }
+    int fd = token_fd(token);
+    Connection &connection = *found;
+    bool alive = !(events & EPOLLERR);
+    if (alive && (events & EPOLLOUT)) {
+        alive = flush(fd, connection);
     }
-    itimerspec timer;
-    timer.it_value.tv_sec = timeout / 1000;
-    timer.it_value.tv_nsec = (timeout % 1000) * 1000000;
-    timer.it_interval.tv_sec = timeout / 1000;
-    timer.it_interval.tv_nsec = (timeout % 1000) * 1000000;
-    if (timerfd_settime(timer_fd, 0, &timer, NULL) == -1) {
-        throw std::runtime_error(fmt::format("Failed to set timer, error: {}", strerror(errno)));
+    if (alive && !connection.closing && (events & (EPOLLIN | EPOLLHUP))) {
+        alive = receive(fd, connection);
     }
+    return settle(fd, connection, alive);
+}
 
-    epoll_event event;
-    event.events = EPOLLIN;
-    event.data.fd = timer_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to add timer to epoll, error: {}", strerror(errno)));
+bool EpollConnections::settle(int fd, Connection &connection, bool alive) {
+    if (connection.closing && connection.pending() == 0 && !connection.stream) {
+        // The response to a non keep-alive request is fully sent.
+        alive = false;
+    }
+    if (!alive) {
+        remove(fd);
+        return false;
+    }
+    if (connection.input.empty() && connection.pending() == 0 && !connection.stream) {
+        recycle(connection);
     }
+    update_events(fd, connection);
+    update_timer(fd, connection);
+    return true;
+}
 
-    timer_timeouts[timer_fd] = timeout;
-    timer_callbacks[timer_fd] = callback;
+void EpollConnections::write(int fd, const std::string &data) {
+    Connection *connection = connections.get(fd);
+    if (connection == nullptr) {
+        return;
+    }
+    OutputChunk chunk;
+    chunk.data = data;
+    queue(*connection, std::move(chunk));
+    if (!flush(fd, *connection)) {
+        remove(fd);
+        return;
+    }
+    update_events(fd, *connection);
 }
 
-void EventLoop::read_timer(int fd) {
-    char buffer[8];
-    int n = ::read(fd, buffer, 8);
-    if (n == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to read from timer, error: {}", strerror(errno)));
+bool EpollConnections::receive(int fd, Connection &connection) {
+    char buffer[BUFFER_SIZE];
+    while (true) {
+        ssize_t n = ::recv(fd, buffer, BUFFER_SIZE, 0);
+        if (n > 0) {
+            connection.input.append(buffer, n);
+            process(fd, connection);
+            if (!edge_triggered || connection.closing || connection.stream || connection.waiting) {
+                break;
+            }
+            if (connection.pending() > OUTPUT_HIGH_WATER) {
+                // Stop draining only if the peer is really behind; update_events() then disarms
+                // EPOLLIN and re-arming it later reports the unread input again.
+                if (!flush(fd, connection)) {
+                    return false;
+                }
+                if (connection.pending() > OUTPUT_HIGH_WATER) {
+                    break;
+                }
+            }
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            // EOF or error: send what was already answered, then close.
+            flush(fd, connection);
+            return false;
+        }
     }
+    return flush(fd, connection);
 }
 
-bool EventLoop::read(int fd, char *buffer, int size) {
-    int n = ::read(fd, buffer, size);
-    if (n == -1) {
-        // throw std::runtime_error(
-        // fmt::format("Failed to read from socket, error: {}", strerror(errno)));
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-        close(fd);
+void EpollConnections::queue(Connection &connection, OutputChunk chunk) {
+    if (!connection.writer.empty()) {
+        // Responses still in the writer were answered first.
+        OutputChunk earlier;
+        connection.writer.copy_to(earlier.data);
+        connection.writer.clear();
+        queue(connection, std::move(earlier));
+    }
+    if (chunk.remaining() == 0) {
+        return;
+    }
+    connection.output_bytes += chunk.remaining();
+    if (!chunk.file && !connection.output.empty() && !connection.output.back().file) {
+        connection.output.back().data.append(chunk.data, chunk.offset);
+        return;
+    }
+    connection.output.push_back(std::move(chunk));
+}
 
-        return false;
-    } else if (n == 0) {
+void EpollConnections::process(int fd, Connection &connection) {
+    // Responses to all pipelined requests are written to the connection's writer and leave in one
+    // sendmsg(), file bodies are queued in between.
+    size_t consumed = 0;
+    while (!connection.closing && !connection.stream && !connection.waiting) {
+        auto result = connection.parser.parse(connection.input.data() + consumed,
+                                              connection.input.size() - consumed);
+        if (result == RequestParser::Result::NeedMore) {
+            // A large body is received into one allocation.
+            connection.input.reserve(consumed + connection.parser.expected_length());
+            break;
+        }
+        if (result == RequestParser::Result::Error) {
+            connection.writer.error(connection.parser.error());
+            connection.closing = true;
+            break;
+        }
+        RequestView request = connection.parser.view(connection.input.data() + consumed);
+        bool keep_alive = request.keep_alive();
+        bool offloaded = false;
+        FileResponse response = respond(router, request, keep_alive, connection.writer,
+                                        connection.stream, pool != nullptr ? &offloaded : nullptr);
+        size_t length = connection.parser.length();
+        connection.parser.reset();
+        if (offloaded) {
+            // Answered by complete(), the requests behind it wait until then.
+            uint64_t token = connections.token(fd, static_cast<uint8_t>(FdType::Client));
+            offload(*pool, *router, offloads, token,
+                    std::string_view(connection.input.data() + consumed, length), keep_alive);
+            connection.waiting = true;
+            consumed += length;
+            break;
+        }
+        consumed += length;
+        if (response.file) {
+            if (connection.output.empty()) {
+                // Errors show up again in flush(), what is left moves to the queue.
+                connection.writer.send(fd);
+            }
+            OutputChunk chunk;
+            chunk.file = std::move(response.file);
+            chunk.offset = response.offset;
+            chunk.length = response.length;
+            queue(connection, std::move(chunk));
+        }
+        connection.closing = !keep_alive;
+    }
+    if (connection.closing) {
+        connection.input.clear();
+    } else {
+        connection.input.erase(0, consumed);
+    }
+}
+
+bool EpollConnections::flush(int fd, Connection &connection) {
+    for (int batch = 0;; ++batch) {
+        if (!flush_output(fd, connection)) {
+            return false;
+        }
+        if (connection.pending() > 0 || !connection.stream || batch == STREAM_BATCH) {
+            return true;
+        }
+        // The socket took everything: produce the next part of the streamed body.
+        produce(fd, connection);
+    }
+}
 
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+void EpollConnections::produce(int fd, Connection &connection) {
+    if (!connection.writer.write_chunk(*connection.stream, STREAM_CHUNK)) {
+        connection.stream.reset();
+        // Requests pipelined behind the stream were held back until now.
+        process(fd, connection);
+    }
+}
+
+bool EpollConnections::flush_output(int fd, Connection &connection) {
+    while (!connection.output.empty()) {
+        OutputChunk &chunk = connection.output.front();
+        ssize_t n;
+        if (chunk.file) {
+            // sendfile() advances chunk.offset, the file's own position is untouched.
+            n = ::sendfile(fd, chunk.file->fd, &chunk.offset, chunk.length);
+            if (n == 0) {
+                return false; // the file was truncated after its Content-Length was sent
+            }
+        } else {
+            n = ::send(fd, chunk.data.data() + chunk.offset, chunk.remaining(), MSG_NOSIGNAL);
+        }
+        if (n > 0) {
+            if (chunk.file) {
+                chunk.length -= n;
+            } else {
+                chunk.offset += n;
+            }
+            connection.output_bytes -= n;
+            if (chunk.remaining() == 0) {
+                connection.output.pop_front();
+            }
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return connection.writer.send(fd);
+}
+
+void EpollConnections::update_timer(int fd, Connection &connection) {
+    // Requests held back behind a stream or an offloaded request are not late, and the time an
+    // offloaded handler takes is not the client's.
+    bool partial = !connection.input.empty() && !connection.stream && !connection.waiting;
+    if (partial && connection.request_pending) {
+        return; // the request deadline is not extended by further bytes
+    }
+    connection.request_pending = partial;
+    int timeout = connection.waiting ? 0 : partial ? request_timeout : idle_timeout;
+    if (timeout <= 0) {
+        if (connection.timer != 0) {
+            timers.cancel(connection.timer);
+            connection.timer = 0;
+        }
+        return;
+    }
+    if (connection.timer != 0 && timers.reschedule(connection.timer, timeout)) {
+        return;
+    }
+    uint64_t token = connections.token(fd, static_cast<uint8_t>(FdType::Client));
+    connection.timer = timers.add(timeout, [this, token] {
+        if (Connection *expired = connections.find(token)) {
+            expired->timer = 0;
+            remove(token_fd(token));
+        }
+    });
+}
+
+void EpollConnections::recycle(Connection &connection) {
+    // Idle between requests: nothing references the request memory in the arena any more.
+    connection.parser.release();
+    connection.writer.release();
+    release(connection.input);
+    connection.arena->reset();
+}
+
+void EpollConnections::complete_offloads() {
+    uint64_t value;
+    ::read(offloads->get_fd(), &value, sizeof(value));
+    offloads->take(completed);
+    for (auto &result : completed) {
+        complete(result);
+    }
+    completed.clear();
+}
+
+void EpollConnections::complete(OffloadResult &result) {
+    Connection *found = connections.find(result.token);
+    if (found == nullptr || !found->waiting) {
+        return; // closed while the request ran
+    }
+    int fd = token_fd(result.token);
+    Connection &connection = *found;
+    connection.waiting = false;
+    OutputChunk head;
+    head.data = std::move(result.response);
+    queue(connection, std::move(head));
+    if (result.file.file) {
+        OutputChunk chunk;
+        chunk.file = std::move(result.file.file);
+        chunk.offset = result.file.offset;
+        chunk.length = result.file.length;
+        queue(connection, std::move(chunk));
+    }
+    connection.stream = std::move(result.stream);
+    connection.closing = !result.keep_alive;
+    process(fd, connection);
+    settle(fd, connection, flush(fd, connection));
+}
+
+void EpollConnections::update_events(int fd, Connection &connection) {
+    size_t pending = connection.pending();
+    uint32_t events = edge_triggered ? static_cast<uint32_t>(EPOLLET) : 0;
+    if (pending <= OUTPUT_HIGH_WATER && !connection.closing && !connection.stream &&
+        !connection.waiting) {
+        events |= EPOLLIN;
+    }
+    if (pending > 0 || connection.stream) {
+        events |= EPOLLOUT;
+    }
+    // A stream that used up its batch with the socket still writable gets no new edge.
+    bool rearm = edge_triggered && connection.stream && pending == 0;
+    if (events == connection.events && !rearm) {
+        return;
+    }
+    // Re-arming EPOLLIN or EPOLLOUT with EPOLLET reports readiness that is already there.
+    connection.events = events;
+    epoll_event event;
+    event.events = events;
+    event.data.u64 = connections.token(fd, static_cast<uint8_t>(FdType::Client));
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+SubEventLoop::SubEventLoop(bool edge_triggered, int events_length)
+    : num_pending(0), running(true), events_length(events_length), epoll_fd(create_epoll()),
+      wakeup_fd(create_wakeup_fd(epoll_fd)), clients(epoll_fd, edge_triggered, timers) {
+    add_timer_fd(epoll_fd, timers.get_fd());
+}
+
+SubEventLoop::~SubEventLoop() {
+    for (int fd : pending_fd) {
         close(fd);
-        return false;
-    } else {
-        buffer[n] = '\0';
     }
-    return true;
+    close(wakeup_fd);
+    close(epoll_fd);
 }
 
-void EventLoop::write(int fd, const std::string &data) {
-    int n = ::write(fd, data.c_str(), data.size());
-    if (n == -1) {
-        throw std::runtime_error(
-            fmt::format("Failed to write to socket, error: {}", strerror(errno)));
+void SubEventLoop::add_client(int fd) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending_fd.push_back(fd);
     }
+    ++num_pending;
+    uint64_t one = 1;
+    ::write(wakeup_fd, &one, sizeof(one));
 }
 
-void EventLoop::run() {
-    epoll_event events[EVENTS_LENGTH];
-    while (true) {
-        int n = epoll_wait(epoll_fd, events, EVENTS_LENGTH, -1);
+void SubEventLoop::add_pending() {
+    uint64_t value;
+    ::read(wakeup_fd, &value, sizeof(value));
+    std::vector<int> fds;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        fds.swap(pending_fd);
+    }
+    for (int fd : fds) {
+        try {
+            clients.add(fd);
+        } catch (std::exception &e) {
+            std::cerr << e.what() << "\n";
+        }
+        --num_pending;
+    }
+}
+
+void SubEventLoop::set_timeouts(int idle_timeout, int request_timeout) {
+    clients.set_timeouts(idle_timeout, request_timeout);
+}
+
+void SubEventLoop::remove_client(int fd) { clients.remove(fd); }
+
+void SubEventLoop::set_router(const Router *router) { clients.set_router(router); }
+
+void SubEventLoop::set_request_limits(size_t header_limit, size_t body_limit) {
+    clients.set_request_limits(header_limit, body_limit);
+}
+
+void SubEventLoop::set_task_pool(TaskPool *pool) { clients.set_task_pool(pool); }
+
+size_t SubEventLoop::client_count() { return num_pending + clients.size(); }
+
+PoolStats SubEventLoop::get_arena_stats() const { return clients.get_arena_stats(); }
+
+void SubEventLoop::run() {
+    std::vector<epoll_event> events(events_length);
+    while (running) {
+        int n = epoll_wait(epoll_fd, events.data(), events_length, -1);
         if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             throw std::runtime_error(
                 fmt::format("Failed to wait on epoll, error: {}", strerror(errno)));
         }
         for (int i = 0; i < n; ++i) {
-            epoll_event event = events[i];
-            if (socket_fd.find(event.data.fd) != socket_fd.end()) {
-                accept(event.data.fd);
-            } else if (timer_callbacks.find(event.data.fd) != timer_callbacks.end()) {
-                timer_callbacks[event.data.fd]();
-                read_timer(event.data.fd);
-            } else {
-                char buffer[1024];
-                if (read(event.data.fd, buffer, 1024)) {
+            uint64_t token = events[i].data.u64;
+            switch (static_cast<FdType>(token_tag(token))) {
+            case FdType::Client:
+                clients.handle(token, events[i].events);
+                break;
+            case FdType::Timer:
+                timers.handle_expired();
+                break;
+            case FdType::Wakeup:
+                add_pending();
+                break;
+            case FdType::Offload:
+                clients.complete_offloads();
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+void SubEventLoop::stop() {
+    running = false;
+    uint64_t one = 1;
+    ::write(wakeup_fd, &one, sizeof(one));
+}
+
+EventLoop::EventLoop(int sub_loops, bool edge_triggered, int events_length)
+    : next_loop(0), running(false), events_length(events_length), edge_triggered(edge_triggered),
+      epoll_fd(create_epoll()), wakeup_fd(create_wakeup_fd(epoll_fd)),
+      clients(epoll_fd, edge_triggered, timers) {
+    add_timer_fd(epoll_fd, timers.get_fd());
+    for (int i = 0; i < sub_loops; ++i) {
+        this->sub_loops.push_back(new SubEventLoop(edge_triggered, events_length));
+    }
+}
+
+EventLoop::~EventLoop() {
+    stop();
+    for (auto sub_loop : sub_loops) {
+        delete sub_loop;
+    }
+    for (int fd : socket_fd) {
+        close(fd);
+    }
+    close(wakeup_fd);
+    close(epoll_fd);
+}
+
+void EventLoop::listen(const char *ip, int port) {
+    int fd = listen_socket(ip, port, listen_options, edge_triggered);
+    socket_fd.insert(fd);
+
+    epoll_event event;
+    event.events = EPOLLIN | (edge_triggered ? static_cast<uint32_t>(EPOLLET) : 0);
+    event.data.u64 = make_token(fd, 0, static_cast<uint8_t>(FdType::Listener));
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        throw std::runtime_error(
+            fmt::format("Failed to add socket to epoll, error: {}", strerror(errno)));
+    }
+}
+
+void EventLoop::accept(int fd) {
+    do {
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int client_fd = ::accept4(fd, (sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == ECONNABORTED || errno == EINTR || errno == EPROTO) {
+                // Only this client is gone.
+                continue;
+            }
+            log_accept_error(errno);
+            if (accept_exhausted(errno)) {
+                pause_accept(fd);
+            }
+            return;
+        }
+        if (!sub_loops.empty()) {
+            pick_sub_loop()->add_client(client_fd);
+        } else {
+            try {
+                // add() closes the fd itself when epoll refuses it.
+                clients.add(client_fd);
+            } catch (std::exception &e) {
+                std::cerr << e.what() << "\n";
+            }
+        }
+    } while (edge_triggered);
+}
+
+void EventLoop::arm_listener(int fd, bool armed) {
+    epoll_event event;
+    event.events = armed ? EPOLLIN | (edge_triggered ? static_cast<uint32_t>(EPOLLET) : 0) : 0;
+    event.data.u64 = make_token(fd, 0, static_cast<uint8_t>(FdType::Listener));
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        throw std::runtime_error(
+            fmt::format("Failed to modify socket in epoll, error: {}", strerror(errno)));
+    }
+}
+
+void EventLoop::pause_accept(int fd) {
+    // Out of fds or memory the clients stay in the backlog, and a listener left armed would be
+    // reported readable again at once. Re-arming it also reports the clients queued meanwhile.
+    arm_listener(fd, false);
+    timers.add(ACCEPT_BACKOFF_MS, [this, fd] { arm_listener(fd, true); });
+}
+
+SubEventLoop *EventLoop::pick_sub_loop() {
+    // Least-loaded, starting the scan round-robin so ties spread evenly.
+    SubEventLoop *best = sub_loops[next_loop];
+    size_t best_count = best->client_count();
+    for (size_t i = 1; i < sub_loops.size() && best_count > 0; ++i) {
+        SubEventLoop *candidate = sub_loops[(next_loop + i) % sub_loops.size()];
+        size_t count = candidate->client_count();
+        if (count < best_count) {
+            best = candidate;
+            best_count = count;
+        }
+    }
+    next_loop = (next_loop + 1) % sub_loops.size();
+    return best;
+}
+
+void EventLoop::set_listen_options(const ListenOptions &options) { listen_options = options; }
+
+void EventLoop::set_timeouts(int idle_timeout, int request_timeout) {
+    clients.set_timeouts(idle_timeout, request_timeout);
+    for (auto sub_loop : sub_loops) {
+        sub_loop->set_timeouts(idle_timeout, request_timeout);
+    }
+}
 
-                    Request request(buffer);
-                    Response response;
+void EventLoop::set_request_limits(size_t header_limit, size_t body_limit) {
+    clients.set_request_limits(header_limit, body_limit);
+    for (auto sub_loop : sub_loops) {
+        sub_loop->set_request_limits(header_limit, body_limit);
+    }
+}
+
+void EventLoop::set_router(const Router *router) {
+    clients.set_router(router);
+    for (auto sub_loop : sub_loops) {
+        sub_loop->set_router(router);
+    }
+}
+
+void EventLoop::set_task_pool(TaskPool *pool) {
+    clients.set_task_pool(pool);
+    for (auto sub_loop : sub_loops) {
+        sub_loop->set_task_pool(pool);
+    }
+}
 
-                    std::string response_body(fmt::format(
-                        "<html><body><h1>{} {}</h1><p>{}</p><p>{}</p></body></html>",
-                        request.get_method(), request.get_path(), request.get_body(), LOREM));
+TimerId EventLoop::add_timer(int timeout, std::function<void()> callback, bool periodic) {
+    return timers.add(timeout, std::move(callback), periodic ? timeout : 0);
+}
+
+bool EventLoop::cancel_timer(TimerId id) { return timers.cancel(id); }
+
+bool EventLoop::reschedule_timer(TimerId id, int timeout) {
+    return timers.reschedule(id, timeout);
+}
+
+std::vector<PoolStats> EventLoop::get_arena_stats() {
+    std::vector<PoolStats> stats = {clients.get_arena_stats()};
+    for (auto sub_loop : sub_loops) {
+        stats.push_back(sub_loop->get_arena_stats());
+    }
+    return stats;
+}
 
-                    response.set_header("Content-Type", "text/html");
-                    response.set_header("Content-Length", std::to_string(response_body.size()));
-                    response.set_body(response_body);
+void EventLoop::write(int fd, const std::string &data) { clients.write(fd, data); }
 
-                    write(event.data.fd, response.to_string());
+void EventLoop::run() {
+    error = nullptr;
+    for (auto sub_loop : sub_loops) {
+        sub_threads.emplace_back([this, sub_loop] {
+            try {
+                sub_loop->run();
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                // run() rethrows it once the other loops have stopped too.
+                stop();
+            }
+        });
+    }
+    try {
+        std::vector<epoll_event> events(events_length);
+        running = true;
+        while (running) {
+            int n = epoll_wait(epoll_fd, events.data(), events_length, -1);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(
+                    fmt::format("Failed to wait on epoll, error: {}", strerror(errno)));
+            }
+            for (int i = 0; i < n; ++i) {
+                uint64_t token = events[i].data.u64;
+                switch (static_cast<FdType>(token_tag(token))) {
+                case FdType::Client:
+                    clients.handle(token, events[i].events);
+                    break;
+                case FdType::Listener:
+                    accept(token_fd(token));
+                    break;
+                case FdType::Timer:
+                    timers.handle_expired();
+                    break;
+                case FdType::Wakeup:
+                    running = false;
+                    break;
+                case FdType::Offload:
+                    clients.complete_offloads();
+                    break;
+                default:
+                    break;
                 }
             }
         }
+    } catch (...) {
+        join_sub_loops();
+        throw;
+    }
+    join_sub_loops();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void EventLoop::join_sub_loops() {
+    // Only run() touches sub_threads, stop() just signals.
+    for (auto sub_loop : sub_loops) {
+        sub_loop->stop();
+    }
+    for (auto &thread : sub_threads) {
+        thread.join();
+    }
+    sub_threads.clear();
+}
+
+void EventLoop::stop() {
+    running = false;
+    uint64_t one = 1;
+    ::write(wakeup_fd, &one, sizeof(one));
+    for (auto sub_loop : sub_loops) {
+        sub_loop->stop();
     }
 }
 
@@ -0,0 +1,240 @@
+#include "http_scanner.h"
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCANNER_X86 1
+#endif
+
+namespace mpmc {
+
+namespace {
+
+constexpr bool is_token_char(unsigned char c) {
+    if (c <= 0x20 || c >= 0x7f) {
+        return false;
+    }
+    for (const char *p = "\"(),/:;<=>?@[\\]{}"; *p != '\0'; ++p) {
+        if (c == static_cast<unsigned char>(*p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr bool is_target_char(unsigned char c) { return c > 0x20 && c != 0x7f; }
+
+constexpr bool is_field_char(unsigned char c) { return (c >= 0x20 || c == '\t') && c != 0x7f; }
+
+struct Tables {
+    bool token[256] = {};
+    bool target[256] = {};
+    bool field[256] = {};
+    // Token lookup by nibbles: byte c is a tchar iff token_low[c & 15] & token_high[c >> 4].
+    alignas(32) uint8_t token_low[32] = {};
+    alignas(32) uint8_t token_high[32] = {};
+
+    constexpr Tables() {
+        for (int c = 0; c < 256; ++c) {
+            token[c] = is_token_char(c);
+            target[c] = is_target_char(c);
+            field[c] = is_field_char(c);
+            if (token[c]) {
+                token_low[c & 15] |= 1 << (c >> 4);
+                token_low[16 + (c & 15)] |= 1 << (c >> 4);
+            }
+        }
+        for (int high = 0; high < 8; ++high) {
+            token_high[high] = token_high[16 + high] = 1 << high;
+        }
+    }
+};
+
+constexpr Tables tables;
+
+inline const char *scan_scalar(const bool *table, const char *begin, const char *end) {
+    while (begin < end && table[static_cast<unsigned char>(*begin)]) {
+        ++begin;
+    }
+    return begin;
+}
+
+const char *scalar_token(const char *begin, const char *end) {
+    return scan_scalar(tables.token, begin, end);
+}
+
+const char *scalar_target(const char *begin, const char *end) {
+    return scan_scalar(tables.target, begin, end);
+}
+
+const char *scalar_field(const char *begin, const char *end) {
+    return scan_scalar(tables.field, begin, end);
+}
+
+#ifdef HTTP_SCANNER_X86
+
+__attribute__((target("sse4.2"))) const char *sse42_token(const char *begin, const char *end) {
+    const __m128i low_table = _mm_load_si128(reinterpret_cast<const __m128i *>(tables.token_low));
+    const __m128i high_table =
+        _mm_load_si128(reinterpret_cast<const __m128i *>(tables.token_high));
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; end - begin >= 16; begin += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+        __m128i low = _mm_shuffle_epi8(low_table, _mm_and_si128(bytes, nibble));
+        __m128i high =
+            _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        __m128i invalid = _mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128());
+        int mask = _mm_movemask_epi8(invalid);
+        if (mask != 0) {
+            return begin + __builtin_ctz(mask);
+        }
+    }
+    return scalar_token(begin, end);
+}
+
+/**
+ * @brief PCMPESTRI in range mode: index of the first byte in [begin, end) that falls in one of the
+ * byte ranges listed in `ranges`.
+ */
+__attribute__((target("sse4.2"))) const char *sse42_ranges(const char *begin, const char *end,
+                                                          const char *ranges, int ranges_length) {
+    const __m128i range = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ranges));
+    for (; end - begin >= 16; begin += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+        int index = _mm_cmpestri(range, ranges_length, bytes, 16,
+                                 _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (index != 16) {
+            return begin + index;
+        }
+    }
+    return nullptr;
+}
+
+__attribute__((target("sse4.2"))) const char *sse42_target(const char *begin, const char *end) {
+    alignas(16) static const char ranges[16] = "\x00\x20\x7f\x7f";
+    const char *found = sse42_ranges(begin, end, ranges, 4);
+    return found != nullptr ? found : scalar_target(begin + (end - begin) / 16 * 16, end);
+}
+
+__attribute__((target("sse4.2"))) const char *sse42_field(const char *begin, const char *end) {
+    alignas(16) static const char ranges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+    const char *found = sse42_ranges(begin, end, ranges, 6);
+    return found != nullptr ? found : scalar_field(begin + (end - begin) / 16 * 16, end);
+}
+
+__attribute__((target("avx2"))) const char *avx2_token(const char *begin, const char *end) {
+    const __m256i low_table =
+        _mm256_load_si256(reinterpret_cast<const __m256i *>(tables.token_low));
+    const __m256i high_table =
+        _mm256_load_si256(reinterpret_cast<const __m256i *>(tables.token_high));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    for (; end - begin >= 32; begin += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+        __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(bytes, nibble));
+        __m256i high =
+            _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        __m256i invalid = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+        uint32_t mask = _mm256_movemask_epi8(invalid);
+        if (mask != 0) {
+            return begin + __builtin_ctz(mask);
+        }
+    }
+    return scalar_token(begin, end);
+}
+
+__attribute__((target("avx2"))) const char *avx2_target(const char *begin, const char *end) {
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    for (; end - begin >= 32; begin += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+        // Unsigned bytes <= 0x20 are those left unchanged by min(bytes, 0x20).
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, space), bytes);
+        __m256i invalid = _mm256_or_si256(control, _mm256_cmpeq_epi8(bytes, del));
+        uint32_t mask = _mm256_movemask_epi8(invalid);
+        if (mask != 0) {
+            return begin + __builtin_ctz(mask);
+        }
+    }
+    return scalar_target(begin, end);
+}
+
+__attribute__((target("avx2"))) const char *avx2_field(const char *begin, const char *end) {
+    const __m256i last_control = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    for (; end - begin >= 32; begin += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+        __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(bytes, last_control), bytes);
+        control = _mm256_andnot_si256(_mm256_cmpeq_epi8(bytes, tab), control);
+        __m256i invalid = _mm256_or_si256(control, _mm256_cmpeq_epi8(bytes, del));
+        uint32_t mask = _mm256_movemask_epi8(invalid);
+        if (mask != 0) {
+            return begin + __builtin_ctz(mask);
+        }
+    }
+    return scalar_field(begin, end);
+}
+
+#endif
+
+using Scan = const char *(*)(const char *, const char *);
+
+struct Implementation {
+    ScannerIsa isa;
+    Scan token;
+    Scan target;
+    Scan field;
+};
+
+Implementation implementation_for(ScannerIsa isa) {
+#ifdef HTTP_SCANNER_X86
+    __builtin_cpu_init();
+    if (isa == ScannerIsa::AVX2 && __builtin_cpu_supports("avx2")) {
+        return {ScannerIsa::AVX2, avx2_token, avx2_target, avx2_field};
+    }
+    if (isa != ScannerIsa::Scalar && __builtin_cpu_supports("sse4.2")) {
+        return {ScannerIsa::SSE42, sse42_token, sse42_target, sse42_field};
+    }
+#endif
+    return {ScannerIsa::Scalar, scalar_token, scalar_target, scalar_field};
+}
+
+Implementation &implementation() {
+    static Implementation selected = implementation_for(ScannerIsa::AVX2);
+    return selected;
+}
+
+} // namespace
+
+const char *scan_token(const char *begin, const char *end) {
+    return implementation().token(begin, end);
+}
+
+const char *scan_target(const char *begin, const char *end) {
+    return implementation().target(begin, end);
+}
+
+const char *scan_field(const char *begin, const char *end) {
+    return implementation().field(begin, end);
+}
+
+ScannerIsa scanner_isa() { return implementation().isa; }
+
+ScannerIsa set_scanner_isa(ScannerIsa isa) {
+    implementation() = implementation_for(isa);
+    return implementation().isa;
+}
+
+const char *scanner_isa_name(ScannerIsa isa) {
+    switch (isa) {
+    case ScannerIsa::AVX2:
+        return "avx2";
+    case ScannerIsa::SSE42:
+        return "sse4.2";
+    case ScannerIsa::Scalar:
+        return "scalar";
+    }
+    return "unknown";
+}
+
+} // namespace mpmc
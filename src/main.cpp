@@ -1,47 +1,166 @@
-#include "event_loop.h"
 #include "network.h"
+#include "response_cache.h"
+#include "router.h"
+#include "server.h"
+#include "static_files.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <iterator>
+#include <thread>
 
 using namespace mpmc;
-using namespace evtlp;
 
-void multithreaded_test() {
-    TCPListener listener("127.0.0.1", 8080);
-    ThreadPool<HTTPHandler> pool(6);
+constexpr const char *LOREM =
+    "But I must explain to you how all this mistaken idea of denouncing pleasure and praising pain "
+    "was born and I will give you a complete account of the system, and expound the actual "
+    "teachings of the great explorer of the truth, the master-builder of human happiness. No one "
+    "rejects, dislikes, or avoids pleasure itself, because it is pleasure, but because those who "
+    "do not know how to pursue pleasure rationally encounter consequences that are extremely "
+    "painful. Nor again is there anyone who loves or pursues or desires to obtain pain of itself, "
+    "because it is pain, but because occasionally circumstances occur in which toil and pain can "
+    "procure him some great pleasure. To take a trivial example, which of us ever undertakes "
+    "laborious physical exercise, except to obtain some advantage from it? But who has any right "
+    "to find fault with a man who chooses to enjoy a pleasure that has no annoying consequences, "
+    "or one who avoids a pain that produces no resultant pleasure?";
 
-    for (auto &stream : listener) {
-        fmt::print("Server received a connection from {}\n", stream.get_client_addr());
-        pool.submit(HTTPHandler(&stream));
+template <typename Output> static void render(const RequestView &request, Output output) {
+    fmt::format_to(output, "<html><body><h1>{} {}</h1><p>{}</p><p>{}</p></body></html>",
+                   request.get_method(), request.get_path(), request.get_body(), LOREM);
+}
+
+/**
+ * @brief Streams `paragraphs` paragraphs of LOREM, as many as fit in each chunk.
+ */
+class LoremStream : public BodyStream {
+  private:
+    size_t paragraphs;
+
+  public:
+    LoremStream(size_t paragraphs) : paragraphs(paragraphs) {}
+
+    bool read(std::pmr::string &output, size_t limit) override {
+        size_t start = output.size();
+        while (paragraphs > 0 && output.size() - start < limit) {
+            fmt::format_to(std::back_inserter(output), "<p>{}</p>\n", LOREM);
+            --paragraphs;
+        }
+        return paragraphs > 0;
+    }
+};
+
+static bool parse_number(std::string_view text, size_t &number) {
+    auto result = std::from_chars(text.data(), text.data() + text.size(), number);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+static void stream_lorem(RouteContext &context) {
+    size_t paragraphs = 0;
+    if (!parse_number(context.param("count"), paragraphs)) {
+        context.writer.error(StatusCode::NotFound, context.keep_alive);
+        return;
     }
+    // HTTP/1.0 has no chunked coding, the body ends with the connection.
+    bool chunked = context.request.get_version() == "HTTP/1.1";
+    context.keep_alive = context.keep_alive && chunked;
+    context.stream = std::make_unique<LoremStream>(paragraphs);
+    context.writer.start(StatusCode::OK);
+    context.writer.header(HeaderId::ContentType, "text/html");
+    context.writer.finish_stream(*context.stream, chunked, context.keep_alive);
 }
 
-void event_loop_test() {
-    EventLoop loop;
-    loop.listen("127.0.0.1", 8080);
-    loop.run();
+static void echo_lorem(RouteContext &context, ResponseCache *cache) {
+    const RequestView &request = context.request;
+    auto render_body = [&request](std::string &body) {
+        render(request, std::back_inserter(body));
+    };
+    if (cache != nullptr &&
+        cache->respond(request, context.keep_alive, context.writer, "text/html", render_body)) {
+        return;
+    }
+    context.writer.start(StatusCode::OK);
+    context.writer.header(HeaderId::ContentType, "text/html");
+    render(request, std::back_inserter(context.writer.body()));
+    context.writer.finish(context.keep_alive);
 }
 
-void ring_event_loop_test(){
-    RingEventLoop loop;
-    loop.listen("127.0.0.1", 8080);
-    loop.run();
+/**
+ * @brief Stands in for a slow backend call: echoes the request after sleeping `ms` milliseconds,
+ * at most MAX_SLOW_MS.
+ */
+static void slow_lorem(RouteContext &context) {
+    constexpr size_t MAX_SLOW_MS = 10000;
+    size_t ms = 0;
+    if (!parse_number(context.param("ms"), ms)) {
+        context.writer.error(StatusCode::NotFound, context.keep_alive);
+        return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(std::min(ms, MAX_SLOW_MS)));
+    echo_lorem(context, nullptr);
 }
 
-void timer_test(){
-    EventLoop loop;
-    loop.add_timer(1000, []{
-        fmt::print("Timer1 fired!\n");
-    });
-    loop.add_timer(2000, []{
-        fmt::print("Timer2 fired!\n");
-    });
-    loop.run();
+/**
+ * @brief The demo routes every engine serves: files below /static/, GET /stream/<n> streams n
+ * paragraphs, GET /slow/<ms> answers after ms milliseconds on the offload pool, and any other
+ * GET, HEAD or POST echoes the request in a page of LOREM (from `cache` if given).
+ */
+static void add_routes(Router &router, StaticFiles &files, ResponseCache *cache = nullptr) {
+    auto serve_file = [&files](RouteContext &context) {
+        context.file = files.serve(context.request, context.keep_alive, context.writer);
+    };
+    router.add("GET", "/static/*path", serve_file);
+    router.add("HEAD", "/static/*path", serve_file);
+    router.add("GET", "/stream/:count", stream_lorem);
+    router.offload("GET", "/slow/:ms", slow_lorem);
+    for (const char *method : {"GET", "HEAD", "POST"}) {
+        router.add(method, "/*path",
+                   [cache](RouteContext &context) { echo_lorem(context, cache); });
+    }
 }
 
-int main() {
-    // timer_test();
-    // event_loop_test();
-    // multithreaded_test();
-    ring_event_loop_test();
+int main(int argc, char **argv) {
+    // ./main [threads] [epoll|io_uring|threads] [et] [cache] [steal], used by bench.sh
+    ServerConfig config;
+    config.addresses = {{"127.0.0.1", 8080}};
+    bool cached = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i == 1 && std::isdigit(static_cast<unsigned char>(arg[0]))) {
+            config.threads = std::atoi(argv[i]);
+        } else if (arg == "et") {
+            config.edge_triggered = true;
+        } else if (arg == "cache") {
+            cached = true;
+        } else if (arg == "steal") {
+            config.scheduling = Scheduling::WorkStealing;
+        } else if (!parse_engine(arg, config.engine)) {
+            std::cerr << "Unknown option: " << arg << "\n";
+            return 1;
+        }
+    }
+    config.pin_cpus = config.engine == Engine::IoUring;
+
+    StaticFiles files("/static/", "static");
+    ResponseCache cache(64 * 1024 * 1024, 5000);
+    Router router;
+    add_routes(router, files, cached ? &cache : nullptr);
+    if (cached) {
+        std::thread reporter([&cache] {
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(5));
+                CacheStats stats = cache.get_stats();
+                fmt::print("cache: {} hits, {} misses, {} evictions, {} entries, {} bytes\n",
+                           stats.hits, stats.misses, stats.evictions, stats.entries, stats.bytes);
+            }
+        });
+        reporter.detach();
+    }
+    fmt::print("Serving on {}:{} with {}, {} threads\n", config.addresses[0].first,
+               config.addresses[0].second, engine_name(config.engine), config.threads);
+    Server server(config, router);
+    server.run();
     return 0;
 }
@@ -1,10 +1,23 @@
 #include "network.h"
+#include "http_scanner.h"
+#include "router.h"
 #include <algorithm>
 #include <arpa/inet.h>
 #include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cctype>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <iterator>
 #include <stdexcept>
+#include <string_view>
+#include <strings.h>
+#include <system_error>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 namespace mpmc {
@@ -25,10 +38,49 @@ int TCPStream::read(char *buffer, int size) {
 }
 
 void TCPStream::write(const std::string &data) {
-    int n = send(socket_fd, data.c_str(), data.size(), 0);
-    if (n < 0) {
-        throw std::runtime_error(
-            fmt::format("Failed to write to socket: {} {}:{}", std::strerror(errno), ip, port));
+    size_t sent = 0;
+    while (sent < data.size()) {
+        int n = send(socket_fd, data.c_str() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw std::runtime_error(fmt::format("Failed to write to socket: {} {}:{}",
+                                                 std::strerror(errno), ip, port));
+        }
+        sent += n;
+    }
+}
+
+void TCPStream::write(ResponseWriter &writer) {
+    if (!writer.send(socket_fd)) {
+        throw std::runtime_error(fmt::format("Failed to write to socket: {} {}:{}",
+                                             std::strerror(errno), ip, port));
+    }
+}
+
+void TCPStream::send_file(int fd, off_t offset, size_t length) {
+    while (length > 0) {
+        ssize_t n = sendfile(socket_fd, fd, &offset, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error(fmt::format("Failed to send file to socket: {} {}:{}",
+                                                 n < 0 ? std::strerror(errno) : "file truncated",
+                                                 ip, port));
+        }
+        length -= n;
+    }
+}
+
+void TCPStream::set_read_timeout(int timeout) {
+    timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        throw std::runtime_error(fmt::format("Failed to set read timeout: {} {}:{}",
+                                             std::strerror(errno), ip, port));
     }
 }
 
@@ -66,29 +118,79 @@ bool TCPStreamIterator::operator!=(const TCPStreamIterator &other) const {
     return !(*this == other);
 }
 
-TCPListener::TCPListener(const char *_ip, int _port) : ip(_ip), port(_port) {
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd < 0) {
+int listen_socket(const char *ip, int port, const ListenOptions &options, bool nonblocking,
+                  bool reuse_port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+    if (fd == -1) {
         throw std::runtime_error(
-            fmt::format("Failed to create socket: {} {}:{}", std::strerror(errno), _ip, _port));
+            fmt::format("Failed to create socket, error: {}", strerror(errno)));
     }
-
-    bzero((char *)&address, sizeof(address));
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = inet_addr(_ip);
-    address.sin_port = htons(_port);
-
-    if (bind(socket_fd, (sockaddr *)&address, sizeof(address)) < 0) {
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        close(fd);
         throw std::runtime_error(
-            fmt::format("Failed to bind socket: {} {}:{}", std::strerror(errno), _ip, _port));
+            fmt::format("Failed to set SO_REUSEPORT, error: {}", strerror(errno)));
     }
-
-    if (listen(socket_fd, 5) < 0) {
+    // Set before listen() so the accepted sockets inherit them and the window scale fits.
+    if (options.receive_buffer > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer,
+                                                 sizeof(options.receive_buffer)) == -1) {
+        close(fd);
+        throw std::runtime_error(
+            fmt::format("Failed to set SO_RCVBUF, error: {}", strerror(errno)));
+    }
+    if (options.send_buffer > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.send_buffer,
+                                              sizeof(options.send_buffer)) == -1) {
+        close(fd);
         throw std::runtime_error(
-            fmt::format("Failed to listen on socket: {} {}:{}", std::strerror(errno), _ip, _port));
+            fmt::format("Failed to set SO_SNDBUF, error: {}", strerror(errno)));
     }
+    sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(ip);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        throw std::runtime_error(
+            fmt::format("Failed to bind socket: {} {}:{}", strerror(errno), ip, port));
+    }
+    if (::listen(fd, options.backlog) == -1) {
+        close(fd);
+        throw std::runtime_error(
+            fmt::format("Failed to listen on socket: {} {}:{}", strerror(errno), ip, port));
+    }
+    return fd;
+}
+
+static uint64_t monotonic_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
 }
 
+void log_accept_error(int error) {
+    static thread_local uint64_t last_ms = 0;
+    static thread_local uint64_t dropped = 0;
+    uint64_t now = monotonic_ms();
+    if (last_ms != 0 && now - last_ms < 1000) {
+        ++dropped;
+        return;
+    }
+    std::cerr << fmt::format("Failed to accept client, error: {} ({} more not logged)",
+                             std::strerror(error), dropped)
+              << "\n";
+    last_ms = now;
+    dropped = 0;
+}
+
+bool accept_exhausted(int error) {
+    return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+}
+
+TCPListener::TCPListener(const char *_ip, int _port, const ListenOptions &options)
+    : socket_fd(listen_socket(_ip, _port, options)), port(_port), ip(_ip) {}
+
 TCPListener::~TCPListener() { close(socket_fd); }
 
 TCPStream TCPListener::accept() {
@@ -97,8 +199,10 @@ TCPStream TCPListener::accept() {
     int client_socket_fd = ::accept(socket_fd, (sockaddr *)&client_addr, &client_addr_len);
 
     if (client_socket_fd < 0) {
-        throw std::runtime_error(
-            fmt::format("Failed to accept connection: {} {}:{}", std::strerror(errno), ip, port));
+        int error = errno;
+        throw std::system_error(
+            error, std::generic_category(),
+            fmt::format("Failed to accept connection on {}:{}", ip, port));
     }
 
     char client_ip[INET_ADDRSTRLEN];
@@ -108,51 +212,104 @@ TCPStream TCPListener::accept() {
     return TCPStream(client_socket_fd, ip.c_str(), port, client_ip, client_port);
 }
 
+void TCPListener::shutdown() { ::shutdown(socket_fd, SHUT_RDWR); }
+
 TCPStreamIterator TCPListener::begin() { return ++TCPStreamIterator(this); }
 
 TCPStreamIterator TCPListener::end() { return TCPStreamIterator(this); }
 
 Request::Request(const std::string &request_str) {
-    auto body_pos = request_str.find("\r\n\r\n");
+    RequestParser parser(SIZE_MAX, SIZE_MAX);
+    if (parser.parse(request_str.data(), request_str.size()) != RequestParser::Result::Complete) {
+        throw std::runtime_error(fmt::format("Failed to parse request: {}",
+                                             reason_phrase(parser.error())));
+    }
+    *this = Request(parser.view(request_str.data()));
+}
 
-    auto request_header = request_str.substr(0, body_pos);
-    std::string request_body("");
+Request::Request(const std::string &method, const std::string &path, const std::string &version,
+                 const Headers &headers, const std::string &body)
+    : method(method), path(path), version(version), headers(headers), body(body) {}
 
-    if (body_pos != std::string::npos) {
-        request_body = request_str.substr(body_pos + 4);
+Request::Request(const RequestView &view)
+    : method(view.get_method()), path(view.get_path()), version(view.get_version()),
+      body(view.get_body()) {
+    for (auto &header : view.get_headers()) {
+        headers.add(header.id, header.name, header.value);
     }
+}
 
-    auto lines = split(request_header, "\r\n");
-    auto request_line = split(lines[0], " ");
-    method = request_line[0];
-    path = request_line[1];
-    version = request_line[2];
+Request::~Request() {}
 
-    for (int i = 1; i < lines.size(); i++) {
-        auto header = split(lines[i], ": ");
-        headers[header[0]] = header[1];
+const std::string &Request::get_method() const { return method; }
+const std::string &Request::get_path() const { return path; }
+const std::string &Request::get_version() const { return version; }
+const Request::Headers &Request::get_headers() const { return headers; }
+const std::string &Request::get_body() const { return body; }
+
+/**
+ * @brief Whether the comma-separated header `value` lists `token`, ignoring case.
+ */
+static bool has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        size_t comma = std::min(value.find(','), value.size());
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+            item.remove_suffix(1);
+        }
+        if (equals_ignore_case(item, token)) {
+            return true;
+        }
+        value.remove_prefix(std::min(comma + 1, value.size()));
     }
+    return false;
+}
 
-    body = request_body;
+static bool keep_alive(std::string_view version, std::string_view connection) {
+    if (has_token(connection, "close")) {
+        return false;
+    }
+    return has_token(connection, "keep-alive") || version == "HTTP/1.1";
 }
 
-Request::Request(const std::string &method, const std::string &path, const std::string &version,
-                 const Headers &headers, const std::string &body)
-    : method(method), path(path), version(version), body(body) {}
+std::string_view Request::get_header(HeaderId id) const { return headers.get(id); }
 
-Request::~Request() {}
+std::string_view Request::get_header(std::string_view name) const { return headers.get(name); }
 
-std::string Request::get_method() const { return method; }
-std::string Request::get_path() const { return path; }
-std::string Request::get_version() const { return version; }
-Request::Headers Request::get_headers() const { return headers; }
-std::string Request::get_body() const { return body; }
+bool Request::keep_alive() const {
+    return mpmc::keep_alive(version, get_header(HeaderId::Connection));
+}
+
+RequestView::RequestView(std::string_view method, std::string_view path, std::string_view version,
+                         const Headers *headers, std::string_view body)
+    : method(method), path(path), version(version), headers(headers), body(body) {}
+
+std::string_view RequestView::get_method() const { return method; }
+std::string_view RequestView::get_path() const { return path; }
+std::string_view RequestView::get_version() const { return version; }
+std::string_view RequestView::get_body() const { return body; }
+const RequestView::Headers &RequestView::get_headers() const { return *headers; }
+size_t RequestView::get_header_count() const { return headers->size(); }
+const RequestView::Header &RequestView::get_header(size_t index) const {
+    return (*headers)[index];
+}
+std::string_view RequestView::get_header(HeaderId id) const { return headers->get(id); }
+std::string_view RequestView::get_header(std::string_view name) const {
+    return headers->get(name);
+}
+
+bool RequestView::keep_alive() const {
+    return mpmc::keep_alive(version, get_header(HeaderId::Connection));
+}
 
 std::string Request::to_string() const {
     std::string request_str = fmt::format("{} {} {}\r\n", method, path, version);
 
     for (auto &header : headers) {
-        request_str += fmt::format("{}: {}\r\n", header.first, header.second);
+        request_str += fmt::format("{}: {}\r\n", header.name, header.value);
     }
 
     request_str += fmt::format("\r\n{}", body);
@@ -160,6 +317,390 @@ std::string Request::to_string() const {
     return request_str;
 }
 
+/**
+ * @brief Length of the line break at `p`: 2 for CRLF, 1 for a bare LF, 0 when a CR is the last byte
+ * received so far and -1 for anything else.
+ */
+static int line_break(const char *p, const char *end) {
+    if (*p == '\n') {
+        return 1;
+    }
+    if (*p != '\r') {
+        return -1;
+    }
+    if (p + 1 == end) {
+        return 0;
+    }
+    return p[1] == '\n' ? 2 : -1;
+}
+
+RequestParser::RequestParser(size_t header_limit, size_t body_limit,
+                             std::pmr::memory_resource *resource)
+    : header_limit(header_limit), body_limit(body_limit), headers(resource), decoded(resource) {
+    reset();
+}
+
+void RequestParser::set_limits(size_t header_limit, size_t body_limit) {
+    this->header_limit = header_limit;
+    this->body_limit = body_limit;
+}
+
+void RequestParser::reset() {
+    state = State::Method;
+    position = 0;
+    scanned = 0;
+    content_length = 0;
+    has_content_length = false;
+    chunked = false;
+    chunk_remaining = 0;
+    status = StatusCode::BadRequest;
+    method = path = version = header_name = body = Span();
+    headers.clear();
+    decoded.clear();
+}
+
+void RequestParser::release() {
+    mpmc::release(headers);
+    mpmc::release(decoded);
+}
+
+RequestParser::Result RequestParser::fail(StatusCode status) {
+    this->status = status;
+    state = State::Failed;
+    return Result::Error;
+}
+
+RequestParser::Result RequestParser::need_more(size_t size) {
+    if (size > header_limit) {
+        return fail(StatusCode::RequestHeaderFieldsTooLarge);
+    }
+    return Result::NeedMore;
+}
+
+bool RequestParser::end_line(size_t line_break) {
+    scanned += line_break;
+    position = scanned;
+    return scanned <= header_limit;
+}
+
+bool RequestParser::add_header(const char *data, HeaderId id, Span name, Span value) {
+    headers.push_back({id, name, value});
+    if (id == HeaderId::TransferEncoding) {
+        // chunked has to be the only coding, which also rules out a second chunked.
+        std::string_view coding(data + value.offset, value.length);
+        if (chunked || !equals_ignore_case(coding, "chunked")) {
+            status = StatusCode::NotImplemented;
+            return false;
+        }
+        chunked = true;
+    }
+    if (id == HeaderId::ContentLength) {
+        // Digits only: from_chars takes no sign or whitespace for an unsigned type, and reports
+        // overflow.
+        const char *digits = data + value.offset;
+        const char *digits_end = digits + value.length;
+        size_t length = 0;
+        auto [end, error] = std::from_chars(digits, digits_end, length);
+        if (value.length == 0 || end != digits_end) {
+            return false;
+        }
+        if (error == std::errc::result_out_of_range) {
+            status = StatusCode::PayloadTooLarge;
+            return false;
+        }
+        if (has_content_length && length != content_length) {
+            return false;
+        }
+        if (length > body_limit) {
+            status = StatusCode::PayloadTooLarge;
+            return false;
+        }
+        content_length = length;
+        has_content_length = true;
+    }
+    return true;
+}
+
+RequestParser::Result RequestParser::parse(const char *data, size_t size) {
+    // `data` always starts at the first byte of the request and `scanned` is where the previous
+    // call stopped, so a request split across reads is scanned once. Only offsets are kept: the
+    // caller may reallocate the buffer between calls. The scanners of http_scanner.h stop at the
+    // next delimiter or at a character the current field does not allow.
+    const char *end = data + size;
+    while (state != State::Body) {
+        switch (state) {
+        case State::Method: {
+            // Empty lines before the request line are ignored.
+            if (scanned == position) {
+                while (position < size && (data[position] == '\r' || data[position] == '\n')) {
+                    ++position;
+                }
+                scanned = position;
+            }
+            const char *p = scan_token(data + scanned, end);
+            scanned = p - data;
+            if (p == end) {
+                return need_more(size);
+            }
+            if (*p != ' ' || scanned == position) {
+                return fail(StatusCode::BadRequest);
+            }
+            method = {position, scanned - position};
+            position = ++scanned;
+            state = State::Target;
+            break;
+        }
+        case State::Target: {
+            const char *p = scan_target(data + scanned, end);
+            scanned = p - data;
+            if (p == end) {
+                return need_more(size);
+            }
+            if (*p != ' ' || scanned == position) {
+                return fail(StatusCode::BadRequest);
+            }
+            path = {position, scanned - position};
+            position = ++scanned;
+            state = State::Version;
+            break;
+        }
+        case State::Version: {
+            const char *p = scan_target(data + scanned, end);
+            scanned = p - data;
+            int length = p == end ? 0 : line_break(p, end);
+            if (length == 0) {
+                return need_more(size);
+            }
+            if (length < 0) {
+                return fail(StatusCode::BadRequest);
+            }
+            version = {position, scanned - position};
+            std::string_view name(data + version.offset, version.length);
+            if (name != "HTTP/1.1" && name != "HTTP/1.0") {
+                return fail(name.substr(0, 5) == "HTTP/" ? StatusCode::HTTPVersionNotSupported
+                                                         : StatusCode::BadRequest);
+            }
+            if (!end_line(length)) {
+                return fail(StatusCode::RequestHeaderFieldsTooLarge);
+            }
+            state = State::HeaderLine;
+            break;
+        }
+        case State::HeaderLine: {
+            if (scanned == size) {
+                return need_more(size);
+            }
+            if (data[scanned] != '\r' && data[scanned] != '\n') {
+                state = State::HeaderName;
+                break;
+            }
+            int length = line_break(data + scanned, end);
+            if (length == 0) {
+                return need_more(size);
+            }
+            if (length < 0) {
+                return fail(StatusCode::BadRequest);
+            }
+            body.offset = scanned + length;
+            if (chunked) {
+                // Both framings at once is how requests are smuggled past other parsers.
+                if (has_content_length) {
+                    return fail(StatusCode::BadRequest);
+                }
+                position = scanned = body.offset;
+                state = State::ChunkSize;
+                break;
+            }
+            state = State::Body;
+            break;
+        }
+        case State::HeaderName: {
+            const char *p = scan_token(data + scanned, end);
+            scanned = p - data;
+            if (p == end) {
+                return need_more(size);
+            }
+            // Also rejects obsolete line folding and whitespace before the colon.
+            if (*p != ':' || scanned == position) {
+                return fail(StatusCode::BadRequest);
+            }
+            header_name = {position, scanned - position};
+            position = ++scanned;
+            state = State::HeaderValue;
+            break;
+        }
+        case State::HeaderValue: {
+            const char *p = scan_field(data + scanned, end);
+            scanned = p - data;
+            int length = p == end ? 0 : line_break(p, end);
+            if (length == 0) {
+                return need_more(size);
+            }
+            if (length < 0) {
+                return fail(StatusCode::BadRequest);
+            }
+            size_t value_begin = position;
+            size_t value_end = scanned;
+            while (value_begin < value_end &&
+                   (data[value_begin] == ' ' || data[value_begin] == '\t')) {
+                ++value_begin;
+            }
+            while (value_end > value_begin &&
+                   (data[value_end - 1] == ' ' || data[value_end - 1] == '\t')) {
+                --value_end;
+            }
+            HeaderId id = header_id({data + header_name.offset, header_name.length});
+            if (!add_header(data, id, header_name, {value_begin, value_end - value_begin})) {
+                return fail(status);
+            }
+            if (!end_line(length)) {
+                return fail(StatusCode::RequestHeaderFieldsTooLarge);
+            }
+            state = State::HeaderLine;
+            break;
+        }
+        case State::ChunkSize: {
+            // Chunks are decoded into `decoded` as they arrive, and view() returns it as the body.
+            Result result = parse_chunk_size(data, size);
+            if (result != Result::Complete) {
+                return result;
+            }
+            break;
+        }
+        case State::ChunkData: {
+            size_t available = std::min(size - scanned, chunk_remaining);
+            decoded.append(data + scanned, available);
+            scanned += available;
+            chunk_remaining -= available;
+            if (chunk_remaining > 0) {
+                return Result::NeedMore;
+            }
+            state = State::ChunkEnd;
+            break;
+        }
+        case State::ChunkEnd: {
+            int length = scanned == size ? 0 : line_break(data + scanned, end);
+            if (length == 0) {
+                return Result::NeedMore;
+            }
+            if (length < 0) {
+                return fail(StatusCode::BadRequest);
+            }
+            position = scanned += length;
+            state = State::ChunkSize;
+            break;
+        }
+        case State::Trailer: {
+            Result result = parse_trailer(data, size);
+            if (result != Result::Complete) {
+                return result;
+            }
+            break;
+        }
+        case State::Done:
+            return Result::Complete;
+        case State::Failed:
+            return Result::Error;
+        case State::Body:
+            break;
+        }
+    }
+    // Content-Length framing: the body is read in place once all of it has arrived.
+    if (size - body.offset < content_length) {
+        return Result::NeedMore;
+    }
+    body.length = content_length;
+    state = State::Done;
+    return Result::Complete;
+}
+
+RequestParser::Result RequestParser::parse_chunk_size(const char *data, size_t size) {
+    // chunk-size [ chunk-ext ] CRLF, the extensions are ignored.
+    auto p = static_cast<const char *>(std::memchr(data + scanned, '\n', size - scanned));
+    if (p == nullptr) {
+        scanned = size;
+        return size - position > CHUNK_LINE_LIMIT ? fail(StatusCode::BadRequest)
+                                                  : Result::NeedMore;
+    }
+    const char *q = data + position;
+    size_t length = 0;
+    int digits = 0;
+    for (; q < p && std::isxdigit(static_cast<unsigned char>(*q)); ++q, ++digits) {
+        if (digits == 15) {
+            return fail(StatusCode::PayloadTooLarge);
+        }
+        int digit = *q <= '9' ? *q - '0' : (*q | 0x20) - 'a' + 10;
+        length = length * 16 + digit;
+    }
+    const char *line_end = p > q && p[-1] == '\r' ? p - 1 : p;
+    if (digits == 0 || (q < line_end && *q != ';' && *q != ' ' && *q != '\t') ||
+        std::find(q, line_end, '\r') != line_end) {
+        return fail(StatusCode::BadRequest);
+    }
+    position = scanned = p + 1 - data;
+    if (length > body_limit - decoded.size()) {
+        return fail(StatusCode::PayloadTooLarge);
+    }
+    if (framing_exceeded()) {
+        return fail(StatusCode::BadRequest);
+    }
+    chunk_remaining = length;
+    state = length == 0 ? State::Trailer : State::ChunkData;
+    return Result::Complete;
+}
+
+RequestParser::Result RequestParser::parse_trailer(const char *data, size_t size) {
+    // Trailer fields are skipped up to the empty line that ends the request.
+    auto p = static_cast<const char *>(std::memchr(data + scanned, '\n', size - scanned));
+    if (p == nullptr) {
+        scanned = size;
+        return framing_exceeded() ? fail(StatusCode::BadRequest) : Result::NeedMore;
+    }
+    size_t line = p - data - position;
+    scanned = p + 1 - data;
+    if (line == 0 || (line == 1 && data[position] == '\r')) {
+        state = State::Done;
+        return Result::Complete;
+    }
+    position = scanned;
+    return framing_exceeded() ? fail(StatusCode::BadRequest) : Result::Complete;
+}
+
+bool RequestParser::framing_exceeded() const {
+    // Chunk lines and trailers may not outgrow the data they frame by more than a header block.
+    // Subtracting keeps it exact for any header_limit, up to SIZE_MAX.
+    size_t framing = scanned - body.offset - decoded.size();
+    return framing > decoded.size() && framing - decoded.size() > header_limit;
+}
+
+size_t RequestParser::length() const { return chunked ? scanned : body.offset + body.length; }
+
+size_t RequestParser::expected_length() const {
+    if (state == State::ChunkData) {
+        // Only the current chunk is known in advance.
+        return scanned + chunk_remaining;
+    }
+    return (state == State::Body || state == State::Done) && !chunked
+               ? body.offset + content_length
+               : 0;
+}
+
+StatusCode RequestParser::error() const { return status; }
+
+RequestView RequestParser::view(const char *data) {
+    // header_views keeps its capacity, so this does not allocate once it has grown to the largest
+    // header count seen.
+    header_views.clear();
+    for (auto &header : headers) {
+        header_views.add(header.id, {data + header.name.offset, header.name.length},
+                         {data + header.value.offset, header.value.length});
+    }
+    std::string_view content = chunked ? std::string_view(decoded)
+                                       : std::string_view(data + body.offset, body.length);
+    return RequestView({data + method.offset, method.length}, {data + path.offset, path.length},
+                       {data + version.offset, version.length}, &header_views, content);
+}
+
 Response::Response() : version("HTTP/1.1"), status_code(200), status_message("OK") {}
 
 Response::Response(const std::string &response_str) {
@@ -180,7 +721,7 @@ Response::Response(const std::string &response_str) {
 
     for (int i = 1; i < lines.size(); i++) {
         auto header = split(lines[i], ": ");
-        headers[header[0]] = header[1];
+        headers.set(header[0], header[1]);
     }
 
     body = response_body;
@@ -205,7 +746,7 @@ void Response::set_status_message(const std::string &status_message) {
 }
 void Response::set_headers(const Headers &headers) { this->headers = headers; }
 void Response::set_header(const std::string &key, const std::string &value) {
-    headers[key] = value;
+    headers.set(key, value);
 }
 void Response::set_body(const std::string &body) { this->body = body; }
 
@@ -213,7 +754,7 @@ std::string Response::to_string() const {
     std::string response_str = fmt::format("{} {} {}\r\n", version, status_code, status_message);
 
     for (auto &header : headers) {
-        response_str += fmt::format("{}: {}\r\n", header.first, header.second);
+        response_str += fmt::format("{}: {}\r\n", header.name, header.value);
     }
 
     response_str += fmt::format("\r\n{}", body);
@@ -221,20 +762,270 @@ std::string Response::to_string() const {
     return response_str;
 }
 
-HTTPHandler::HTTPHandler() : stream(nullptr) {}
-HTTPHandler::HTTPHandler(TCPStream *stream) : stream(stream) {}
+void ResponseWriter::push(Source source, const char *data, size_t offset, size_t length) {
+    // Heads and bodies go to separate buffers and each response becomes a head segment followed
+    // by a body segment, so a body is never copied after it was rendered. Segments hold offsets
+    // because the buffers may grow while responses to pipelined requests accumulate.
+    if (length == 0) {
+        return;
+    }
+    pending += length;
+    if (segments.size() > first) {
+        Segment &last = segments.back();
+        if (last.source == source && source != Source::External &&
+            last.offset + last.length == offset) {
+            last.length += length;
+            return;
+        }
+    }
+    segments.push_back({source, data, offset, length});
+}
+
+ResponseWriter::ResponseWriter(std::pmr::memory_resource *resource)
+    : heads(resource), bodies(resource), segments(resource), iovecs(resource), owners(resource) {}
+
+void ResponseWriter::start(StatusCode status) {
+    head_start = heads.size();
+    body_start = bodies.size();
+    heads.append(status_line(status));
+}
+
+void ResponseWriter::header(std::string_view name, std::string_view value) {
+    heads.append(name);
+    heads.append(": ");
+    heads.append(value);
+    heads.append("\r\n");
+}
+
+void ResponseWriter::header(std::string_view name, uint64_t value) {
+    char digits[20];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    header(name, std::string_view(digits, result.ptr - digits));
+}
+
+void ResponseWriter::header(HeaderId id, std::string_view value) { header(header_name(id), value); }
+
+void ResponseWriter::header(HeaderId id, uint64_t value) { header(header_name(id), value); }
+
+std::pmr::string &ResponseWriter::body() { return bodies; }
+
+void ResponseWriter::end_head(size_t content_length, bool keep_alive) {
+    header(HeaderId::ContentLength, static_cast<uint64_t>(content_length));
+    heads.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    push(Source::Head, nullptr, head_start, heads.size() - head_start);
+}
+
+void ResponseWriter::finish(bool keep_alive) {
+    size_t length = bodies.size() - body_start;
+    end_head(length, keep_alive);
+    if (head_only) {
+        bodies.resize(body_start);
+        return;
+    }
+    push(Source::Body, nullptr, body_start, length);
+}
+
+void ResponseWriter::finish(std::string_view body, bool keep_alive) {
+    // The body is referenced in place and must outlive the send.
+    end_head(body.size(), keep_alive);
+    if (!head_only) {
+        push(Source::External, body.data(), 0, body.size());
+    }
+}
+
+void ResponseWriter::finish_head(size_t content_length, bool keep_alive) {
+    // The caller sends the body (a file), or none is sent.
+    end_head(content_length, keep_alive);
+}
+
+void ResponseWriter::finish_serialized(std::string_view head, std::string_view body,
+                                       bool keep_alive, std::shared_ptr<const void> owner) {
+    // Head and body of a ResponseCache entry are sent in place while `owner` keeps them alive.
+    static constexpr std::string_view KEEP_ALIVE = "Connection: keep-alive\r\n\r\n";
+    static constexpr std::string_view CLOSE = "Connection: close\r\n\r\n";
+    std::string_view connection = keep_alive ? KEEP_ALIVE : CLOSE;
+    push(Source::External, head.data(), 0, head.size());
+    push(Source::External, connection.data(), 0, connection.size());
+    if (!head_only) {
+        push(Source::External, body.data(), 0, body.size());
+    }
+    owners.push_back(std::move(owner));
+}
+
+void ResponseWriter::error(StatusCode status, bool keep_alive) {
+    start(status);
+    header(HeaderId::ContentType, "text/html");
+    fmt::format_to(std::back_inserter(bodies), "<html><body><h1>{} {}</h1></body></html>",
+                   static_cast<int>(status), reason_phrase(status));
+    finish(keep_alive);
+}
+
+void ResponseWriter::set_head_only(bool head_only) { this->head_only = head_only; }
+
+bool ResponseWriter::get_head_only() const { return head_only; }
+
+void ResponseWriter::finish_stream(BodyStream &body, bool chunked, bool keep_alive) {
+    // HTTP/1.0 clients do not understand chunked coding: without it the body ends when the
+    // connection closes, so the caller passes keep_alive false.
+    body.chunked = chunked;
+    if (chunked) {
+        header(HeaderId::TransferEncoding, "chunked");
+    }
+    heads.append(keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    push(Source::Head, nullptr, head_start, heads.size() - head_start);
+}
+
+bool ResponseWriter::write_chunk(BodyStream &body, size_t limit) {
+    size_t start = bodies.size();
+    if (!body.chunked) {
+        bool more = body.read(bodies, limit);
+        push(Source::Body, nullptr, start, bodies.size() - start);
+        return more;
+    }
+    // The size line is reserved at a fixed width and filled in once the data was appended after
+    // it, so the stream writes straight into the body buffer. Leading zeros are valid chunk-size.
+    bodies.append(CHUNK_SIZE_DIGITS, '0');
+    bodies.append("\r\n");
+    bool more = body.read(bodies, limit);
+    size_t length = bodies.size() - start - CHUNK_SIZE_DIGITS - 2;
+    if (length == 0) {
+        // An empty chunk would end the body early.
+        bodies.resize(start);
+    } else {
+        fmt::format_to_n(&bodies[start], CHUNK_SIZE_DIGITS, "{:08x}", length);
+        bodies.append("\r\n");
+    }
+    if (!more) {
+        bodies.append("0\r\n\r\n");
+    }
+    push(Source::Body, nullptr, start, bodies.size() - start);
+    return more;
+}
+
+ResponseWriter::Mark ResponseWriter::mark() const {
+    // rollback() to it discards what was written since, e.g. a response whose handler failed
+    // halfway.
+    size_t last_length = segments.size() > first ? segments.back().length : 0;
+    return {heads.size(), bodies.size(), segments.size(), last_length, owners.size(), pending};
+}
+
+void ResponseWriter::rollback(const Mark &mark) {
+    heads.resize(mark.heads);
+    bodies.resize(mark.bodies);
+    segments.resize(mark.segments);
+    if (segments.size() > first) {
+        segments.back().length = mark.last_length;
+    }
+    owners.resize(mark.owners);
+    pending = mark.pending;
+    head_start = heads.size();
+    body_start = bodies.size();
+}
+
+size_t ResponseWriter::size() const { return pending; }
+
+bool ResponseWriter::empty() const { return pending == 0; }
+
+const iovec *ResponseWriter::data(size_t &count) {
+    // Everything queued, e.g. the responses to pipelined requests, leaves in one sendmsg().
+    iovecs.clear();
+    size_t last = std::min(segments.size(), first + IOV_MAX);
+    for (size_t i = first; i < last; ++i) {
+        const Segment &segment = segments[i];
+        const char *base = segment.source == Source::Head   ? heads.data()
+                           : segment.source == Source::Body ? bodies.data()
+                                                            : segment.data;
+        iovecs.push_back({const_cast<char *>(base + segment.offset), segment.length});
+    }
+    count = iovecs.size();
+    return iovecs.data();
+}
+
+void ResponseWriter::consume(size_t n) {
+    pending -= n;
+    while (n > 0) {
+        Segment &segment = segments[first];
+        size_t taken = std::min(n, segment.length);
+        segment.offset += taken;
+        segment.length -= taken;
+        n -= taken;
+        if (segment.length == 0) {
+            ++first;
+        }
+    }
+    if (pending == 0) {
+        clear();
+    }
+}
+
+void ResponseWriter::copy_to(std::string &output) const {
+    for (size_t i = first; i < segments.size(); ++i) {
+        const Segment &segment = segments[i];
+        const char *base = segment.source == Source::Head   ? heads.data()
+                           : segment.source == Source::Body ? bodies.data()
+                                                            : segment.data;
+        output.append(base + segment.offset, segment.length);
+    }
+}
+
+void ResponseWriter::clear() {
+    // The buffers keep their capacity: a connection that keeps one writer stops allocating once
+    // they have grown to its largest batch of responses.
+    heads.clear();
+    bodies.clear();
+    segments.clear();
+    owners.clear();
+    head_start = body_start = first = pending = 0;
+}
+
+void ResponseWriter::release() {
+    // Hands the memory back to the resource, e.g. the connection's Arena, while nothing is queued.
+    clear();
+    mpmc::release(heads);
+    mpmc::release(bodies);
+    mpmc::release(segments);
+    mpmc::release(iovecs);
+    mpmc::release(owners);
+}
+
+bool ResponseWriter::send(int fd) {
+    while (pending > 0) {
+        msghdr message = {};
+        size_t count;
+        message.msg_iov = const_cast<iovec *>(data(count));
+        message.msg_iovlen = count;
+        ssize_t n = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (n >= 0) {
+            consume(n);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+HTTPHandler::HTTPHandler() : stream(nullptr), router(nullptr) {}
+HTTPHandler::HTTPHandler(TCPStream *stream, const Router *router, const HandlerOptions &options)
+    : stream(stream), router(router), options(options) {}
 HTTPHandler::~HTTPHandler() {
     if (stream != nullptr) {
         delete stream;
     }
 }
-HTTPHandler::HTTPHandler(HTTPHandler &&other) : stream(other.stream) { other.stream = nullptr; }
+HTTPHandler::HTTPHandler(HTTPHandler &&other)
+    : stream(other.stream), router(other.router), options(other.options) {
+    other.stream = nullptr;
+}
 
 HTTPHandler &HTTPHandler::operator=(HTTPHandler &&other) {
     if(stream != nullptr) {
         delete stream;
     }
     stream = other.stream;
+    router = other.router;
+    options = other.options;
     other.stream = nullptr;
     return *this;
 }
@@ -273,24 +1064,71 @@ std::string rtrim(const std::string &s) {
     return std::string(s.begin(), wsback);
 }
 
-void HTTPHandler::operator()(Worker<HTTPHandler> *worker) {
+void HTTPHandler::operator()(Worker<HTTPHandler> *) {
+    std::string input;
     char buffer[BUFFER_SIZE];
-    int n = stream->read(buffer, BUFFER_SIZE);
-
-    std::string request_str(buffer, n);
-    Request request(request_str);
-
-    fmt::print("Worker {} received request: \n{}\n", worker->get_id(), request.to_string());
-
-    Response response;
-
-    std::string response_body("<html><body><h1>Hello World</h1></body></html>");
-
-    response.set_header("Content-Type", "text/html");
-    response.set_header("Content-Length", std::to_string(response_body.size()));
-    response.set_body(response_body);
-
-    stream->write(response.to_string());
+    RequestParser parser(options.header_limit, options.body_limit);
+    ResponseWriter writer;
+    bool keep_alive = true;
+    try {
+        stream->set_read_timeout(options.idle_timeout);
+        while (keep_alive) {
+            int n = stream->read(buffer, BUFFER_SIZE);
+            if (n == 0) {
+                break;
+            }
+            input.append(buffer, n);
+
+            size_t consumed = 0;
+            while (keep_alive) {
+                auto result = parser.parse(input.data() + consumed, input.size() - consumed);
+                if (result == RequestParser::Result::NeedMore) {
+                    // A large body is received into one allocation.
+                    input.reserve(consumed + parser.expected_length());
+                    break;
+                }
+                if (result == RequestParser::Result::Error) {
+                    writer.error(parser.error());
+                    keep_alive = false;
+                    break;
+                }
+                RequestView request = parser.view(input.data() + consumed);
+                keep_alive = request.keep_alive();
+
+                RouteContext context(request, writer, keep_alive);
+                if (router != nullptr) {
+                    router->dispatch(context);
+                } else {
+                    writer.error(StatusCode::NotFound, keep_alive);
+                }
+                keep_alive = context.keep_alive;
+                if (context.file.file) {
+                    stream->write(writer);
+                    stream->send_file(context.file.file->fd, context.file.offset,
+                                      context.file.length);
+                }
+                if (context.stream) {
+                    // The blocking writes pace the producer.
+                    bool more = true;
+                    while (more) {
+                        more = writer.write_chunk(*context.stream, STREAM_CHUNK);
+                        stream->write(writer);
+                    }
+                }
+                // The view points into `input`, which is only advanced past the request now.
+                consumed += parser.length();
+                parser.reset();
+            }
+            input.erase(0, consumed);
+            // All pipelined responses of this read go out together.
+            stream->write(writer);
+        }
+    } catch (std::exception &e) {
+        // Idle keep-alive timeout or a broken connection.
+    }
+    // Close now rather than when the worker's next job replaces this handler.
+    delete stream;
+    stream = nullptr;
 }
 
 } // namespace mpmc
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include "offload.h"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace mpmc {
+
+namespace evtlp {
+
+OffloadQueue::OffloadQueue() {
+    fd = eventfd(0, EFD_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error(
+            fmt::format("Failed to create eventfd, error: {}", strerror(errno)));
+    }
+}
+
+OffloadQueue::~OffloadQueue() { close(fd); }
+
+int OffloadQueue::get_fd() const { return fd; }
+
+void OffloadQueue::push(OffloadResult result) {
+    bool first;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        first = results.empty();
+        results.push_back(std::move(result));
+    }
+    if (first) {
+        // Later results until the next take() ride on this wakeup.
+        uint64_t one = 1;
+        ::write(fd, &one, sizeof(one));
+    }
+}
+
+void OffloadQueue::take(std::vector<OffloadResult> &output) {
+    output.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    output.swap(results);
+}
+
+/**
+ * @brief Pool task answering one offloaded request. Destroyed without having run, it answers
+ * with 503 so the connection is not left waiting.
+ *
+ * Small enough for the inline storage of a Task: the copy of the request is the only allocation.
+ */
+class OffloadJob {
+  private:
+    const Router *router;
+    std::shared_ptr<OffloadQueue> queue;
+    uint64_t token;
+    std::unique_ptr<char[]> request;
+    uint32_t length;
+    bool keep_alive;
+
+    void fail(StatusCode status) {
+        ResponseWriter writer;
+        writer.error(status);
+        OffloadResult result;
+        result.token = token;
+        writer.copy_to(result.response);
+        queue->push(std::move(result));
+    }
+
+  public:
+    OffloadJob(const Router *router, std::shared_ptr<OffloadQueue> queue, uint64_t token,
+               std::string_view request, bool keep_alive)
+        : router(router), queue(std::move(queue)), token(token),
+          request(new char[request.size()]), length(static_cast<uint32_t>(request.size())),
+          keep_alive(keep_alive) {
+        memcpy(this->request.get(), request.data(), length);
+    }
+    OffloadJob(OffloadJob &&other) noexcept = default;
+    OffloadJob(const OffloadJob &other) = delete;
+    OffloadJob &operator=(const OffloadJob &other) = delete;
+
+    ~OffloadJob() {
+        if (queue != nullptr) {
+            fail(StatusCode::ServiceUnavailable);
+        }
+    }
+
+    void operator()() {
+        // The loop already parsed the request within its limits.
+        RequestParser parser(length, length);
+        parser.parse(request.get(), length);
+        RequestView view = parser.view(request.get());
+        ResponseWriter writer;
+        OffloadResult result;
+        result.token = token;
+        try {
+            RouteContext context(view, writer, keep_alive);
+            router->dispatch(context);
+            result.keep_alive = context.keep_alive;
+            result.file = std::move(context.file);
+            result.stream = std::move(context.stream);
+        } catch (std::exception &e) {
+            std::cerr << e.what() << "\n";
+            fail(StatusCode::InternalServerError);
+            queue.reset();
+            return;
+        }
+        writer.copy_to(result.response);
+        std::shared_ptr<OffloadQueue> done = std::move(queue);
+        done->push(std::move(result));
+    }
+};
+
+static_assert(sizeof(OffloadJob) <= Task::INLINE_SIZE, "OffloadJob no longer fits in a Task");
+
+void offload(TaskPool &pool, const Router &router, const std::shared_ptr<OffloadQueue> &queue,
+             uint64_t token, std::string_view request, bool keep_alive) {
+    // Waiting for room would stall every connection of the loop. A job the full pool refuses is
+    // destroyed unrun, which answers 503 through the queue like one the pool drops.
+    pool.try_post(OffloadJob(&router, queue, token, request, keep_alive));
+}
+
+} // namespace evtlp
+
+} // namespace mpmc
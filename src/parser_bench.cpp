@@ -0,0 +1,118 @@
+#include "http_scanner.h"
+#include "network.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+using namespace mpmc;
+
+/**
+ * @brief Microbenchmark of request parsing on browser-sized requests: the split()-based parsing
+ * Request used before RequestParser, against RequestParser with each scanner implementation the
+ * CPU supports.
+ *
+ * ./parser_bench [iterations]
+ */
+
+/**
+ * @brief The original split()-based Request parsing, kept here as the baseline.
+ */
+static size_t split_parse(const std::string &request_str) {
+    auto body_pos = request_str.find("\r\n\r\n");
+    auto request_header = request_str.substr(0, body_pos);
+    std::string body;
+    if (body_pos != std::string::npos) {
+        body = request_str.substr(body_pos + 4);
+    }
+    auto lines = split(request_header, "\r\n");
+    auto request_line = split(lines[0], " ");
+    std::map<std::string, std::string> headers;
+    for (size_t i = 1; i < lines.size(); i++) {
+        auto header = split(lines[i], ": ");
+        headers[header[0]] = header[1];
+    }
+    return headers.size() + request_line.size();
+}
+
+static size_t parser_parse(RequestParser &parser, const std::string &request_str) {
+    parser.reset();
+    if (parser.parse(request_str.data(), request_str.size()) != RequestParser::Result::Complete) {
+        throw std::runtime_error("benchmark request failed to parse");
+    }
+    RequestView request = parser.view(request_str.data());
+    return request.get_header_count() + 3;
+}
+
+static std::string make_request(size_t target_size) {
+    static const char *browser_headers[] = {
+        "Host: www.example.com",
+        "Connection: keep-alive",
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+        "Chrome/124.0.0.0 Safari/537.36",
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,"
+        "*/*;q=0.8",
+        "Accept-Encoding: gzip, deflate, br, zstd",
+        "Accept-Language: en-US,en;q=0.9,de;q=0.8",
+        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"",
+        "sec-ch-ua-mobile: ?0",
+        "sec-ch-ua-platform: \"Linux\"",
+        "Sec-Fetch-Site: same-origin",
+        "Sec-Fetch-Mode: navigate",
+        "Sec-Fetch-Dest: document",
+        "Referer: https://www.example.com/products/category/shoes?page=2&sort=price",
+    };
+    std::string request = "GET /static/js/app.3f9c1a7e.js?v=20240611 HTTP/1.1\r\n";
+    for (const char *header : browser_headers) {
+        if (request.size() + strlen(header) + 4 > target_size) {
+            break;
+        }
+        request += fmt::format("{}\r\n", header);
+    }
+    // Cookies make up most of the variation in real header sizes.
+    std::string cookie = "Cookie: _ga=GA1.2.1234567890.1700000000";
+    while (request.size() + cookie.size() + 46 < target_size) {
+        cookie += fmt::format("; s{:02}=a8f3k29dk3l0x9w2e7r5t1y6u4i8o0p", cookie.size() % 100);
+    }
+    return request + cookie + "\r\n\r\n";
+}
+
+template <typename Parse> static double measure(int iterations, Parse parse) {
+    size_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        checksum += parse();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (checksum == 0) {
+        fmt::print("unexpected checksum\n");
+    }
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 200000;
+    ScannerIsa best = scanner_isa();
+    std::vector<ScannerIsa> isas = {ScannerIsa::Scalar};
+    if (best != ScannerIsa::Scalar) {
+        isas.push_back(ScannerIsa::SSE42);
+    }
+    if (best == ScannerIsa::AVX2) {
+        isas.push_back(ScannerIsa::AVX2);
+    }
+    fmt::print("{:>6} {:>8} {:>12} {:>10}\n", "bytes", "parser", "ns/request", "MB/s");
+    for (size_t size : {500, 1000, 1500, 2000}) {
+        std::string request = make_request(size);
+        double ns = measure(iterations, [&] { return split_parse(request); });
+        fmt::print("{:>6} {:>8} {:>12.1f} {:>10.1f}\n", request.size(), "split", ns,
+                   request.size() * 1e3 / ns);
+        RequestParser parser;
+        for (ScannerIsa isa : isas) {
+            set_scanner_isa(isa);
+            ns = measure(iterations, [&] { return parser_parse(parser, request); });
+            fmt::print("{:>6} {:>8} {:>12.1f} {:>10.1f}\n", request.size(), scanner_isa_name(isa),
+                       ns, request.size() * 1e3 / ns);
+        }
+        set_scanner_isa(best);
+    }
+}
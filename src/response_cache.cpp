@@ -0,0 +1,184 @@
+#include "response_cache.h"
+#include <mutex>
+#include <stdexcept>
+#include <time.h>
+
+namespace mpmc {
+
+static uint64_t monotonic_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t fnv1a(std::string_view data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+ResponseCache::ResponseCache(size_t capacity, int ttl_ms, std::vector<std::string> vary,
+                             size_t shards)
+    : vary(std::move(vary)), ttl_ms(ttl_ms), shard_count(shards) {
+    if (capacity == 0 || ttl_ms <= 0 || shards == 0) {
+        throw std::runtime_error("capacity, ttl_ms and shards must be greater than 0");
+    }
+    shard_capacity = capacity / shards;
+    this->shards = std::make_unique<Shard[]>(shards);
+    for (auto &name : this->vary) {
+        vary_ids.push_back(header_id(name));
+        vary_header += vary_header.empty() ? name : ", " + name;
+    }
+}
+
+bool ResponseCache::cacheable(const RequestView &request) const {
+    std::string_view method = request.get_method();
+    return (method == "GET" || method == "HEAD") && request.get_body().empty();
+}
+
+void ResponseCache::make_key(const RequestView &request, std::string &key) const {
+    key.assign(request.get_method());
+    key += ' ';
+    key += request.get_path();
+    // Header values cannot contain a line feed, so the parts cannot run into each other.
+    for (size_t i = 0; i < vary.size(); ++i) {
+        key += '\n';
+        key += vary_ids[i] != HeaderId::Unknown ? request.get_header(vary_ids[i])
+                                                : request.get_header(vary[i]);
+    }
+}
+
+ResponseCache::Shard &ResponseCache::shard_for(const std::string &key) {
+    return shards[std::hash<std::string>()(key) % shard_count];
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::lookup(const RequestView &request) {
+    static thread_local std::string key;
+    make_key(request, key);
+    Shard &shard = shard_for(key);
+    std::shared_ptr<const CachedResponse> entry;
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            entry = shard.slots[it->second];
+        }
+    }
+    if (entry == nullptr || entry->expires_ms <= monotonic_ms()) {
+        shard.misses.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    entry->referenced.store(true, std::memory_order_relaxed);
+    shard.hits.fetch_add(1, std::memory_order_relaxed);
+    return entry;
+}
+
+void ResponseCache::evict_one(Shard &shard, uint64_t now) {
+    while (true) {
+        if (shard.hand >= shard.slots.size()) {
+            shard.hand = 0;
+        }
+        size_t slot = shard.hand++;
+        const std::shared_ptr<const CachedResponse> &entry = shard.slots[slot];
+        if (entry == nullptr) {
+            continue;
+        }
+        // Referenced entries get another round unless they expired anyway.
+        if (entry->expires_ms > now && entry->referenced.exchange(false)) {
+            continue;
+        }
+        shard.bytes -= entry->charge;
+        shard.index.erase(entry->key);
+        shard.slots[slot] = nullptr;
+        shard.free_slots.push_back(slot);
+        shard.evictions.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+}
+
+std::shared_ptr<const CachedResponse> ResponseCache::store(const RequestView &request,
+                                                           StatusCode status,
+                                                           std::string_view content_type,
+                                                           std::string body) {
+    auto entry = std::make_shared<CachedResponse>();
+    make_key(request, entry->key);
+    entry->etag = fmt::format("\"{:016x}\"", fnv1a(body));
+    auto head = std::back_inserter(entry->head);
+    entry->head = status_line(status);
+    fmt::format_to(head, "Content-Type: {}\r\nETag: {}\r\n", content_type, entry->etag);
+    if (!vary_header.empty()) {
+        fmt::format_to(head, "Vary: {}\r\n", vary_header);
+    }
+    fmt::format_to(head, "Content-Length: {}\r\n", body.size());
+    entry->body = std::move(body);
+    uint64_t now = monotonic_ms();
+    entry->expires_ms = now + ttl_ms;
+    entry->charge = sizeof(CachedResponse) + entry->key.size() + entry->head.size() +
+                    entry->body.size() + entry->etag.size();
+    entry->referenced.store(false, std::memory_order_relaxed);
+    if (entry->charge > shard_capacity) {
+        return entry;
+    }
+    Shard &shard = shard_for(entry->key);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.index.find(entry->key);
+    if (it != shard.index.end()) {
+        // Expired, or stored concurrently by another thread: the newer one replaces it.
+        shard.bytes -= shard.slots[it->second]->charge;
+        shard.slots[it->second] = nullptr;
+        shard.free_slots.push_back(it->second);
+        shard.index.erase(it);
+    }
+    while (shard.bytes + entry->charge > shard_capacity) {
+        evict_one(shard, now);
+    }
+    size_t slot;
+    if (shard.free_slots.empty()) {
+        slot = shard.slots.size();
+        shard.slots.emplace_back();
+    } else {
+        slot = shard.free_slots.back();
+        shard.free_slots.pop_back();
+    }
+    shard.slots[slot] = entry;
+    shard.index.emplace(entry->key, slot);
+    shard.bytes += entry->charge;
+    return entry;
+}
+
+void ResponseCache::serve(std::shared_ptr<const CachedResponse> entry,
+                          const RequestView &request, bool keep_alive,
+                          ResponseWriter &writer) const {
+    std::string_view if_none_match = request.get_header(HeaderId::IfNoneMatch);
+    if (!if_none_match.empty() &&
+        (if_none_match == "*" || if_none_match.find(entry->etag) != std::string_view::npos)) {
+        writer.start(StatusCode::NotModified);
+        writer.header(HeaderId::ETag, entry->etag);
+        if (!vary_header.empty()) {
+            writer.header(HeaderId::Vary, vary_header);
+        }
+        writer.finish_head(entry->body.size(), keep_alive);
+        return;
+    }
+    std::string_view head = entry->head;
+    std::string_view body = request.get_method() == "HEAD" ? std::string_view() : entry->body;
+    writer.finish_serialized(head, body, keep_alive, std::move(entry));
+}
+
+CacheStats ResponseCache::get_stats() {
+    CacheStats stats = {};
+    for (size_t i = 0; i < shard_count; ++i) {
+        Shard &shard = shards[i];
+        stats.hits += shard.hits.load(std::memory_order_relaxed);
+        stats.misses += shard.misses.load(std::memory_order_relaxed);
+        stats.evictions += shard.evictions.load(std::memory_order_relaxed);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        stats.entries += shard.index.size();
+        stats.bytes += shard.bytes;
+    }
+    return stats;
+}
+
+} // namespace mpmc
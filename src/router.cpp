@@ -0,0 +1,215 @@
+#include "router.h"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+namespace mpmc {
+
+void PathParams::push(std::string_view name, std::string_view value) {
+    params[count++] = {name, value};
+}
+
+void PathParams::pop() { --count; }
+
+std::string_view PathParams::get(std::string_view name) const {
+    for (size_t i = 0; i < count; ++i) {
+        if (params[i].name == name) {
+            return params[i].value;
+        }
+    }
+    return std::string_view();
+}
+
+const PathParams::Param &PathParams::operator[](size_t index) const { return params[index]; }
+
+size_t PathParams::size() const { return count; }
+
+Router::Node *Router::insert(std::string_view pattern) {
+    Node *node = &root;
+    size_t params = 0;
+    while (!pattern.empty()) {
+        if (pattern[0] == ':' || pattern[0] == '*') {
+            bool wildcard = pattern[0] == '*';
+            size_t end = wildcard ? pattern.size() : std::min(pattern.find('/'), pattern.size());
+            std::string_view name = pattern.substr(1, end - 1);
+            if (name.empty() || name.find_first_of(wildcard ? ":*/" : ":*") != name.npos) {
+                throw std::runtime_error(fmt::format("Invalid placeholder in route: {}", pattern));
+            }
+            if (++params > PathParams::CAPACITY) {
+                throw std::runtime_error(
+                    fmt::format("More than {} placeholders in route", PathParams::CAPACITY));
+            }
+            std::unique_ptr<Node> &child = wildcard ? node->wildcard : node->param;
+            if (child == nullptr) {
+                child = std::make_unique<Node>();
+                child->name = name;
+            } else if (child->name != name) {
+                throw std::runtime_error(fmt::format(
+                    "Route placeholder {} conflicts with {} at the same position", name,
+                    child->name));
+            }
+            node = child.get();
+            pattern.remove_prefix(end);
+            continue;
+        }
+        std::string_view literal = pattern.substr(0, pattern.find_first_of(":*"));
+        size_t index = node->indices.find(literal[0]);
+        if (index == std::string::npos) {
+            node->indices += literal[0];
+            node->children.push_back(std::make_unique<Node>());
+            node = node->children.back().get();
+            node->prefix = literal;
+            pattern.remove_prefix(literal.size());
+            continue;
+        }
+        Node *child = node->children[index].get();
+        size_t common = std::mismatch(literal.begin(), literal.end(), child->prefix.begin(),
+                                      child->prefix.end())
+                            .first -
+                        literal.begin();
+        if (common < child->prefix.size()) {
+            // Split the edge: the shared part becomes a node of its own above the rest.
+            auto split = std::make_unique<Node>();
+            split->prefix = child->prefix.substr(0, common);
+            child->prefix.erase(0, common);
+            split->indices += child->prefix[0];
+            split->children.push_back(std::move(node->children[index]));
+            node->children[index] = std::move(split);
+            child = node->children[index].get();
+        }
+        node = child;
+        pattern.remove_prefix(common);
+    }
+    return node;
+}
+
+void Router::add(std::string_view method, std::string_view pattern, RouteHandler handler) {
+    add_route(method, pattern, std::move(handler), false);
+}
+
+void Router::offload(std::string_view method, std::string_view pattern, RouteHandler handler) {
+    // For handlers that block or burn CPU: loops given a TaskPool run them on a pool worker, every
+    // other caller in place like any route.
+    add_route(method, pattern, std::move(handler), true);
+}
+
+void Router::add_route(std::string_view method, std::string_view pattern, RouteHandler handler,
+                       bool offload) {
+    // Not thread-safe: routes are set up before dispatch() runs on the loops and workers.
+    if (pattern.empty() || pattern[0] != '/') {
+        throw std::runtime_error(fmt::format("Route must start with '/': {}", pattern));
+    }
+    Node *node = insert(pattern);
+    for (auto &route : node->routes) {
+        if (route.method == method) {
+            throw std::runtime_error(fmt::format("Route {} {} is already added", method, pattern));
+        }
+    }
+    node->routes.push_back({std::string(method), std::move(handler), offload});
+    // Built once here, so a 405 does not allocate.
+    node->allow.clear();
+    bool get = false;
+    bool head = false;
+    for (auto &route : node->routes) {
+        node->allow += node->allow.empty() ? route.method : ", " + route.method;
+        get |= route.method == "GET";
+        head |= route.method == "HEAD";
+    }
+    if (get && !head) {
+        node->allow += ", HEAD";
+    }
+}
+
+const Router::Node *Router::match(const Node &node, std::string_view path,
+                                  PathParams &params) const {
+    // Literal edges before parameters before wildcards; the walk only backs up when a literal
+    // edge leads nowhere. Parameters are the raw, still percent-encoded path bytes.
+    if (path.empty() && !node.routes.empty()) {
+        return &node;
+    }
+    if (!path.empty()) {
+        size_t index = node.indices.find(path[0]);
+        if (index != std::string::npos) {
+            const Node &child = *node.children[index];
+            if (path.compare(0, child.prefix.size(), child.prefix) == 0) {
+                if (const Node *found = match(child, path.substr(child.prefix.size()), params)) {
+                    return found;
+                }
+            }
+        }
+        size_t end = std::min(path.find('/'), path.size());
+        if (node.param != nullptr && end > 0) {
+            params.push(node.param->name, path.substr(0, end));
+            if (const Node *found = match(*node.param, path.substr(end), params)) {
+                return found;
+            }
+            params.pop();
+        }
+    }
+    if (node.wildcard != nullptr && !node.wildcard->routes.empty()) {
+        params.push(node.wildcard->name, path);
+        return node.wildcard.get();
+    }
+    return nullptr;
+}
+
+void Router::route(RouteContext &context) const {
+    // The query string is not part of the path.
+    std::string_view path = context.request.get_path();
+    path = path.substr(0, path.find('?'));
+    const Node *node = match(root, path, context.params);
+    if (node == nullptr) {
+        context.writer.error(StatusCode::NotFound, context.keep_alive);
+        return;
+    }
+    std::string_view method = context.request.get_method();
+    const Route *found = nullptr;
+    for (auto &route : node->routes) {
+        if (route.method == method) {
+            found = &route;
+            break;
+        }
+        // HEAD falls back to GET unless the route has a HEAD handler of its own.
+        if (route.method == "GET" && method == "HEAD") {
+            found = &route;
+        }
+    }
+    if (found == nullptr) {
+        context.writer.start(StatusCode::MethodNotAllowed);
+        context.writer.header(HeaderId::Allow, node->allow);
+        context.writer.finish(context.keep_alive);
+        return;
+    }
+    if (found->offload && context.can_offload) {
+        context.offloaded = true;
+        return;
+    }
+    found->handler(context);
+}
+
+void Router::dispatch(RouteContext &context) const {
+    // A HEAD response ends with its head, whichever way the route wrote the body.
+    bool head = context.request.get_method() == "HEAD";
+    ResponseWriter::Mark mark = context.writer.mark();
+    context.writer.set_head_only(head);
+    try {
+        route(context);
+    } catch (std::exception &e) {
+        // Whatever the handler wrote before it failed is replaced by a 500 that closes the
+        // connection, on every engine.
+        std::cerr << e.what() << "\n";
+        context.writer.rollback(mark);
+        context.writer.error(StatusCode::InternalServerError);
+        context.keep_alive = false;
+        context.offloaded = false;
+        context.file = FileResponse();
+        context.stream.reset();
+    }
+    context.writer.set_head_only(false);
+    if (head) {
+        context.file = FileResponse();
+        context.stream.reset();
+    }
+}
+
+} // namespace mpmc
@@ -0,0 +1,191 @@
+#include "server.h"
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+namespace mpmc {
+
+bool parse_engine(std::string_view name, Engine &engine) {
+    if (name == "threads") {
+        engine = Engine::ThreadPool;
+    } else if (name == "epoll") {
+        engine = Engine::Epoll;
+    } else if (name == "io_uring") {
+        engine = Engine::IoUring;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string_view engine_name(Engine engine) {
+    switch (engine) {
+    case Engine::ThreadPool:
+        return "threads";
+    case Engine::Epoll:
+        return "epoll";
+    case Engine::IoUring:
+        return "io_uring";
+    }
+    return "unknown";
+}
+
+Server::Server(const ServerConfig &config, const Router &router)
+    : config(config), router(router), stopped(false) {
+    if (config.addresses.empty()) {
+        throw std::runtime_error("addresses must not be empty");
+    }
+    if (config.threads < 0) {
+        throw std::runtime_error("threads must not be negative");
+    }
+    if (config.offload_threads < 0) {
+        throw std::runtime_error("offload_threads must not be negative");
+    }
+}
+
+Server::~Server() { stop(); }
+
+const ServerConfig &Server::get_config() const { return config; }
+
+void Server::start() {
+    if (config.engine != Engine::ThreadPool && config.offload_threads > 0) {
+        offload_pool = std::make_unique<TaskPool>(config.offload_threads);
+    }
+    switch (config.engine) {
+    case Engine::Epoll:
+        event_loop = std::make_unique<evtlp::EventLoop>(config.threads, config.edge_triggered);
+        event_loop->set_listen_options(config.listen);
+        event_loop->set_router(&router);
+        event_loop->set_task_pool(offload_pool.get());
+        event_loop->set_timeouts(config.idle_timeout, config.request_timeout);
+        event_loop->set_request_limits(config.header_limit, config.body_limit);
+        for (auto &address : config.addresses) {
+            event_loop->listen(address.first.c_str(), address.second);
+        }
+        break;
+    case Engine::IoUring:
+        rings = std::make_unique<evtlp::ShardedRingEventLoop>(std::max(config.threads, 1),
+                                                              config.pin_cpus, config.ring);
+        rings->set_listen_options(config.listen);
+        rings->set_router(&router);
+        rings->set_task_pool(offload_pool.get());
+        rings->set_request_limits(config.header_limit, config.body_limit);
+        // The rings bind their listeners when they start, on their own threads.
+        for (auto &address : config.addresses) {
+            rings->listen(address.first.c_str(), address.second);
+        }
+        break;
+    case Engine::ThreadPool:
+        for (auto &address : config.addresses) {
+            listeners.push_back(std::make_unique<TCPListener>(address.first.c_str(),
+                                                              address.second, config.listen));
+        }
+        break;
+    }
+}
+
+void Server::serve() {
+    switch (config.engine) {
+    case Engine::Epoll:
+        event_loop->run();
+        break;
+    case Engine::IoUring:
+        rings->run();
+        break;
+    case Engine::ThreadPool:
+        serve_thread_pool();
+        break;
+    }
+}
+
+void Server::serve_thread_pool() {
+    ThreadPool<HTTPHandler> pool(std::max(config.threads, 1),
+                                 Channel<HTTPHandler>::DEFAULT_CAPACITY, config.scheduling);
+    std::vector<std::thread> acceptors;
+    for (size_t i = 1; i < listeners.size(); ++i) {
+        acceptors.emplace_back([this, &pool, i] { accept_loop(*listeners[i], pool); });
+    }
+    accept_loop(*listeners[0], pool);
+    for (auto &acceptor : acceptors) {
+        acceptor.join();
+    }
+}
+
+void Server::accept_loop(TCPListener &listener, ThreadPool<HTTPHandler> &pool) {
+    HandlerOptions options;
+    options.idle_timeout = config.idle_timeout;
+    options.header_limit = config.header_limit;
+    options.body_limit = config.body_limit;
+    while (!stopped) {
+        TCPStream *stream;
+        try {
+            stream = new TCPStream(listener.accept());
+        } catch (std::system_error &e) {
+            if (stopped) {
+                break;
+            }
+            // Out of fds or an aborted connection, the listener is still usable. Out of fds the
+            // client stays in the backlog, and retrying at once would only fail again.
+            log_accept_error(e.code().value());
+            if (accept_exhausted(e.code().value())) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_BACKOFF_MS));
+            }
+            continue;
+        }
+        pool.submit(HTTPHandler(stream, &router, options));
+    }
+}
+
+void Server::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!stopped) {
+        try {
+            start();
+        } catch (...) {
+            event_loop.reset();
+            rings.reset();
+            offload_pool.reset();
+            listeners.clear();
+            throw;
+        }
+    }
+    std::exception_ptr error;
+    if (!stopped) {
+        // stop() takes the lock to reach the engine, serve() must not hold it.
+        lock.unlock();
+        try {
+            serve();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+    }
+    event_loop.reset();
+    rings.reset();
+    // After the loops: a request still running on it finishes, its result goes nowhere.
+    offload_pool.reset();
+    listeners.clear();
+    stopped = false;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void Server::stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+    if (event_loop != nullptr) {
+        event_loop->stop();
+    }
+    if (rings != nullptr) {
+        rings->stop();
+    }
+    for (auto &listener : listeners) {
+        listener->shutdown();
+    }
+}
+
+} // namespace mpmc
@@ -0,0 +1,263 @@
+#include "static_files.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace mpmc {
+
+static uint64_t monotonic_ms() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t mtime_ns(const struct stat &st) {
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+static std::string http_date(time_t time) {
+    tm gmt;
+    gmtime_r(&time, &gmt);
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+    return buffer;
+}
+
+static const char *content_type(const std::string &path) {
+    static const std::unordered_map<std::string, const char *> types = {
+        {"html", "text/html"},
+        {"htm", "text/html"},
+        {"css", "text/css"},
+        {"js", "text/javascript"},
+        {"json", "application/json"},
+        {"txt", "text/plain"},
+        {"xml", "application/xml"},
+        {"svg", "image/svg+xml"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"webp", "image/webp"},
+        {"ico", "image/x-icon"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"wasm", "application/wasm"},
+        {"pdf", "application/pdf"},
+    };
+    auto dot = path.rfind('.');
+    auto slash = path.rfind('/');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+        auto type = types.find(path.substr(dot + 1));
+        if (type != types.end()) {
+            return type->second;
+        }
+    }
+    return "application/octet-stream";
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+StaticFile::StaticFile(int fd) : fd(fd), size(0), inode(0), mtime_ns(0) {}
+
+StaticFile::~StaticFile() { close(fd); }
+
+StaticFiles::StaticFiles(const std::string &prefix, const std::string &root, size_t capacity)
+    : prefix(prefix), root(root), capacity(capacity) {
+    if (capacity == 0) {
+        throw std::runtime_error("capacity must be greater than 0");
+    }
+    signal(SIGPIPE, SIG_IGN);
+}
+
+bool StaticFiles::matches(std::string_view request_path) const {
+    return request_path.substr(0, prefix.size()) == prefix;
+}
+
+size_t StaticFiles::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+bool StaticFiles::resolve(std::string_view request_path, std::string &path) const {
+    size_t end = std::min(request_path.find_first_of("?#"), request_path.size());
+    path.assign(root);
+    path += '/';
+    size_t relative = path.size();
+    for (size_t i = prefix.size(); i < end; ++i) {
+        char c = request_path[i];
+        if (c == '%' && i + 2 < end && hex_value(request_path[i + 1]) >= 0 &&
+            hex_value(request_path[i + 2]) >= 0) {
+            c = static_cast<char>(hex_value(request_path[i + 1]) * 16 +
+                                  hex_value(request_path[i + 2]));
+            i += 2;
+        }
+        if (c == '\0') {
+            return false;
+        }
+        path += c;
+    }
+    // Decoded before the check, so "%2e%2e" cannot climb out of root either.
+    for (size_t begin = relative; begin <= path.size();) {
+        size_t end = std::min(path.find('/', begin), path.size());
+        if (end - begin == 2 && path.compare(begin, 2, "..") == 0) {
+            return false;
+        }
+        begin = end + 1;
+    }
+    if (path.size() == relative || path.back() == '/') {
+        path += "index.html";
+    }
+    return true;
+}
+
+std::shared_ptr<const StaticFile> StaticFiles::open(const std::string &path,
+                                                   StatusCode &status) {
+    // O_NONBLOCK: a FIFO without a writer would otherwise block the loop in open(). It has no
+    // effect on the regular files that are served.
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+    if (fd == -1) {
+        status = errno == EACCES ? StatusCode::Forbidden : StatusCode::NotFound;
+        return nullptr;
+    }
+    auto file = std::make_shared<StaticFile>(fd);
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        status = StatusCode::NotFound;
+        return nullptr;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        // A directory is redirected to its index, FIFOs, devices and sockets are not served.
+        status = S_ISDIR(st.st_mode) ? StatusCode::MovedPermanently : StatusCode::NotFound;
+        return nullptr;
+    }
+    file->size = st.st_size;
+    file->inode = st.st_ino;
+    file->mtime_ns = mtime_ns(st);
+    file->content_type = content_type(path);
+    file->etag = fmt::format("\"{:x}-{:x}\"", file->mtime_ns, file->size);
+    file->last_modified = http_date(st.st_mtim.tv_sec);
+    return file;
+}
+
+std::shared_ptr<const StaticFile> StaticFiles::lookup(const std::string &path,
+                                                     StatusCode &status) {
+    uint64_t now = monotonic_ms();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(path);
+        if (it != entries.end()) {
+            Entry &entry = it->second;
+            lru.splice(lru.begin(), lru, entry.lru);
+            if (now - entry.checked_ms < REVALIDATE_MS) {
+                return entry.file;
+            }
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0 && st.st_ino == entry.file->inode &&
+                static_cast<size_t>(st.st_size) == entry.file->size &&
+                mtime_ns(st) == entry.file->mtime_ns) {
+                entry.checked_ms = now;
+                return entry.file;
+            }
+            // Replaced, modified or removed: reopen.
+            lru.erase(entry.lru);
+            entries.erase(it);
+        }
+    }
+    std::shared_ptr<const StaticFile> file = open(path, status);
+    if (file == nullptr) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        // Opened concurrently by another thread, keep the newer one.
+        it->second.file = file;
+        it->second.checked_ms = now;
+        lru.splice(lru.begin(), lru, it->second.lru);
+        return file;
+    }
+    lru.push_front(path);
+    entries.insert({path, {file, now, lru.begin()}});
+    while (entries.size() > capacity) {
+        entries.erase(lru.back());
+        lru.pop_back();
+    }
+    return file;
+}
+
+FileResponse StaticFiles::serve(const RequestView &request, bool keep_alive,
+                                ResponseWriter &writer) {
+    static thread_local std::string path;
+    FileResponse result;
+    std::string_view method = request.get_method();
+    std::shared_ptr<const StaticFile> file;
+    StatusCode status = StatusCode::OK;
+    if (method != "GET" && method != "HEAD") {
+        status = StatusCode::MethodNotAllowed;
+    } else if (!resolve(request.get_path(), path)) {
+        status = StatusCode::Forbidden;
+    } else {
+        file = lookup(path, status);
+    }
+    if (status == StatusCode::MovedPermanently) {
+        // A directory without the trailing slash: relative links in its index.html only resolve
+        // below it once the client asks for the slashed path.
+        std::string_view target = request.get_path();
+        size_t query = std::min(target.find('?'), target.size());
+        std::string location(target.substr(0, query));
+        location += '/';
+        location += target.substr(query);
+        writer.start(StatusCode::MovedPermanently);
+        writer.header(HeaderId::Location, location);
+        writer.finish(keep_alive);
+        return result;
+    }
+    if (status == StatusCode::MethodNotAllowed) {
+        writer.start(status);
+        writer.header(HeaderId::Allow, "GET, HEAD");
+        writer.finish(keep_alive);
+        return result;
+    }
+    if (file == nullptr) {
+        bool head_only = writer.get_head_only();
+        writer.set_head_only(head_only || method == "HEAD");
+        writer.error(status, keep_alive);
+        writer.set_head_only(head_only);
+        return result;
+    }
+    std::string_view if_none_match = request.get_header(HeaderId::IfNoneMatch);
+    bool not_modified = if_none_match.empty()
+                            ? request.get_header(HeaderId::IfModifiedSince) == file->last_modified
+                            : if_none_match == "*" ||
+                                  if_none_match.find(file->etag) != std::string_view::npos;
+    writer.start(not_modified ? StatusCode::NotModified : StatusCode::OK);
+    writer.header(HeaderId::ETag, file->etag);
+    writer.header(HeaderId::LastModified, file->last_modified);
+    if (!not_modified) {
+        writer.header(HeaderId::ContentType, file->content_type);
+    }
+    writer.finish_head(file->size, keep_alive);
+    if (!not_modified && method == "GET" && file->size > 0) {
+        result.file = file;
+        result.length = file->size;
+    }
+    return result;
+}
+
+} // namespace mpmc
@@ -0,0 +1,39 @@
+#include "task_pool.h"
+
+namespace mpmc {
+
+Task::Task(Task &&other) noexcept : ops(other.ops) {
+    if (ops != nullptr) {
+        ops->relocate(other.storage, storage);
+        other.ops = nullptr;
+    }
+}
+
+Task &Task::operator=(Task &&other) noexcept {
+    if (this != &other) {
+        if (ops != nullptr) {
+            ops->destroy(storage);
+        }
+        ops = other.ops;
+        if (ops != nullptr) {
+            ops->relocate(other.storage, storage);
+            other.ops = nullptr;
+        }
+    }
+    return *this;
+}
+
+Task::~Task() {
+    if (ops != nullptr) {
+        ops->destroy(storage);
+    }
+}
+
+Task::operator bool() const { return ops != nullptr; }
+
+void Task::operator()(Worker<Task> *worker) { ops->invoke(storage, worker); }
+
+TaskPool::TaskPool(int num_workers, size_t capacity, Scheduling scheduling)
+    : pool(num_workers, capacity, scheduling) {}
+
+} // namespace mpmc
@@ -1,8 +1,62 @@
 #include "thread_pool.h"
+#include <cstdint>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 namespace mpmc {
 
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words are 32-bit");
+
+void futex_wait(std::atomic<uint32_t> &word, uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, expected, nullptr,
+            nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t> &word, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, count, nullptr,
+            nullptr, 0);
+}
+
+EventCount::EventCount() : epoch(0), waiting(0) {}
+
+uint32_t EventCount::prepare_wait() {
+    uint32_t key = epoch.load(std::memory_order_acquire);
+    waiting.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return key;
+}
+
+void EventCount::cancel_wait() { waiting.fetch_sub(1, std::memory_order_relaxed); }
+
+void EventCount::wait(uint32_t key) {
+    // Returns at once if a notify bumped the epoch since prepare_wait().
+    futex_wait(epoch, key);
+    waiting.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void EventCount::notify_one() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed) > 0) {
+        epoch.fetch_add(1, std::memory_order_release);
+        futex_wake(epoch, 1);
+    }
+}
+
+void EventCount::notify_n(int count) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (count > 0 && waiting.load(std::memory_order_relaxed) > 0) {
+        epoch.fetch_add(1, std::memory_order_release);
+        futex_wake(epoch, count);
+    }
+}
+
+void EventCount::notify_all() {
+    epoch.fetch_add(1, std::memory_order_release);
+    futex_wake(epoch, INT32_MAX);
+}
+
 Semaphore::Semaphore(int n) : count(n) {}
 Semaphore::~Semaphore() {}
 
-} // namespace mpmc
\ No newline at end of file
+} // namespace mpmc
@@ -0,0 +1,261 @@
+#include "timer_wheel.h"
+#include <cerrno>
+#include <cstring>
+#include <fmt/format.h>
+#include <stdexcept>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace mpmc {
+
+namespace evtlp {
+
+static uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+TimerWheel::TimerWheel(int tick_ms)
+    : nodes(FIRST_NODE), start_ns(monotonic_ns()), current(0), armed(UINT64_MAX), count(0),
+      tick_ms(tick_ms) {
+    if (tick_ms <= 0) {
+        throw std::runtime_error("tick_ms must be greater than 0");
+    }
+    // The first FIRST_NODE nodes are list sentinels: one per slot plus the expired list.
+    for (uint32_t i = 0; i < FIRST_NODE; ++i) {
+        nodes[i].prev = nodes[i].next = i;
+    }
+    memset(occupied, 0, sizeof(occupied));
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        throw std::runtime_error(fmt::format("Failed to create timer, error: {}", strerror(errno)));
+    }
+}
+
+TimerWheel::~TimerWheel() { close(timer_fd); }
+
+int TimerWheel::get_fd() const { return timer_fd; }
+
+size_t TimerWheel::size() const { return count; }
+
+uint64_t TimerWheel::now_tick() const {
+    return (monotonic_ns() - start_ns) / (static_cast<uint64_t>(tick_ms) * 1000000);
+}
+
+uint64_t TimerWheel::ticks(uint64_t ms) const {
+    uint64_t n = (ms + tick_ms - 1) / tick_ms;
+    return n > 0 ? n : 1;
+}
+
+void TimerWheel::link(uint32_t index, uint32_t slot) {
+    Node &sentinel = nodes[slot];
+    Node &node = nodes[index];
+    node.prev = sentinel.prev;
+    node.next = slot;
+    nodes[sentinel.prev].next = index;
+    sentinel.prev = index;
+    node.slot = slot;
+    if (slot < SLOTS) {
+        occupied[slot / 64] |= uint64_t(1) << (slot % 64);
+    }
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    Node &node = nodes[index];
+    nodes[node.prev].next = node.next;
+    nodes[node.next].prev = node.prev;
+    if (node.slot < SLOTS && nodes[node.slot].next == node.slot) {
+        occupied[node.slot / 64] &= ~(uint64_t(1) << (node.slot % 64));
+    }
+    node.prev = node.next = index;
+    node.slot = NONE;
+}
+
+void TimerWheel::place(uint32_t index) {
+    uint64_t expire = std::max(nodes[index].expire, current);
+    uint64_t delta = expire - current;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+        ++level;
+    }
+    if (level == LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * LEVELS))) {
+        expire = current + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+        nodes[index].expire = expire;
+    }
+    link(index, level * SLOTS + ((expire >> (SLOT_BITS * level)) & SLOT_MASK));
+}
+
+void TimerWheel::cascade(int level) {
+    uint32_t slot = level * SLOTS + ((current >> (SLOT_BITS * level)) & SLOT_MASK);
+    while (nodes[slot].next != slot) {
+        uint32_t index = nodes[slot].next;
+        unlink(index);
+        place(index);
+    }
+}
+
+void TimerWheel::run_tick() {
+    uint32_t index = current & SLOT_MASK;
+    // Entering a new lap of a level pulls the next slot of the level above down into it.
+    for (int level = 1; level < LEVELS; ++level) {
+        if (((current >> (SLOT_BITS * (level - 1))) & SLOT_MASK) != 0) {
+            break;
+        }
+        cascade(level);
+    }
+    uint64_t tick = current++;
+    while (nodes[index].next != index) {
+        uint32_t expired = nodes[index].next;
+        unlink(expired);
+        link(expired, EXPIRED);
+    }
+    while (nodes[EXPIRED].next != EXPIRED) {
+        uint32_t expired = nodes[EXPIRED].next;
+        unlink(expired);
+        uint32_t generation = nodes[expired].generation;
+        std::function<void()> callback = std::move(nodes[expired].callback);
+        if (nodes[expired].interval == 0) {
+            // One-shot timers are released first so the callback may reuse the node.
+            nodes[expired].generation++;
+            free_nodes.push_back(expired);
+            --count;
+            callback();
+            continue;
+        }
+        callback();
+        Node &node = nodes[expired];
+        if (node.generation != generation) {
+            continue; // cancelled by its own callback
+        }
+        node.callback = std::move(callback);
+        if (node.slot == NONE) {
+            node.expire = tick + node.interval;
+            place(expired);
+        }
+    }
+}
+
+void TimerWheel::arm(uint64_t tick) {
+    armed = tick;
+    itimerspec timer = {};
+    if (tick != UINT64_MAX) {
+        uint64_t ns = start_ns + tick * static_cast<uint64_t>(tick_ms) * 1000000;
+        timer.it_value.tv_sec = ns / 1000000000;
+        timer.it_value.tv_nsec = ns % 1000000000;
+        if (ns == 0) {
+            timer.it_value.tv_nsec = 1;
+        }
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) == -1) {
+        throw std::runtime_error(fmt::format("Failed to set timer, error: {}", strerror(errno)));
+    }
+}
+
+void TimerWheel::rearm() {
+    if (count == 0) {
+        arm(UINT64_MAX);
+        return;
+    }
+    uint32_t index = current & SLOT_MASK;
+    uint64_t next = current + (SLOTS - index);
+    for (uint32_t word = index / 64; word < SLOTS / 64; ++word) {
+        uint64_t bits = occupied[word];
+        if (word == index / 64) {
+            bits &= ~uint64_t(0) << (index % 64);
+        }
+        if (bits != 0) {
+            next = current + (word * 64 + __builtin_ctzll(bits) - index);
+            break;
+        }
+    }
+    arm(next);
+}
+
+TimerWheel::Node *TimerWheel::lookup(TimerId id) {
+    uint32_t index = id & 0xffffffff;
+    if (index < FIRST_NODE || index >= nodes.size() || nodes[index].generation != id >> 32) {
+        return nullptr;
+    }
+    return &nodes[index];
+}
+
+TimerId TimerWheel::add(uint64_t delay_ms, std::function<void()> callback, uint64_t interval_ms) {
+    uint64_t now = now_tick();
+    if (count == 0 && now > current) {
+        // Nothing is pending, skip the idle ticks instead of replaying them.
+        current = now;
+    }
+    uint32_t index;
+    if (free_nodes.empty()) {
+        index = nodes.size();
+        nodes.emplace_back();
+        nodes[index].prev = nodes[index].next = index;
+    } else {
+        index = free_nodes.back();
+        free_nodes.pop_back();
+    }
+    Node &node = nodes[index];
+    node.expire = std::max(now, current) + ticks(delay_ms);
+    node.interval = interval_ms > 0 ? ticks(interval_ms) : 0;
+    node.callback = std::move(callback);
+    place(index);
+    ++count;
+    if (node.expire < armed) {
+        arm(node.expire);
+    }
+    return (static_cast<uint64_t>(node.generation) << 32) | index;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+    Node *node = lookup(id);
+    if (node == nullptr) {
+        return false;
+    }
+    uint32_t index = id & 0xffffffff;
+    if (node->slot != NONE) {
+        unlink(index);
+    }
+    node->callback = nullptr;
+    node->generation++;
+    free_nodes.push_back(index);
+    --count;
+    return true;
+}
+
+bool TimerWheel::reschedule(TimerId id, uint64_t delay_ms) {
+    Node *node = lookup(id);
+    if (node == nullptr) {
+        return false;
+    }
+    uint32_t index = id & 0xffffffff;
+    if (node->slot != NONE) {
+        unlink(index);
+    }
+    node->expire = std::max(now_tick(), current) + ticks(delay_ms);
+    place(index);
+    if (nodes[index].expire < armed) {
+        arm(nodes[index].expire);
+    }
+    return true;
+}
+
+void TimerWheel::handle_expired() {
+    uint64_t expirations;
+    ::read(timer_fd, &expirations, sizeof(expirations));
+    armed = UINT64_MAX;
+    uint64_t now = now_tick();
+    while (current <= now) {
+        if (count == 0) {
+            current = now + 1;
+            break;
+        }
+        run_tick();
+    }
+    rearm();
+}
+
+} // namespace evtlp
+
+} // namespace mpmc